@@ -795,6 +795,20 @@ STEXI
 @item info rocker-of-dpa-groups @var{name} [@var{type}]
 @findex info rocker-of-dpa-groups
 Show rocker OF-DPA groups.
+ETEXI
+
+    {
+        .name       = "ptnet",
+        .args_type  = "name:s?",
+        .params     = "[name]",
+        .help       = "show netmap passthrough device statistics",
+        .cmd        = hmp_info_ptnet,
+    },
+
+STEXI
+@item info ptnet [@var{name}]
+@findex info ptnet
+Show the per-ring statistics of the netmap passthrough devices.
 ETEXI
 
 #if defined(TARGET_S390X)
@@ -2957,6 +2957,57 @@ void hmp_rocker_of_dpa_groups(Monitor *mon, const QDict *qdict)
     qapi_free_RockerOfDpaGroupList(list);
 }
 
+void hmp_info_ptnet(Monitor *mon, const QDict *qdict)
+{
+    const char *name = qdict_get_try_str(qdict, "name");
+    PtnetInfoList *list, *dev;
+    Error *err = NULL;
+
+    list = qmp_query_ptnet(!!name, name, &err);
+    if (err != NULL) {
+        hmp_handle_error(mon, &err);
+        return;
+    }
+
+    for (dev = list; dev; dev = dev->next) {
+        PtnetInfo *info = dev->value;
+        PtnetRingInfoList *ring;
+
+        monitor_printf(mon, "%s: sync-loop=%s", info->name,
+                       PtnetSyncLoop_str(info->sync_loop));
+        if (info->has_polls && info->has_sleeps) {
+            monitor_printf(mon, " polls=%" PRId64 " sleeps=%" PRId64,
+                           info->polls, info->sleeps);
+        }
+        monitor_printf(mon, "\n");
+
+        for (ring = info->rings; ring; ring = ring->next) {
+            PtnetRingInfo *r = ring->value;
+            intList *bucket;
+
+            monitor_printf(mon, "  %s%" PRId64 ": slots=%" PRId64
+                           " occupancy=%" PRId64,
+                           r->tx ? "tx" : "rx", r->index, r->slots,
+                           r->occupancy);
+            if (r->has_kicks && r->has_interrupts) {
+                monitor_printf(mon, " kicks=%" PRId64 " interrupts=%" PRId64,
+                               r->kicks, r->interrupts);
+            }
+            monitor_printf(mon, "\n");
+            if (r->has_kick_interval) {
+                monitor_printf(mon, "    kick-interval (log2 us):");
+                for (bucket = r->kick_interval; bucket;
+                     bucket = bucket->next) {
+                    monitor_printf(mon, " %" PRId64, bucket->value);
+                }
+                monitor_printf(mon, "\n");
+            }
+        }
+    }
+
+    qapi_free_PtnetInfoList(list);
+}
+
 void hmp_info_dump(Monitor *mon, const QDict *qdict)
 {
     DumpQueryResult *result = qmp_query_dump(NULL);
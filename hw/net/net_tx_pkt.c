@@ -45,6 +45,7 @@ struct NetTxPkt {
 
     uint8_t l2_hdr[ETH_MAX_L2_HDR_LEN];
     uint8_t l3_hdr[ETH_MAX_IP_DGRAM_LEN];
+    uint8_t l4_hdr[ETH_MAX_TCP_HDR_LEN];
 
     uint32_t payload_len;
 
@@ -496,6 +497,11 @@ enum {
     NET_TX_PKT_FRAGMENT_HEADER_NUM
 };
 
+enum {
+    NET_TX_PKT_SEGMENT_L4_HDR_POS = NET_TX_PKT_FRAGMENT_HEADER_NUM,
+    NET_TX_PKT_SEGMENT_HEADER_NUM
+};
+
 #define NET_MAX_FRAG_SG_LIST (64)
 
 static size_t net_tx_pkt_fetch_fragment(struct NetTxPkt *pkt,
@@ -594,12 +600,191 @@ static bool net_tx_pkt_do_sw_fragmentation(struct NetTxPkt *pkt,
     return true;
 }
 
+static size_t net_tx_pkt_fetch_segment(struct NetTxPkt *pkt,
+    int *src_idx, size_t *src_offset, size_t seg_size,
+    struct iovec *dst, int *dst_idx, uint32_t *csum_cntr)
+{
+    size_t fetched = 0;
+    struct iovec *src = pkt->vec;
+
+    *dst_idx = NET_TX_PKT_SEGMENT_HEADER_NUM;
+
+    while (fetched < seg_size) {
+
+        /* no more place in segment iov, send a short segment */
+        if (*dst_idx == NET_MAX_FRAG_SG_LIST) {
+            break;
+        }
+
+        /* no more data in iovec */
+        if (*src_idx == (pkt->payload_frags + NET_TX_PKT_PL_START_FRAG)) {
+            break;
+        }
+
+        dst[*dst_idx].iov_base = src[*src_idx].iov_base + *src_offset;
+        dst[*dst_idx].iov_len = MIN(src[*src_idx].iov_len - *src_offset,
+            seg_size - fetched);
+
+        /* payload is checksummed in place, it is never copied */
+        *csum_cntr += net_checksum_add_cont(dst[*dst_idx].iov_len,
+                                            dst[*dst_idx].iov_base,
+                                            fetched);
+
+        *src_offset += dst[*dst_idx].iov_len;
+        fetched += dst[*dst_idx].iov_len;
+
+        if (*src_offset == src[*src_idx].iov_len) {
+            *src_offset = 0;
+            (*src_idx)++;
+        }
+
+        (*dst_idx)++;
+    }
+
+    return fetched;
+}
+
+/*
+ * Software TSO: cut a TCP large send into gso_size segments.
+ *
+ * The L2, L3 and TCP headers are turned into a template once per large
+ * send; every segment reuses it and only gets its sequence number, IP ID,
+ * lengths and flags patched.  The IP header and TCP checksums are derived
+ * from sums of the template taken with those fields zeroed, so per segment
+ * only the payload, which is referenced in guest memory, is summed.
+ */
+static bool net_tx_pkt_do_sw_segmentation(struct NetTxPkt *pkt,
+    NetClientState *nc)
+{
+    struct iovec segment[NET_MAX_FRAG_SG_LIST];
+    struct ip_header *ip4 = NULL;
+    struct ip6_header *ip6 = NULL;
+    struct tcp_hdr *th = (struct tcp_hdr *) pkt->l4_hdr;
+    void *l3_iov_base = pkt->vec[NET_TX_PKT_L3HDR_FRAG].iov_base;
+    size_t l3_iov_len = pkt->vec[NET_TX_PKT_L3HDR_FRAG].iov_len;
+    size_t l4_len = pkt->virt_hdr.hdr_len - pkt->hdr_len;
+    size_t mss = pkt->virt_hdr.gso_size;
+    size_t data_len, data_offset = 0, seg_len;
+    uint16_t ip_id = 0, ip_len = 0, ip_sum = 0, orig_plen = 0, seg_id = 0;
+    uint32_t ip_cntr = 0, tcp_cntr, csum_cntr, cso;
+    uint32_t seq;
+    uint8_t flags, seg_flags;
+    int src_idx = NET_TX_PKT_PL_START_FRAG, dst_idx;
+    size_t src_offset = l4_len;
+    bool first = true;
+
+    if (pkt->l4proto != IP_PROTO_TCP || !mss ||
+        l4_len < sizeof(struct tcp_hdr) || l4_len > ETH_MAX_TCP_HDR_LEN ||
+        l4_len > pkt->payload_len) {
+        return false;
+    }
+    data_len = pkt->payload_len - l4_len;
+
+    /* Skip the TCP header, segments carry the template instead */
+    while (src_offset && src_offset >= pkt->vec[src_idx].iov_len) {
+        src_offset -= pkt->vec[src_idx].iov_len;
+        src_idx++;
+    }
+
+    /* Build the TCP template, with the per-segment fields zeroed */
+    iov_to_buf(&pkt->vec[NET_TX_PKT_PL_START_FRAG], pkt->payload_frags,
+               0, th, l4_len);
+    seq = be32_to_cpu(th->th_seq);
+    flags = th->th_flags;
+    th->th_seq = 0;
+    th->th_flags = 0;
+    th->th_sum = 0;
+    tcp_cntr = net_checksum_add(l4_len, pkt->l4_hdr);
+
+    /* ...and the L3 one, to be restored once the large send is done */
+    if ((pkt->virt_hdr.gso_type & ~VIRTIO_NET_HDR_GSO_ECN) ==
+        VIRTIO_NET_HDR_GSO_TCPV4) {
+        ip4 = l3_iov_base;
+        ip_id = ip4->ip_id;
+        seg_id = be16_to_cpu(ip_id);
+        ip_len = ip4->ip_len;
+        ip_sum = ip4->ip_sum;
+        ip4->ip_id = 0;
+        ip4->ip_len = 0;
+        ip4->ip_sum = 0;
+        ip_cntr = net_checksum_add(l3_iov_len, l3_iov_base);
+        tcp_cntr += eth_calc_ip4_pseudo_hdr_csum(ip4, 0, &cso);
+    } else {
+        ip6 = l3_iov_base;
+        orig_plen = ip6->ip6_plen;
+        tcp_cntr += eth_calc_ip6_pseudo_hdr_csum(ip6, 0, IP_PROTO_TCP, &cso);
+    }
+
+    segment[NET_TX_PKT_FRAGMENT_L2_HDR_POS] =
+        pkt->vec[NET_TX_PKT_L2HDR_FRAG];
+    segment[NET_TX_PKT_FRAGMENT_L3_HDR_POS] =
+        pkt->vec[NET_TX_PKT_L3HDR_FRAG];
+    segment[NET_TX_PKT_SEGMENT_L4_HDR_POS].iov_base = pkt->l4_hdr;
+    segment[NET_TX_PKT_SEGMENT_L4_HDR_POS].iov_len = l4_len;
+
+    do {
+        csum_cntr = 0;
+        seg_len = net_tx_pkt_fetch_segment(pkt, &src_idx, &src_offset,
+            MIN(mss, data_len - data_offset), segment, &dst_idx, &csum_cntr);
+
+        seg_flags = flags;
+        if (data_offset + seg_len < data_len) {
+            seg_flags &= ~(TH_FIN | TH_PUSH);
+        }
+        if (!first) {
+            seg_flags &= ~TH_CWR;
+        }
+
+        if (ip4) {
+            uint16_t len = l3_iov_len + l4_len + seg_len;
+
+            ip4->ip_id = cpu_to_be16(seg_id);
+            ip4->ip_len = cpu_to_be16(len);
+            ip4->ip_sum = cpu_to_be16(
+                net_checksum_finish(ip_cntr + len + seg_id));
+            seg_id++;
+        } else {
+            ip6->ip6_plen = cpu_to_be16(l3_iov_len - sizeof(*ip6) +
+                                        l4_len + seg_len);
+        }
+
+        th->th_seq = cpu_to_be32(seq);
+        th->th_flags = seg_flags;
+        csum_cntr += tcp_cntr + l4_len + seg_len +
+                     (seq >> 16) + (seq & 0xffff) + seg_flags;
+        th->th_sum = cpu_to_be16(net_checksum_finish(csum_cntr));
+
+        net_tx_pkt_sendv(pkt, nc, segment, dst_idx);
+
+        seq += seg_len;
+        data_offset += seg_len;
+        first = false;
+    } while (seg_len && data_offset < data_len);
+
+    if (ip4) {
+        ip4->ip_id = ip_id;
+        ip4->ip_len = ip_len;
+        ip4->ip_sum = ip_sum;
+    } else {
+        ip6->ip6_plen = orig_plen;
+    }
+
+    return true;
+}
+
 bool net_tx_pkt_send(struct NetTxPkt *pkt, NetClientState *nc)
 {
+    uint8_t gso_type;
+
     assert(pkt);
 
+    gso_type = pkt->virt_hdr.gso_type & ~VIRTIO_NET_HDR_GSO_ECN;
+
+    /* TCP segments get their checksums computed as they are cut */
     if (!pkt->has_virt_hdr &&
-        pkt->virt_hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
+        pkt->virt_hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM &&
+        gso_type != VIRTIO_NET_HDR_GSO_TCPV4 &&
+        gso_type != VIRTIO_NET_HDR_GSO_TCPV6) {
         net_tx_pkt_do_sw_csum(pkt);
     }
 
@@ -622,6 +807,11 @@ bool net_tx_pkt_send(struct NetTxPkt *pkt, NetClientState *nc)
         return true;
     }
 
+    if (gso_type == VIRTIO_NET_HDR_GSO_TCPV4 ||
+        gso_type == VIRTIO_NET_HDR_GSO_TCPV6) {
+        return net_tx_pkt_do_sw_segmentation(pkt, nc);
+    }
+
     return net_tx_pkt_do_sw_fragmentation(pkt, nc);
 }
 
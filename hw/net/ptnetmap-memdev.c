@@ -26,9 +26,11 @@
 #include "qemu/osdep.h"
 #include "hw/hw.h"
 #include "hw/pci/pci.h"
+#include "qapi/error.h"
 #include "qemu/error-report.h"
 #include "qemu/event_notifier.h"
 #include "qemu/osdep.h"
+#include "migration/misc.h"
 #include "hw/net/ptnetmap.h"
 
 #ifdef PTNET_DEBUG
@@ -60,8 +62,12 @@ typedef struct PTNetmapMemDevState {
     MemoryRegion io_bar;        /* ptnetmap register BAR */
     MemoryRegion mem_bar;       /* ptnetmap shared memory BAR */
     MemoryRegion mem_ram;       /* ptnetmap shared memory subregion */
+    MemoryRegion shadow_ram;    /* its copy, restored by incoming migration */
     void *mem_ptr;              /* host virtual pointer to netmap memory */
     struct nmreq_pools_info pi;
+    bool shadow;                /* guest uses shadow_ram, not mem_ram */
+    unsigned int users;         /* netmap backends sharing this memory */
+    struct nmreq_pools_info saved_pi;   /* layout of the migration source */
 
     QTAILQ_ENTRY(PTNetmapMemDevState) next;
 } PTNetmapMemDevState;
@@ -144,6 +150,13 @@ static const MemoryRegionOps ptnetmap_memdev_io_ops = {
     },
 };
 
+/* The memory region that holds the netmap memory seen by the guest */
+static MemoryRegion *
+ptnetmap_memdev_ram(PTNetmapMemDevState *memd)
+{
+    return memd->shadow ? &memd->shadow_ram : &memd->mem_ram;
+}
+
 static void
 ptnetmap_memdev_realize(PCIDevice *dev, Error **errp)
 {
@@ -162,17 +175,33 @@ ptnetmap_memdev_realize(PCIDevice *dev, Error **errp)
             &memd->io_bar);
 
     /* init PCI_BAR to map netmap memory into the guest */
-    if (memd->mem_ptr) {
+    if (memd->mem_ptr || memd->shadow) {
         size = upper_pow2(memd->pi.nr_memsize);
         DBG("Netmap memory mapped, size %lx (%lu MiB)", size, size >> 20);
 
         memory_region_init(&memd->mem_bar, OBJECT(memd),
                            "ptnetmap-mem-bar", size);
-        memory_region_init_ram_ptr(&memd->mem_ram, OBJECT(memd),
-                                   "ptnetmap-mem-ram", memd->pi.nr_memsize,
-                                   memd->mem_ptr);
-        memory_region_add_subregion(&memd->mem_bar, 0, &memd->mem_ram);
-        vmstate_register_ram(&memd->mem_ram, DEVICE(memd));
+        if (memd->shadow) {
+            /* The guest keeps using the netmap memory of the migration
+             * source, which is restored into plain RAM. */
+            Error *err = NULL;
+
+            memory_region_init_ram_nomigrate(&memd->shadow_ram, OBJECT(memd),
+                                             "ptnetmap-mem-ram",
+                                             memd->pi.nr_memsize, &err);
+            if (err) {
+                error_propagate(errp, err);
+                return;
+            }
+            memd->mem_ptr = memory_region_get_ram_ptr(&memd->shadow_ram);
+        } else {
+            memory_region_init_ram_ptr(&memd->mem_ram, OBJECT(memd),
+                                       "ptnetmap-mem-ram", memd->pi.nr_memsize,
+                                       memd->mem_ptr);
+        }
+        memory_region_add_subregion(&memd->mem_bar, 0,
+                                    ptnetmap_memdev_ram(memd));
+        vmstate_register_ram(ptnetmap_memdev_ram(memd), DEVICE(memd));
         pci_register_bar(dev, PTNETMAP_MEM_PCI_BAR,
                 PCI_BASE_ADDRESS_SPACE_MEMORY  |
                 PCI_BASE_ADDRESS_MEM_PREFETCH /*  |
@@ -209,16 +238,23 @@ ptnetmap_memdev_find(uint16_t memid)
     return NULL;
 }
 
-/* Function exported to be used by the netmap backend. */
+/* Function exported to be used by the netmap backend. If 'shadow' is
+ * set, the guest is given a copy of the netmap memory, to be restored
+ * by an incoming migration, rather than the memory at 'mem_ptr'. The
+ * memory seen by the guest is returned in 'guest_mem'. */
 int
-ptnetmap_memdev_create(void *mem_ptr, struct nmreq_pools_info *pi)
+ptnetmap_memdev_create(void *mem_ptr, struct nmreq_pools_info *pi,
+                       bool shadow, void **guest_mem)
 {
     PTNetmapMemDevState *memd;
     PCIDevice *dev;
     PCIBus *bus;
 
-    if (ptnetmap_memdev_find(pi->nr_mem_id)) {
+    memd = ptnetmap_memdev_find(pi->nr_mem_id);
+    if (memd) {
         DBG("memdev instance for mem-id %d already exists", pi->nr_mem_id);
+        memd->users++;
+        *guest_mem = memd->mem_ptr;
         return 0;
     }
 
@@ -234,22 +270,155 @@ ptnetmap_memdev_create(void *mem_ptr, struct nmreq_pools_info *pi)
 
     /* Set shared memory parameters for the new ptnetmap memdev instance. */
     memd = PTNETMAP_MEMDEV(dev);
-    memd->mem_ptr = mem_ptr;
+    memd->mem_ptr = shadow ? NULL : mem_ptr;
     memd->pi = *pi;
+    memd->shadow = shadow;
+    memd->users = 1;
 
     /* Initialize the new device. */
     qdev_init_nofail(&dev->qdev);
+    *guest_mem = memd->mem_ptr;
 
     DBG("New instance created");
 
     return 0;
 }
 
+/* Function exported to be used by the netmap backend. Netmap buffers
+ * written by the host are not seen by dirty logging, so the backend
+ * marks them before the last pass of migration. */
+void
+ptnetmap_memdev_set_dirty(void *ptr, uint64_t len)
+{
+    PTNetmapMemDevState *memd;
+
+    QTAILQ_FOREACH(memd, &ptn_memdevs, next) {
+        uintptr_t ofs = (uintptr_t)ptr - (uintptr_t)memd->mem_ptr;
+
+        if (memd->mem_ptr && ptr >= memd->mem_ptr &&
+            ofs < memd->pi.nr_memsize &&
+            len <= memd->pi.nr_memsize - ofs) {
+            memory_region_set_dirty(ptnetmap_memdev_ram(memd), ofs, len);
+            return;
+        }
+    }
+}
+
+/* Function exported to be used by the netmap backend. When the guest
+ * registers its netmap interface again after an incoming migration, it
+ * takes the rings from the port rather than from the copy of the source
+ * memory at 'guest_mem': map the netmap memory at 'mem_ptr' in place of
+ * the copy. */
+int
+ptnetmap_memdev_unshadow(void *guest_mem, void *mem_ptr)
+{
+    PTNetmapMemDevState *memd;
+
+    QTAILQ_FOREACH(memd, &ptn_memdevs, next) {
+        if (memd->shadow && memd->mem_ptr == guest_mem) {
+            break;
+        }
+    }
+    if (!memd) {
+        return -ENOENT;
+    }
+
+    /* Other backends may still serve guest rings in the copy, and the
+     * RAM blocks to migrate cannot change under a migration. */
+    if (memd->users > 1 || !migration_is_idle()) {
+        return -EBUSY;
+    }
+
+    memory_region_transaction_begin();
+    memory_region_del_subregion(&memd->mem_bar, &memd->shadow_ram);
+    memory_region_init_ram_ptr(&memd->mem_ram, OBJECT(memd),
+                               "ptnetmap-mem-ram", memd->pi.nr_memsize,
+                               mem_ptr);
+    memory_region_add_subregion(&memd->mem_bar, 0, &memd->mem_ram);
+    memory_region_transaction_commit();
+
+    vmstate_unregister_ram(&memd->shadow_ram, DEVICE(memd));
+    object_unparent(OBJECT(&memd->shadow_ram));
+    vmstate_register_ram(&memd->mem_ram, DEVICE(memd));
+
+    memd->mem_ptr = mem_ptr;
+    memd->shadow = false;
+    DBG("Netmap memory mapped again after migration");
+
+    return 0;
+}
+
 static void
 qdev_ptnetmap_memdev_reset(DeviceState *dev)
 {
 }
 
+static int
+ptnetmap_memdev_pre_save(void *opaque)
+{
+    PTNetmapMemDevState *memd = opaque;
+
+    memd->saved_pi = memd->pi;
+
+    return 0;
+}
+
+static int
+ptnetmap_memdev_post_load(void *opaque, int version_id)
+{
+    PTNetmapMemDevState *memd = opaque;
+    struct nmreq_pools_info *pi = &memd->pi, *spi = &memd->saved_pi;
+
+    if (!memd->shadow) {
+        /* The netmap memory is shared with the host kernel, which has its
+         * own view of the rings: it can only be restored into a copy. */
+        error_report("ptnetmap-memdev: netmap memory can only be restored "
+                     "by an incoming migration");
+        return -EINVAL;
+    }
+
+    /* The guest has already seen the layout of the source: the memory
+     * allocator of the destination must be configured in the same way. */
+    if (pi->nr_memsize != spi->nr_memsize ||
+        pi->nr_if_pool_offset != spi->nr_if_pool_offset ||
+        pi->nr_if_pool_objtotal != spi->nr_if_pool_objtotal ||
+        pi->nr_if_pool_objsize != spi->nr_if_pool_objsize ||
+        pi->nr_ring_pool_offset != spi->nr_ring_pool_offset ||
+        pi->nr_ring_pool_objtotal != spi->nr_ring_pool_objtotal ||
+        pi->nr_ring_pool_objsize != spi->nr_ring_pool_objsize ||
+        pi->nr_buf_pool_offset != spi->nr_buf_pool_offset ||
+        pi->nr_buf_pool_objtotal != spi->nr_buf_pool_objtotal ||
+        pi->nr_buf_pool_objsize != spi->nr_buf_pool_objsize) {
+        error_report("ptnetmap-memdev: netmap memory layout does not match "
+                     "the one of the migration source");
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static const VMStateDescription vmstate_ptnetmap_memdev = {
+    .name = "ptnetmap-memdev",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .pre_save = ptnetmap_memdev_pre_save,
+    .post_load = ptnetmap_memdev_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_PCI_DEVICE(parent_obj, PTNetmapMemDevState),
+        VMSTATE_UINT64(saved_pi.nr_memsize, PTNetmapMemDevState),
+        VMSTATE_UINT64(saved_pi.nr_if_pool_offset, PTNetmapMemDevState),
+        VMSTATE_UINT32(saved_pi.nr_if_pool_objtotal, PTNetmapMemDevState),
+        VMSTATE_UINT32(saved_pi.nr_if_pool_objsize, PTNetmapMemDevState),
+        VMSTATE_UINT64(saved_pi.nr_ring_pool_offset, PTNetmapMemDevState),
+        VMSTATE_UINT32(saved_pi.nr_ring_pool_objtotal, PTNetmapMemDevState),
+        VMSTATE_UINT32(saved_pi.nr_ring_pool_objsize, PTNetmapMemDevState),
+        VMSTATE_UINT64(saved_pi.nr_buf_pool_offset, PTNetmapMemDevState),
+        VMSTATE_UINT32(saved_pi.nr_buf_pool_objtotal, PTNetmapMemDevState),
+        VMSTATE_UINT32(saved_pi.nr_buf_pool_objsize, PTNetmapMemDevState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void
 ptnetmap_memdev_class_init(ObjectClass *klass, void *data)
 {
@@ -265,6 +434,7 @@ ptnetmap_memdev_class_init(ObjectClass *klass, void *data)
     dc->desc = "ptnetmap memory device";
     set_bit(DEVICE_CATEGORY_MISC, dc->categories);
     dc->reset = qdev_ptnetmap_memdev_reset;
+    dc->vmsd = &vmstate_ptnetmap_memdev;
 }
 
 static const TypeInfo ptnetmap_memdev_info = {
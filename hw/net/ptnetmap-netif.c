@@ -28,7 +28,9 @@
 #include "qemu/error-report.h"
 #include "qemu/iov.h"
 #include "qemu/range.h"
+#include "qemu/atomic.h"
 #include "qapi/error.h"
+#include "qapi/qapi-commands-net.h"
 
 #include <net/if.h>
 #include "net/netmap.h"
@@ -86,8 +88,19 @@ typedef struct PtNetState_st {
     uint32_t ioregs[PTNET_IO_END >> 2];
     char *csb_gh;
     char *csb_hg;
+
+    /* The sync loop is stopped while the VM is stopped. This is true
+     * if it must be restarted when the VM runs again, possibly on the
+     * destination of a migration. */
+    bool kloop_suspended;
+    VMChangeStateEntry *vmstate;
+
+    QTAILQ_ENTRY(PtNetState_st) next;
 } PtNetState;
 
+static QTAILQ_HEAD(, PtNetState_st) ptnet_devices =
+                        QTAILQ_HEAD_INITIALIZER(ptnet_devices);
+
 #define TYPE_PTNET_PCI  "ptnet-pci"
 
 #define PTNET(obj) \
@@ -304,6 +317,7 @@ ptnet_ptctl(PtNetState *s, uint64_t cmd)
     switch (cmd) {
     case PTNETMAP_PTCTL_CREATE:
         /* React to guest REGIF operation. */
+        ptnetmap_unshadow(s->ptbe);
         ret = ptnet_ptctl_create(s);
         break;
 
@@ -460,10 +474,105 @@ static const MemoryRegionOps ptnet_io_ops = {
     },
 };
 
+/* Migration support. */
+
+static void
+ptnet_vm_state_change(void *opaque, int running, RunState state)
+{
+    PtNetState *s = opaque;
+
+    if (!s->ptbe) {
+        return;
+    }
+
+    if (running) {
+        if (s->kloop_suspended) {
+            s->kloop_suspended = false;
+            if (ptnet_ptctl_create(s)) {
+                error_report("ptnet: failed to restart the sync loop");
+            }
+        }
+        return;
+    }
+
+    if (!s->ptbe->worker_started) {
+        return;
+    }
+
+    ptnet_ptctl_delete(s);
+    s->kloop_suspended = true;
+
+    /* Rings, CSB and received frames are written by the host without
+     * dirty logging: mark them, in case a migration is in progress.
+     * Remapping the CSB marks it. */
+    ptnetmap_dirty_rings(s->ptbe, s->csb_gh, s->csb_hg, s->num_rings);
+    ptnet_csb_map_one(s, &s->csb_hg, PTNET_IO_CSB_HG_BAH,
+                      PTNET_IO_CSB_HG_BAL, sizeof(struct nm_csb_ktoa),
+                      /*is_write=*/1);
+}
+
+static bool
+ptnet_version_2(void *opaque, int version_id)
+{
+    return version_id >= 2;
+}
+
+static int
+ptnet_post_load(void *opaque, int version_id)
+{
+    static const unsigned int geometry_regs[] = {
+        PTNET_IO_NUM_TX_RINGS, PTNET_IO_NUM_RX_RINGS,
+        PTNET_IO_NUM_TX_SLOTS, PTNET_IO_NUM_RX_SLOTS,
+    };
+    uint32_t geometry[ARRAY_SIZE(geometry_regs)];
+    PtNetState *s = opaque;
+    int i;
+
+    if (!s->ptbe) {
+        return 0;
+    }
+
+    /* The guest keeps using the rings of the source: the netmap port of
+     * the destination must have the same ones. */
+    for (i = 0; i < ARRAY_SIZE(geometry_regs); i++) {
+        geometry[i] = s->ioregs[geometry_regs[i] >> 2];
+    }
+    if (ptnet_get_netmap_if(s)) {
+        return -EINVAL;
+    }
+    for (i = 0; i < ARRAY_SIZE(geometry_regs); i++) {
+        unsigned int index = geometry_regs[i] >> 2;
+
+        if (geometry[i] != s->ioregs[index]) {
+            error_report("ptnet: %s does not match the migration source "
+                         "(%" PRIu32 " != %" PRIu32 ")", regnames[index],
+                         s->ioregs[index], geometry[i]);
+            return -EINVAL;
+        }
+    }
+
+    /* The netmap_if seen by the guest is the one of the source. */
+    s->ptbe->nifp_offset = s->ioregs[PTNET_IO_NIFP_OFS >> 2];
+
+    ptnet_csb_map_one(s, &s->csb_gh, PTNET_IO_CSB_GH_BAH,
+                      PTNET_IO_CSB_GH_BAL, sizeof(struct nm_csb_atok),
+                      /*is_write=*/0);
+    ptnet_csb_map_one(s, &s->csb_hg, PTNET_IO_CSB_HG_BAH,
+                      PTNET_IO_CSB_HG_BAL, sizeof(struct nm_csb_ktoa),
+                      /*is_write=*/1);
+
+    /* The CSB holds the state of the rings, which are resumed from
+     * there when the VM runs. */
+    s->ptbe->resume = s->kloop_suspended;
+
+    return 0;
+}
+
 static const VMStateDescription vmstate_ptnet = {
     .name = "ptnet",
-    .version_id = 1,
+    .version_id = 2,
     .minimum_version_id = 1,
+    .post_load = ptnet_post_load,
     .fields = (VMStateField[]) {
         VMSTATE_PCI_DEVICE(pci_device, PtNetState),
         VMSTATE_UINT32(ioregs[PTNET_IO_PTFEAT >> 2], PtNetState),
@@ -481,10 +590,122 @@ static const VMStateDescription vmstate_ptnet = {
         VMSTATE_UINT32(ioregs[PTNET_IO_CSB_GH_BAL >> 2], PtNetState),
         VMSTATE_UINT32(ioregs[PTNET_IO_CSB_HG_BAH >> 2], PtNetState),
         VMSTATE_UINT32(ioregs[PTNET_IO_CSB_HG_BAL >> 2], PtNetState),
+        VMSTATE_MSIX_TEST(pci_device, PtNetState, ptnet_version_2),
+        VMSTATE_BOOL_V(kloop_suspended, PtNetState, 2),
         VMSTATE_END_OF_LIST()
     }
 };
 
+/* Statistics support. */
+
+static PtnetRingInfo *
+ptnet_query_ring(PtNetState *s, unsigned int i)
+{
+    unsigned int num_tx = s->ioregs[PTNET_IO_NUM_TX_RINGS >> 2];
+    PtnetRingInfo *info = g_new0(PtnetRingInfo, 1);
+    PTNetmapState *ptn = s->ptbe;
+    uint32_t slots;
+    int b;
+
+    info->tx = i < num_tx;
+    info->index = info->tx ? i : i - num_tx;
+    slots = s->ioregs[info->tx ? PTNET_IO_NUM_TX_SLOTS >> 2
+                               : PTNET_IO_NUM_RX_SLOTS >> 2];
+    info->slots = slots;
+
+    if (s->csb_gh && s->csb_hg && slots) {
+        struct nm_csb_atok *atok = (struct nm_csb_atok *)s->csb_gh + i;
+        struct nm_csb_ktoa *ktoa = (struct nm_csb_ktoa *)s->csb_hg + i;
+        uint32_t head = atomic_read(&atok->head);
+        uint32_t hwtail = atomic_read(&ktoa->hwtail);
+
+        if (head < slots && hwtail < slots) {
+            /* Slots between head and hwtail are owned by the guest. */
+            uint32_t guest_slots = (hwtail + slots - head) % slots;
+
+            info->occupancy = info->tx ? slots - 1 - guest_slots
+                                       : guest_slots;
+        }
+    }
+
+    /* The kernel sync loop does not count notifications. */
+    if (ptn && ptn->uloop && i < ptn->num_ring_stats) {
+        PTNetmapRingStats *stats = ptn->ring_stats + i;
+
+        info->has_kicks = true;
+        info->kicks = stat64_get(&stats->kicks);
+        info->has_interrupts = true;
+        info->interrupts = stat64_get(&stats->interrupts);
+        info->has_kick_interval = true;
+        for (b = PTNETMAP_KICK_HIST_BUCKETS - 1; b >= 0; b--) {
+            intList *elem = g_new0(intList, 1);
+
+            elem->value = stat64_get(&stats->kick_hist[b]);
+            elem->next = info->kick_interval;
+            info->kick_interval = elem;
+        }
+    }
+
+    return info;
+}
+
+static PtnetInfo *
+ptnet_query_info(PtNetState *s)
+{
+    PtnetInfo *info = g_new0(PtnetInfo, 1);
+    PTNetmapState *ptn = s->ptbe;
+    PtnetRingInfoList **tail = &info->rings;
+    unsigned int i;
+
+    info->name = g_strdup(qemu_get_queue(s->nic)->name);
+    if (!ptn || !ptn->worker_started) {
+        info->sync_loop = PTNET_SYNC_LOOP_NONE;
+    } else if (ptn->uloop) {
+        info->sync_loop = PTNET_SYNC_LOOP_USER;
+        info->has_polls = true;
+        info->polls = stat64_get(&ptn->uloop_polls);
+        info->has_sleeps = true;
+        info->sleeps = stat64_get(&ptn->uloop_sleeps);
+    } else {
+        info->sync_loop = PTNET_SYNC_LOOP_KERNEL;
+    }
+
+    for (i = 0; i < s->num_rings; i++) {
+        PtnetRingInfoList *entry = g_new0(PtnetRingInfoList, 1);
+
+        entry->value = ptnet_query_ring(s, i);
+        *tail = entry;
+        tail = &entry->next;
+    }
+
+    return info;
+}
+
+PtnetInfoList *qmp_query_ptnet(bool has_name, const char *name, Error **errp)
+{
+    PtnetInfoList *list = NULL, **tail = &list;
+    PtNetState *s;
+
+    QTAILQ_FOREACH(s, &ptnet_devices, next) {
+        PtnetInfoList *entry;
+
+        if (has_name && strcmp(qemu_get_queue(s->nic)->name, name) != 0) {
+            continue;
+        }
+
+        entry = g_new0(PtnetInfoList, 1);
+        entry->value = ptnet_query_info(s);
+        *tail = entry;
+        tail = &entry->next;
+    }
+
+    if (has_name && !list) {
+        error_setg(errp, "net client(%s) isn't a ptnet device", name);
+    }
+
+    return list;
+}
+
 /* PCI interface */
 
 static NetClientInfo net_ptnet_info = {
@@ -550,6 +771,9 @@ pci_ptnet_realize(PCIDevice *pci_dev, Error **errp)
         }
     }
 
+    s->vmstate = qemu_add_vm_change_state_handler(ptnet_vm_state_change, s);
+    QTAILQ_INSERT_TAIL(&ptnet_devices, s, next);
+
     DBG("%s(%p)", __func__, s);
 }
 
@@ -566,6 +790,8 @@ pci_ptnet_uninit(PCIDevice *dev)
     g_free(s->host_notifiers);
     g_free(s->virqs);
 
+    QTAILQ_REMOVE(&ptnet_devices, s, next);
+    qemu_del_vm_change_state_handler(s->vmstate);
     msix_uninit_exclusive_bar(PCI_DEVICE(s));
     qemu_del_nic(s->nic);
 
@@ -0,0 +1,23 @@
+/*
+ * QMP commands of the netmap passthrough device, when it is not built
+ *
+ * Copyright (c) 2018 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qapi/error.h"
+#include "qapi/qapi-commands-net.h"
+
+PtnetInfoList *qmp_query_ptnet(bool has_name, const char *name, Error **errp)
+{
+    /* There are no ptnet devices without netmap support. */
+    if (has_name) {
+        error_setg(errp, "net client(%s) isn't a ptnet device", name);
+    }
+    return NULL;
+}
@@ -0,0 +1,21 @@
+/*
+ * QMP commands of virtio-net, when it is not built
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qapi/error.h"
+#include "qapi/qapi-commands-net.h"
+
+VirtioNetTxInfoList *qmp_query_virtio_net_tx(bool has_name, const char *name,
+                                             Error **errp)
+{
+    if (has_name) {
+        error_setg(errp, "net client(%s) isn't a virtio-net device", name);
+    }
+    return NULL;
+}
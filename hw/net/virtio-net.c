@@ -16,7 +16,11 @@
 #include "hw/virtio/virtio.h"
 #include "net/net.h"
 #include "net/checksum.h"
+#include "net/eth.h"
 #include "net/tap.h"
+#ifdef CONFIG_NETMAP
+#include "hw/net/ptnetmap.h"
+#endif
 #include "qemu/error-report.h"
 #include "qemu/timer.h"
 #include "hw/virtio/virtio-net.h"
@@ -24,9 +28,14 @@
 #include "hw/virtio/virtio-bus.h"
 #include "qapi/error.h"
 #include "qapi/qapi-events-net.h"
+#include "qapi/qapi-commands-net.h"
+#include "qapi/util.h"
 #include "hw/virtio/virtio-access.h"
 #include "migration/misc.h"
 #include "standard-headers/linux/ethtool.h"
+#include "block/aio.h"
+#include "block/aio-wait.h"
+#include "trace.h"
 
 #define VIRTIO_NET_VM_VERSION    11
 
@@ -41,6 +50,27 @@
 #define VIRTIO_NET_RX_QUEUE_MIN_SIZE VIRTIO_NET_RX_QUEUE_DEFAULT_SIZE
 #define VIRTIO_NET_TX_QUEUE_MIN_SIZE VIRTIO_NET_TX_QUEUE_DEFAULT_SIZE
 
+/* number of TX buffers popped from the guest at once */
+#define VIRTIO_NET_TX_BATCH 32
+
+/* tx=adaptive: flushes finding at least this many packets mean the guest
+ * is streaming, flushes finding a single packet mean it is not
+ */
+#define VIRTIO_NET_TX_ADAPT_BULK        8
+/* Shortest time for which notifications stay disabled, in ns */
+#define VIRTIO_NET_TX_ADAPT_MIN_DELAY   16000
+
+/* Hash types we can compute for VIRTIO_NET_F_RSS and HASH_REPORT */
+#define VIRTIO_NET_RSS_SUPPORTED_HASHES (VIRTIO_NET_RSS_HASH_TYPE_IPv4 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_TCPv4 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_UDPv4 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_IPv6 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_TCPv6 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_UDPv6 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_IP_EX | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_TCP_EX | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_UDP_EX)
+
 /*
  * Calculate the number of bytes up to and including the given 'field' of
  * 'container'.
@@ -48,6 +78,9 @@
 #define endof(container, field) \
     (offsetof(container, field) + sizeof_field(container, field))
 
+static QTAILQ_HEAD(, VirtIONet) virtio_net_devices =
+                        QTAILQ_HEAD_INITIALIZER(virtio_net_devices);
+
 typedef struct VirtIOFeature {
     uint64_t flags;
     size_t end;
@@ -55,15 +88,17 @@ typedef struct VirtIOFeature {
 
 static VirtIOFeature feature_sizes[] = {
     {.flags = 1ULL << VIRTIO_NET_F_MAC,
-     .end = endof(struct virtio_net_config, mac)},
+     .end = endof(VirtIONetConfig, mac)},
     {.flags = 1ULL << VIRTIO_NET_F_STATUS,
-     .end = endof(struct virtio_net_config, status)},
+     .end = endof(VirtIONetConfig, status)},
     {.flags = 1ULL << VIRTIO_NET_F_MQ,
-     .end = endof(struct virtio_net_config, max_virtqueue_pairs)},
+     .end = endof(VirtIONetConfig, max_virtqueue_pairs)},
     {.flags = 1ULL << VIRTIO_NET_F_MTU,
-     .end = endof(struct virtio_net_config, mtu)},
+     .end = endof(VirtIONetConfig, mtu)},
     {.flags = 1ULL << VIRTIO_NET_F_SPEED_DUPLEX,
-     .end = endof(struct virtio_net_config, duplex)},
+     .end = endof(VirtIONetConfig, duplex)},
+    {.flags = (1ULL << VIRTIO_NET_F_RSS) | (1ULL << VIRTIO_NET_F_HASH_REPORT),
+     .end = endof(VirtIONetConfig, supported_hash_types)},
     {}
 };
 
@@ -86,7 +121,7 @@ static int vq2q(int queue_index)
 static void virtio_net_get_config(VirtIODevice *vdev, uint8_t *config)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
-    struct virtio_net_config netcfg;
+    VirtIONetConfig netcfg;
 
     virtio_stw_p(vdev, &netcfg.status, n->status);
     virtio_stw_p(vdev, &netcfg.max_virtqueue_pairs, n->max_queues);
@@ -94,13 +129,18 @@ static void virtio_net_get_config(VirtIODevice *vdev, uint8_t *config)
     memcpy(netcfg.mac, n->mac, ETH_ALEN);
     virtio_stl_p(vdev, &netcfg.speed, n->net_conf.speed);
     netcfg.duplex = n->net_conf.duplex;
+    netcfg.rss_max_key_size = VIRTIO_NET_RSS_MAX_KEY_SIZE;
+    virtio_stw_p(vdev, &netcfg.rss_max_indirection_table_length,
+                 VIRTIO_NET_RSS_MAX_TABLE_LEN);
+    virtio_stl_p(vdev, &netcfg.supported_hash_types,
+                 VIRTIO_NET_RSS_SUPPORTED_HASHES);
     memcpy(config, &netcfg, n->config_size);
 }
 
 static void virtio_net_set_config(VirtIODevice *vdev, const uint8_t *config)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
-    struct virtio_net_config netcfg = {};
+    VirtIONetConfig netcfg = {};
 
     memcpy(&netcfg, config, n->config_size);
 
@@ -240,14 +280,53 @@ static void virtio_net_vnet_endian_status(VirtIONet *n, uint8_t status)
     }
 }
 
+/* Guest notification for the data queues, usable from an IOThread when
+ * the dataplane is running.
+ */
+static void virtio_net_notify(VirtIONet *n, VirtQueue *vq)
+{
+    if (n->dataplane_started) {
+        virtio_notify_irqfd(VIRTIO_DEVICE(n), vq);
+    } else {
+        virtio_notify(VIRTIO_DEVICE(n), vq);
+    }
+}
+
+/* Take the AioContexts of all the queue pairs processed in IOThreads,
+ * before touching state that they use.
+ */
+static void virtio_net_dataplane_acquire(VirtIONet *n)
+{
+    int i;
+
+    for (i = 0; i < n->max_queues; i++) {
+        if (n->vqs[i].ctx) {
+            aio_context_acquire(n->vqs[i].ctx);
+        }
+    }
+}
+
+static void virtio_net_dataplane_release(VirtIONet *n)
+{
+    int i;
+
+    for (i = 0; i < n->max_queues; i++) {
+        if (n->vqs[i].ctx) {
+            aio_context_release(n->vqs[i].ctx);
+        }
+    }
+}
+
 static void virtio_net_drop_tx_queue_data(VirtIODevice *vdev, VirtQueue *vq)
 {
     unsigned int dropped = virtqueue_drop_all(vq);
     if (dropped) {
-        virtio_notify(vdev, vq);
+        virtio_net_notify(VIRTIO_NET(vdev), vq);
     }
 }
 
+static bool virtio_net_gro_flush(VirtIONetQueue *q);
+
 static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
@@ -271,14 +350,35 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
         queue_started =
             virtio_net_started(n, queue_status) && !n->vhost_started;
 
+        if (q->ctx) {
+            aio_context_acquire(q->ctx);
+        }
+
         if (queue_started) {
             qemu_flush_queued_packets(ncs);
         }
 
+        /* Hand a held RX packet to the guest when the VM stops, which
+         * also happens before migration, so that it is not lost.  If
+         * there are no RX buffers it stays held until the VM runs again.
+         */
+        if (q->gro.size) {
+            if (!vdev->vm_running) {
+                rcu_read_lock();
+                virtio_net_gro_flush(q);
+                rcu_read_unlock();
+            } else if (q->gro.bh) {
+                qemu_bh_schedule(q->gro.bh);
+            }
+        }
+
         if (!q->tx_waiting) {
-            continue;
+            goto next;
         }
 
+        if (q->tx_adapt.timer) {
+            timer_del(q->tx_adapt.timer);
+        }
         if (queue_started) {
             if (q->tx_timer) {
                 timer_mod(q->tx_timer,
@@ -302,6 +402,10 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
                 virtio_net_drop_tx_queue_data(vdev, q->tx_vq);
             }
         }
+next:
+        if (q->ctx) {
+            aio_context_release(q->ctx);
+        }
     }
 }
 
@@ -424,6 +528,18 @@ static RxFilterInfo *virtio_net_query_rxfilter(NetClientState *nc)
     return info;
 }
 
+static void virtio_net_tx_adapt_reset(VirtIONetQueue *q)
+{
+    VirtIONet *n = q->n;
+
+    q->tx_adapt.delay = 0;
+    if (n->tx_mode == VIRTIO_NET_TX_MODE_ADAPTIVE) {
+        q->tx_burst = MIN(VIRTIO_NET_TX_BATCH, n->tx_burst);
+    } else {
+        q->tx_burst = n->tx_burst;
+    }
+}
+
 static void virtio_net_reset(VirtIODevice *vdev)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
@@ -438,6 +554,7 @@ static void virtio_net_reset(VirtIODevice *vdev)
     n->nobcast = 0;
     /* multiqueue is disabled by default */
     n->curr_queues = 1;
+    memset(&n->rss_data, 0, sizeof(n->rss_data));
     timer_del(n->announce_timer);
     n->announce_counter = 0;
     n->status &= ~VIRTIO_NET_S_ANNOUNCE;
@@ -452,10 +569,13 @@ static void virtio_net_reset(VirtIODevice *vdev)
     qemu_format_nic_info_str(qemu_get_queue(n->nic), n->mac);
     memset(n->vlans, 0, MAX_VLAN >> 3);
 
-    /* Flush any async TX */
+    /* Flush any async TX and drop held RX packets */
     for (i = 0;  i < n->max_queues; i++) {
         NetClientState *nc = qemu_get_subqueue(n->nic, i);
 
+        n->vqs[i].gro.size = 0;
+        virtio_net_tx_adapt_reset(&n->vqs[i]);
+
         if (nc->peer) {
             qemu_flush_or_purge_queued_packets(nc->peer, true);
             assert(!virtio_net_get_subqueue(nc)->async_tx.elem);
@@ -489,28 +609,33 @@ static int peer_has_ufo(VirtIONet *n)
 }
 
 static void virtio_net_set_mrg_rx_bufs(VirtIONet *n, int mergeable_rx_bufs,
-                                       int version_1)
+                                       int version_1, int hash_report)
 {
-    int i;
+    int i, hdr_len;
     NetClientState *nc;
 
     n->mergeable_rx_bufs = mergeable_rx_bufs;
 
     if (version_1) {
-        n->guest_hdr_len = sizeof(struct virtio_net_hdr_mrg_rxbuf);
+        n->guest_hdr_len = hash_report ?
+            sizeof(struct virtio_net_hdr_v1_hash) :
+            sizeof(struct virtio_net_hdr_mrg_rxbuf);
     } else {
         n->guest_hdr_len = n->mergeable_rx_bufs ?
             sizeof(struct virtio_net_hdr_mrg_rxbuf) :
             sizeof(struct virtio_net_hdr);
     }
 
+    /* The hash fields are ours to fill, the backend never sees them */
+    hdr_len = MIN(n->guest_hdr_len, sizeof(struct virtio_net_hdr_mrg_rxbuf));
+
     for (i = 0; i < n->max_queues; i++) {
         nc = qemu_get_subqueue(n->nic, i);
 
         if (peer_has_vnet_hdr(n) &&
-            qemu_has_vnet_hdr_len(nc->peer, n->guest_hdr_len)) {
-            qemu_set_vnet_hdr_len(nc->peer, n->guest_hdr_len);
-            n->host_hdr_len = n->guest_hdr_len;
+            qemu_has_vnet_hdr_len(nc->peer, hdr_len)) {
+            qemu_set_vnet_hdr_len(nc->peer, hdr_len);
+            n->host_hdr_len = hdr_len;
         }
     }
 }
@@ -608,15 +733,30 @@ static uint64_t virtio_net_get_features(VirtIODevice *vdev, uint64_t features,
 
     virtio_add_feature(&features, VIRTIO_NET_F_MAC);
 
+    /* The packed ring layout is only defined for virtio 1.0 devices */
+    if (!virtio_has_feature(features, VIRTIO_F_VERSION_1)) {
+        virtio_clear_feature(&features, VIRTIO_F_RING_PACKED);
+    }
+
+    /* RSS and hash reporting are configured through the control queue */
+    if (!virtio_has_feature(features, VIRTIO_F_VERSION_1) ||
+        !virtio_has_feature(features, VIRTIO_NET_F_CTRL_VQ)) {
+        virtio_clear_feature(&features, VIRTIO_NET_F_RSS);
+        virtio_clear_feature(&features, VIRTIO_NET_F_HASH_REPORT);
+    }
+
     if (!peer_has_vnet_hdr(n)) {
         virtio_clear_feature(&features, VIRTIO_NET_F_CSUM);
         virtio_clear_feature(&features, VIRTIO_NET_F_HOST_TSO4);
         virtio_clear_feature(&features, VIRTIO_NET_F_HOST_TSO6);
         virtio_clear_feature(&features, VIRTIO_NET_F_HOST_ECN);
 
-        virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_CSUM);
-        virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_TSO4);
-        virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_TSO6);
+        /* RX coalescing produces TSO packets by itself */
+        if (!n->rx_gro) {
+            virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_CSUM);
+            virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_TSO4);
+            virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_TSO6);
+        }
         virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_ECN);
     }
 
@@ -629,6 +769,11 @@ static uint64_t virtio_net_get_features(VirtIODevice *vdev, uint64_t features,
         return features;
     }
     features = vhost_net_get_features(get_vhost_net(nc->peer), features);
+    /* vhost only knows how to hand over split ring indices */
+    virtio_clear_feature(&features, VIRTIO_F_RING_PACKED);
+    /* vhost delivers packets without looking at them */
+    virtio_clear_feature(&features, VIRTIO_NET_F_RSS);
+    virtio_clear_feature(&features, VIRTIO_NET_F_HASH_REPORT);
     vdev->backend_features = features;
 
     if (n->mtu_bypass_backend &&
@@ -699,12 +844,22 @@ static void virtio_net_set_features(VirtIODevice *vdev, uint64_t features)
                                virtio_has_feature(features,
                                                   VIRTIO_NET_F_MRG_RXBUF),
                                virtio_has_feature(features,
-                                                  VIRTIO_F_VERSION_1));
+                                                  VIRTIO_F_VERSION_1),
+                               virtio_has_feature(features,
+                                                  VIRTIO_NET_F_HASH_REPORT));
+
+    if (!virtio_has_feature(features, VIRTIO_NET_F_RSS) &&
+        !virtio_has_feature(features, VIRTIO_NET_F_HASH_REPORT)) {
+        memset(&n->rss_data, 0, sizeof(n->rss_data));
+    }
 
     if (n->has_vnet_hdr) {
         n->curr_guest_offloads =
             virtio_net_guest_offloads_by_features(features);
         virtio_net_apply_guest_offloads(n);
+    } else if (n->rx_gro) {
+        n->curr_guest_offloads =
+            virtio_net_guest_offloads_by_features(features);
     }
 
     for (i = 0;  i < n->max_queues; i++) {
@@ -777,7 +932,7 @@ static int virtio_net_handle_offloads(VirtIONet *n, uint8_t cmd,
 
         offloads = virtio_ldq_p(vdev, &offloads);
 
-        if (!n->has_vnet_hdr) {
+        if (!n->has_vnet_hdr && !n->rx_gro) {
             return VIRTIO_NET_ERR;
         }
 
@@ -787,7 +942,9 @@ static int virtio_net_handle_offloads(VirtIONet *n, uint8_t cmd,
         }
 
         n->curr_guest_offloads = offloads;
-        virtio_net_apply_guest_offloads(n);
+        if (n->has_vnet_hdr) {
+            virtio_net_apply_guest_offloads(n);
+        }
 
         return VIRTIO_NET_OK;
     } else {
@@ -937,32 +1094,143 @@ static int virtio_net_handle_announce(VirtIONet *n, uint8_t cmd,
     }
 }
 
+/* Parse a VIRTIO_NET_CTRL_MQ_RSS_CONFIG or VIRTIO_NET_CTRL_MQ_HASH_CONFIG
+ * command into @rss.  For RSS_CONFIG, @queues is set to the number of
+ * queue pairs requested by the guest.
+ */
+static int virtio_net_parse_rss(VirtIONet *n, uint8_t cmd,
+                                struct iovec *iov, unsigned int iov_cnt,
+                                VirtioNetRssData *rss, uint16_t *queues)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    struct virtio_net_rss_config cfg;
+    struct {
+        uint16_t max_tx_vq;
+        uint8_t hash_key_length;
+    } QEMU_PACKED tail;
+    size_t s, offset, len;
+    unsigned int i;
+
+    offset = offsetof(struct virtio_net_rss_config, indirection_table);
+    s = iov_to_buf(iov, iov_cnt, 0, &cfg, offset);
+    if (s != offset) {
+        return VIRTIO_NET_ERR;
+    }
+
+    memset(rss, 0, sizeof(*rss));
+    rss->hash_types = virtio_ldl_p(vdev, &cfg.hash_types) &
+                      VIRTIO_NET_RSS_SUPPORTED_HASHES;
+
+    if (cmd == VIRTIO_NET_CTRL_MQ_RSS_CONFIG) {
+        /* The mask covers a power-of-2 sized table */
+        len = virtio_lduw_p(vdev, &cfg.indirection_table_mask) + 1;
+        if (len > VIRTIO_NET_RSS_MAX_TABLE_LEN || !is_power_of_2(len)) {
+            return VIRTIO_NET_ERR;
+        }
+        rss->redirect = true;
+        rss->indirections_len = len;
+        rss->default_queue = virtio_lduw_p(vdev, &cfg.unclassified_queue);
+
+        s = iov_to_buf(iov, iov_cnt, offset, rss->indirections_table,
+                       len * sizeof(uint16_t));
+        if (s != len * sizeof(uint16_t)) {
+            return VIRTIO_NET_ERR;
+        }
+        offset += s;
+
+        s = iov_to_buf(iov, iov_cnt, offset, &tail, sizeof(tail));
+        if (s != sizeof(tail)) {
+            return VIRTIO_NET_ERR;
+        }
+        offset += s;
+
+        *queues = virtio_lduw_p(vdev, &tail.max_tx_vq);
+        if (rss->default_queue >= *queues) {
+            return VIRTIO_NET_ERR;
+        }
+        for (i = 0; i < len; i++) {
+            rss->indirections_table[i] =
+                virtio_lduw_p(vdev, &rss->indirections_table[i]);
+            if (rss->indirections_table[i] >= *queues) {
+                return VIRTIO_NET_ERR;
+            }
+        }
+    } else {
+        offset = offsetof(struct virtio_net_hash_config, hash_key_length);
+        s = iov_to_buf(iov, iov_cnt, offset, &tail.hash_key_length,
+                       sizeof(tail.hash_key_length));
+        if (s != sizeof(tail.hash_key_length)) {
+            return VIRTIO_NET_ERR;
+        }
+        offset += s;
+    }
+
+    /* A shorter key is padded with zeroes */
+    len = tail.hash_key_length;
+    if (len > VIRTIO_NET_RSS_MAX_KEY_SIZE) {
+        return VIRTIO_NET_ERR;
+    }
+    s = iov_to_buf(iov, iov_cnt, offset, rss->key, len);
+    if (s != len) {
+        return VIRTIO_NET_ERR;
+    }
+
+    rss->populate_hash = virtio_vdev_has_feature(vdev,
+                                                 VIRTIO_NET_F_HASH_REPORT);
+    return VIRTIO_NET_OK;
+}
+
 static int virtio_net_handle_mq(VirtIONet *n, uint8_t cmd,
                                 struct iovec *iov, unsigned int iov_cnt)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
     struct virtio_net_ctrl_mq mq;
+    VirtioNetRssData rss;
     size_t s;
     uint16_t queues;
 
-    s = iov_to_buf(iov, iov_cnt, 0, &mq, sizeof(mq));
-    if (s != sizeof(mq)) {
-        return VIRTIO_NET_ERR;
+    if (cmd == VIRTIO_NET_CTRL_MQ_HASH_CONFIG) {
+        if (!virtio_vdev_has_feature(vdev, VIRTIO_NET_F_HASH_REPORT) ||
+            virtio_net_parse_rss(n, cmd, iov, iov_cnt, &rss, NULL)) {
+            return VIRTIO_NET_ERR;
+        }
+        n->rss_data = rss;
+        return VIRTIO_NET_OK;
     }
 
-    if (cmd != VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET) {
-        return VIRTIO_NET_ERR;
-    }
+    if (cmd == VIRTIO_NET_CTRL_MQ_RSS_CONFIG) {
+        if (!virtio_vdev_has_feature(vdev, VIRTIO_NET_F_RSS) ||
+            virtio_net_parse_rss(n, cmd, iov, iov_cnt, &rss, &queues)) {
+            return VIRTIO_NET_ERR;
+        }
+        /* RSS may be used to spread a single queue pair's hash */
+        if (queues < VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN ||
+            queues > n->max_queues ||
+            (queues > 1 && !n->multiqueue)) {
+            return VIRTIO_NET_ERR;
+        }
+    } else if (cmd == VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET) {
+        s = iov_to_buf(iov, iov_cnt, 0, &mq, sizeof(mq));
+        if (s != sizeof(mq)) {
+            return VIRTIO_NET_ERR;
+        }
 
-    queues = virtio_lduw_p(vdev, &mq.virtqueue_pairs);
+        queues = virtio_lduw_p(vdev, &mq.virtqueue_pairs);
 
-    if (queues < VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN ||
-        queues > VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MAX ||
-        queues > n->max_queues ||
-        !n->multiqueue) {
+        if (queues < VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN ||
+            queues > VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MAX ||
+            queues > n->max_queues ||
+            !n->multiqueue) {
+            return VIRTIO_NET_ERR;
+        }
+        /* Back to steering by backend queue, hash reporting stays */
+        rss = n->rss_data;
+        rss.redirect = false;
+    } else {
         return VIRTIO_NET_ERR;
     }
 
+    n->rss_data = rss;
     n->curr_queues = queues;
     /* stop the backend before changing the number of queues to avoid handling a
      * disabled queue */
@@ -999,6 +1267,7 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
         iov2 = iov = g_memdup(elem->out_sg, sizeof(struct iovec) * elem->out_num);
         s = iov_to_buf(iov, iov_cnt, 0, &ctrl, sizeof(ctrl));
         iov_discard_front(&iov, &iov_cnt, sizeof(ctrl));
+        virtio_net_dataplane_acquire(n);
         if (s != sizeof(ctrl)) {
             status = VIRTIO_NET_ERR;
         } else if (ctrl.class == VIRTIO_NET_CTRL_RX) {
@@ -1014,6 +1283,7 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
         } else if (ctrl.class == VIRTIO_NET_CTRL_GUEST_OFFLOADS) {
             status = virtio_net_handle_offloads(n, ctrl.cmd, iov, iov_cnt);
         }
+        virtio_net_dataplane_release(n);
 
         s = iov_from_buf(elem->in_sg, elem->in_num, 0, &status, sizeof(status));
         assert(s == sizeof(status));
@@ -1031,8 +1301,22 @@ static void virtio_net_handle_rx(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
     int queue_index = vq2q(virtio_get_queue_index(vq));
+    int i;
+
+    /* A held packet goes before anything queued after it */
+    rcu_read_lock();
+    virtio_net_gro_flush(&n->vqs[queue_index]);
+    rcu_read_unlock();
+
+    if (!n->rss_data.redirect) {
+        qemu_flush_queued_packets(qemu_get_subqueue(n->nic, queue_index));
+        return;
+    }
 
-    qemu_flush_queued_packets(qemu_get_subqueue(n->nic, queue_index));
+    /* With RSS, packets for this queue may wait on any backend queue */
+    for (i = 0; i < n->curr_queues; i++) {
+        qemu_flush_queued_packets(qemu_get_subqueue(n->nic, i));
+    }
 }
 
 static int virtio_net_can_receive(NetClientState *nc)
@@ -1116,9 +1400,12 @@ static void work_around_broken_dhclient(struct virtio_net_hdr *hdr,
 }
 
 static void receive_header(VirtIONet *n, const struct iovec *iov, int iov_cnt,
+                           const struct virtio_net_hdr *gso,
                            const void *buf, size_t size)
 {
-    if (n->has_vnet_hdr) {
+    if (gso) {
+        iov_from_buf(iov, iov_cnt, 0, gso, sizeof(*gso));
+    } else if (n->has_vnet_hdr) {
         /* FIXME this cast is evil */
         void *wbuf = (void *)buf;
         work_around_broken_dhclient(wbuf, wbuf + n->host_hdr_len,
@@ -1188,20 +1475,173 @@ static int receive_filter(VirtIONet *n, const uint8_t *buf, int size)
     return 0;
 }
 
-static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
-                                      size_t size)
+/* RSS
+ *
+ * The guest programs a Toeplitz key, the enabled hash types and an
+ * indirection table through VIRTIO_NET_CTRL_MQ_RSS_CONFIG.  Each packet
+ * is then hashed over its IP addresses and, when enabled, TCP/UDP
+ * ports, and placed on the RX queue the table gives for the hash,
+ * whichever backend queue it came from.  With VIRTIO_NET_F_HASH_REPORT
+ * the hash is also reported in the virtio-net header.
+ */
+
+typedef struct VirtIONetRxHash {
+    uint32_t value;
+    uint16_t report;
+} VirtIONetRxHash;
+
+static bool virtio_net_hash_report_is_ex(uint16_t report)
 {
-    VirtIONet *n = qemu_get_nic_opaque(nc);
-    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    return report == VIRTIO_NET_HASH_REPORT_IPv6_EX ||
+           report == VIRTIO_NET_HASH_REPORT_TCPv6_EX ||
+           report == VIRTIO_NET_HASH_REPORT_UDPv6_EX;
+}
+
+/* Hash @buf (without host header) for the most specific enabled type */
+static void virtio_net_rss_hash(VirtIONet *n, const uint8_t *buf,
+                                size_t size, VirtIONetRxHash *hash)
+{
+    struct iovec iov = { .iov_base = (void *)buf, .iov_len = size };
+    uint32_t types = n->rss_data.hash_types;
+    bool isip4, isip6, isudp, istcp;
+    size_t l3hdr_off, l4hdr_off, l5hdr_off;
+    eth_ip4_hdr_info ip4hdr_info;
+    eth_ip6_hdr_info ip6hdr_info;
+    eth_l4_hdr_info l4hdr_info;
+    net_toeplitz_key key;
+    uint8_t input[36];
+    size_t len;
+
+    hash->value = 0;
+    hash->report = VIRTIO_NET_HASH_REPORT_NONE;
+
+    eth_get_protocols(&iov, 1, &isip4, &isip6, &isudp, &istcp,
+                      &l3hdr_off, &l4hdr_off, &l5hdr_off,
+                      &ip6hdr_info, &ip4hdr_info, &l4hdr_info);
+
+    if (isip4) {
+        /* Fragments carry no L4 header to hash */
+        if (ip4hdr_info.fragment) {
+            istcp = isudp = false;
+        }
+        if (istcp && (types & VIRTIO_NET_RSS_HASH_TYPE_TCPv4)) {
+            hash->report = VIRTIO_NET_HASH_REPORT_TCPv4;
+        } else if (isudp && (types & VIRTIO_NET_RSS_HASH_TYPE_UDPv4)) {
+            hash->report = VIRTIO_NET_HASH_REPORT_UDPv4;
+        } else if (types & VIRTIO_NET_RSS_HASH_TYPE_IPv4) {
+            hash->report = VIRTIO_NET_HASH_REPORT_IPv4;
+        } else {
+            return;
+        }
+        memcpy(&input[0], &ip4hdr_info.ip4_hdr.ip_src, sizeof(uint32_t));
+        memcpy(&input[4], &ip4hdr_info.ip4_hdr.ip_dst, sizeof(uint32_t));
+        len = 2 * sizeof(uint32_t);
+    } else if (isip6) {
+        const struct in6_address *src = &ip6hdr_info.ip6_hdr.ip6_src;
+        const struct in6_address *dst = &ip6hdr_info.ip6_hdr.ip6_dst;
+
+        if (ip6hdr_info.fragment) {
+            istcp = isudp = false;
+        }
+        if (istcp && (types & VIRTIO_NET_RSS_HASH_TYPE_TCP_EX)) {
+            hash->report = VIRTIO_NET_HASH_REPORT_TCPv6_EX;
+        } else if (istcp && (types & VIRTIO_NET_RSS_HASH_TYPE_TCPv6)) {
+            hash->report = VIRTIO_NET_HASH_REPORT_TCPv6;
+        } else if (isudp && (types & VIRTIO_NET_RSS_HASH_TYPE_UDP_EX)) {
+            hash->report = VIRTIO_NET_HASH_REPORT_UDPv6_EX;
+        } else if (isudp && (types & VIRTIO_NET_RSS_HASH_TYPE_UDPv6)) {
+            hash->report = VIRTIO_NET_HASH_REPORT_UDPv6;
+        } else if (types & VIRTIO_NET_RSS_HASH_TYPE_IP_EX) {
+            hash->report = VIRTIO_NET_HASH_REPORT_IPv6_EX;
+        } else if (types & VIRTIO_NET_RSS_HASH_TYPE_IPv6) {
+            hash->report = VIRTIO_NET_HASH_REPORT_IPv6;
+        } else {
+            return;
+        }
+
+        /* _EX types prefer the addresses from the extension headers */
+        if (virtio_net_hash_report_is_ex(hash->report)) {
+            if (ip6hdr_info.rss_ex_src_valid) {
+                src = &ip6hdr_info.rss_ex_src;
+            }
+            if (ip6hdr_info.rss_ex_dst_valid) {
+                dst = &ip6hdr_info.rss_ex_dst;
+            }
+        }
+        memcpy(&input[0], src, sizeof(*src));
+        memcpy(&input[16], dst, sizeof(*dst));
+        len = 2 * sizeof(struct in6_address);
+    } else {
+        return;
+    }
+
+    switch (hash->report) {
+    case VIRTIO_NET_HASH_REPORT_TCPv4:
+    case VIRTIO_NET_HASH_REPORT_UDPv4:
+    case VIRTIO_NET_HASH_REPORT_TCPv6:
+    case VIRTIO_NET_HASH_REPORT_UDPv6:
+    case VIRTIO_NET_HASH_REPORT_TCPv6_EX:
+    case VIRTIO_NET_HASH_REPORT_UDPv6_EX:
+        /* Both TCP and UDP headers start with the two ports */
+        memcpy(&input[len], &l4hdr_info.hdr, 2 * sizeof(uint16_t));
+        len += 2 * sizeof(uint16_t);
+        break;
+    }
+
+    net_toeplitz_key_init(&key, n->rss_data.key);
+    net_toeplitz_add(&hash->value, input, len, &key);
+}
+
+static uint16_t virtio_net_rss_queue(VirtIONet *n, const VirtIONetRxHash *hash)
+{
+    if (hash->report == VIRTIO_NET_HASH_REPORT_NONE) {
+        return n->rss_data.default_queue;
+    }
+    return n->rss_data.indirections_table[hash->value &
+                                          (n->rss_data.indirections_len - 1)];
+}
+
+/* Fill in the hash fields of a virtio_net_hdr_v1_hash header.  @hash is
+ * computed here if the caller did not need it for steering.
+ */
+static void receive_hash(VirtIONet *n, const struct iovec *iov, int iov_cnt,
+                         const VirtIONetRxHash *hash,
+                         const uint8_t *buf, size_t size)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    struct virtio_net_hdr_v1_hash hdr = {};
+    const size_t off = offsetof(struct virtio_net_hdr_v1_hash, hash_value);
+    VirtIONetRxHash h;
+
+    if (n->rss_data.populate_hash) {
+        if (!hash) {
+            virtio_net_rss_hash(n, buf + n->host_hdr_len,
+                                size - n->host_hdr_len, &h);
+            hash = &h;
+        }
+        virtio_stl_p(vdev, &hdr.hash_value, hash->value);
+        virtio_stw_p(vdev, &hdr.hash_report, hash->report);
+    }
+    iov_from_buf(iov, iov_cnt, off, (uint8_t *)&hdr + off, sizeof(hdr) - off);
+}
+
+/* Copy a packet into the RX queue.  If @gso is not NULL it is the
+ * header given to the guest (in guest byte order), and @buf has no
+ * host header.  @hash, if not NULL, is the RSS hash of the packet.
+ */
+static ssize_t virtio_net_receive_buf(VirtIONetQueue *q,
+                                      const struct virtio_net_hdr *gso,
+                                      const VirtIONetRxHash *hash,
+                                      const uint8_t *buf, size_t size)
+{
+    VirtIONet *n = q->n;
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
     struct iovec mhdr_sg[VIRTQUEUE_MAX_SIZE];
     struct virtio_net_hdr_mrg_rxbuf mhdr;
     unsigned mhdr_cnt = 0;
     size_t offset, i, guest_offset;
 
-    if (!virtio_net_can_receive(nc)) {
-        return -1;
-    }
+    assert(!gso || !n->host_hdr_len);
 
     /* hdr_len refers to the header we supply to the guest */
     if (!virtio_net_has_buffers(q, size + n->guest_hdr_len - n->host_hdr_len)) {
@@ -1252,7 +1692,10 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
                                     sizeof(mhdr.num_buffers));
             }
 
-            receive_header(n, sg, elem->in_num, buf, size);
+            receive_header(n, sg, elem->in_num, gso, buf, size);
+            if (n->guest_hdr_len == sizeof(struct virtio_net_hdr_v1_hash)) {
+                receive_hash(n, sg, elem->in_num, hash, buf, size);
+            }
             offset = n->host_hdr_len;
             total += n->guest_hdr_len;
             guest_offset = n->guest_hdr_len;
@@ -1287,153 +1730,686 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
     }
 
     virtqueue_flush(q->rx_vq, i);
-    virtio_notify(vdev, q->rx_vq);
+    if (q->rx_batching) {
+        q->rx_notify_pending = true;
+    } else {
+        virtio_net_notify(n, q->rx_vq);
+    }
 
     return size;
 }
 
-static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf,
-                                  size_t size)
+/* RX coalescing
+ *
+ * Backends without a vnet header deliver every TCP segment on its own.
+ * With rx-gro=on, consecutive in-order segments of the same flow are
+ * merged into a single TSO packet for the guest.  The merged packet is
+ * flushed when the flow is interrupted, after a short or PSH segment,
+ * and in any case once the backend is done with its current burst
+ * (gro.bh).
+ */
+
+/* IP total length or IPv6 payload length, whichever is smaller */
+#define VIRTIO_NET_GRO_MAX_LEN  (64 * KiB - 1)
+
+typedef struct VirtIONetGROPkt {
+    size_t l3_off;
+    size_t l4_off;
+    size_t l5_off;
+    size_t len;         /* without Ethernet padding */
+    uint32_t seq;
+    bool is_ip6;
+    bool push;
+} VirtIONetGROPkt;
+
+/* Check that @buf is a TCP segment that can be merged, and that its
+ * checksum is correct: the guest cannot check it after merging.
+ */
+static bool virtio_net_gro_parse(VirtIONet *n, const uint8_t *buf,
+                                 size_t size, VirtIONetGROPkt *pkt)
 {
-    ssize_t r;
+    struct iovec iov = { .iov_base = (void *)buf, .iov_len = size };
+    bool isip4, isip6, isudp, istcp;
+    eth_ip4_hdr_info ip4hdr_info;
+    eth_ip6_hdr_info ip6hdr_info;
+    eth_l4_hdr_info l4hdr_info;
+    uint16_t flags;
+    uint32_t sum, cso;
+    size_t l4_len;
 
-    rcu_read_lock();
-    r = virtio_net_receive_rcu(nc, buf, size);
-    rcu_read_unlock();
-    return r;
-}
+    if (size < ETH_MAX_L2_HDR_LEN) {
+        return false;
+    }
 
-static int32_t virtio_net_flush_tx(VirtIONetQueue *q);
+    eth_get_protocols(&iov, 1, &isip4, &isip6, &isudp, &istcp,
+                      &pkt->l3_off, &pkt->l4_off, &pkt->l5_off,
+                      &ip6hdr_info, &ip4hdr_info, &l4hdr_info);
+    if (!istcp) {
+        return false;
+    }
 
-static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
-{
-    VirtIONet *n = qemu_get_nic_opaque(nc);
-    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
-    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    if (isip4) {
+        struct ip_header *iphdr = &ip4hdr_info.ip4_hdr;
 
-    virtqueue_push(q->tx_vq, q->async_tx.elem, 0);
-    virtio_notify(vdev, q->tx_vq);
+        if (!(n->curr_guest_offloads & (1ULL << VIRTIO_NET_F_GUEST_TSO4)) ||
+            ip4hdr_info.fragment ||
+            IP_HDR_GET_LEN(iphdr) != sizeof(*iphdr) ||
+            IPTOS_ECN(iphdr->ip_tos) == IPTOS_ECN_CE) {
+            return false;
+        }
+        pkt->len = pkt->l3_off + be16_to_cpu(iphdr->ip_len);
+    } else {
+        struct ip6_header *ip6hdr = &ip6hdr_info.ip6_hdr;
 
-    g_free(q->async_tx.elem);
-    q->async_tx.elem = NULL;
+        if (!(n->curr_guest_offloads & (1ULL << VIRTIO_NET_F_GUEST_TSO6)) ||
+            ip6hdr_info.fragment || ip6hdr_info.has_ext_hdrs ||
+            IP6_ECN(ip6hdr->ip6_ecn_acc) == IP6_ECN_CE) {
+            return false;
+        }
+        pkt->len = pkt->l4_off +
+                   be16_to_cpu(ip6hdr->ip6_ctlun.ip6_un1.ip6_un1_plen);
+    }
 
-    virtio_queue_set_notification(q->tx_vq, 1);
-    virtio_net_flush_tx(q);
+    /* The IPv6 payload length does not include the fixed header, so the
+     * IP packet can be larger than the hold buffer allows.
+     */
+    if (!l4hdr_info.has_tcp_data || pkt->len > size ||
+        pkt->len - pkt->l3_off > VIRTIO_NET_GRO_MAX_LEN ||
+        pkt->l5_off < pkt->l4_off + sizeof(struct tcp_header) ||
+        pkt->l5_off >= pkt->len) {
+        return false;
+    }
+
+    /* Only plain data segments; this also excludes ECE and CWR */
+    flags = be16_to_cpu(l4hdr_info.hdr.tcp.th_offset_flags) & 0xfff;
+    if ((flags & ~TH_PUSH) != TH_ACK) {
+        return false;
+    }
+    pkt->push = flags & TH_PUSH;
+    pkt->seq = be32_to_cpu(l4hdr_info.hdr.tcp.th_seq);
+    pkt->is_ip6 = isip6;
+
+    l4_len = pkt->len - pkt->l4_off;
+    if (isip4) {
+        sum = eth_calc_ip4_pseudo_hdr_csum(&ip4hdr_info.ip4_hdr,
+                                           l4_len, &cso);
+    } else {
+        sum = eth_calc_ip6_pseudo_hdr_csum(&ip6hdr_info.ip6_hdr,
+                                           l4_len, IP_PROTO_TCP, &cso);
+    }
+    sum += net_checksum_add(l4_len, (uint8_t *)buf + pkt->l4_off);
+    return net_checksum_finish(sum) == 0;
 }
 
-/* TX */
-static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
+/* Can @pkt be appended to the packet held by @q? */
+static bool virtio_net_gro_match(VirtIONetQueue *q, const uint8_t *buf,
+                                 const VirtIONetGROPkt *pkt)
 {
-    VirtIONet *n = q->n;
-    VirtIODevice *vdev = VIRTIO_DEVICE(n);
-    VirtQueueElement *elem;
-    int32_t num_packets = 0;
-    int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
-    if (!(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK)) {
-        return num_packets;
+    const uint8_t *held = q->gro.buf;
+    const uint8_t *l3 = buf + pkt->l3_off, *held_l3 = held + pkt->l3_off;
+    const uint8_t *l4 = buf + pkt->l4_off, *held_l4 = held + pkt->l4_off;
+    size_t payload = pkt->len - pkt->l5_off;
+
+    if (pkt->is_ip6 != q->gro.is_ip6 || pkt->l3_off != q->gro.l3_off ||
+        pkt->l4_off != q->gro.l4_off || pkt->l5_off != q->gro.l5_off ||
+        pkt->seq != q->gro.next_seq || payload > q->gro.mss ||
+        q->gro.size + payload - pkt->l3_off > VIRTIO_NET_GRO_MAX_LEN) {
+        return false;
     }
 
-    if (q->async_tx.elem) {
-        virtio_queue_set_notification(q->tx_vq, 0);
-        return num_packets;
+    /* Link-layer header */
+    if (memcmp(held, buf, pkt->l3_off)) {
+        return false;
     }
 
-    for (;;) {
-        ssize_t ret;
-        unsigned int out_num;
-        struct iovec sg[VIRTQUEUE_MAX_SIZE], sg2[VIRTQUEUE_MAX_SIZE + 1], *out_sg;
-        struct virtio_net_hdr_mrg_rxbuf mhdr;
+    /* Everything in the IP header but lengths, ID and checksum */
+    if (pkt->is_ip6) {
+        size_t plen = offsetof(struct ip6_header,
+                               ip6_ctlun.ip6_un1.ip6_un1_plen);
+        size_t nxt = offsetof(struct ip6_header,
+                              ip6_ctlun.ip6_un1.ip6_un1_nxt);
 
-        elem = virtqueue_pop(q->tx_vq, sizeof(VirtQueueElement));
-        if (!elem) {
-            break;
+        if (memcmp(held_l3, l3, plen) ||
+            memcmp(held_l3 + nxt, l3 + nxt,
+                   sizeof(struct ip6_header) - nxt)) {
+            return false;
         }
-
-        out_num = elem->out_num;
-        out_sg = elem->out_sg;
-        if (out_num < 1) {
-            virtio_error(vdev, "virtio-net header not in first element");
-            virtqueue_detach_element(q->tx_vq, elem, 0);
-            g_free(elem);
-            return -EINVAL;
+    } else {
+        size_t len = offsetof(struct ip_header, ip_len);
+        size_t off = offsetof(struct ip_header, ip_off);
+        size_t sum = offsetof(struct ip_header, ip_sum);
+        size_t src = offsetof(struct ip_header, ip_src);
+
+        if (memcmp(held_l3, l3, len) ||
+            memcmp(held_l3 + off, l3 + off, sum - off) ||
+            memcmp(held_l3 + src, l3 + src, sizeof(struct ip_header) - src)) {
+            return false;
         }
+    }
 
-        if (n->has_vnet_hdr) {
-            if (iov_to_buf(out_sg, out_num, 0, &mhdr, n->guest_hdr_len) <
-                n->guest_hdr_len) {
-                virtio_error(vdev, "virtio-net header incorrect");
-                virtqueue_detach_element(q->tx_vq, elem, 0);
-                g_free(elem);
-                return -EINVAL;
-            }
-            if (n->needs_vnet_hdr_swap) {
-                virtio_net_hdr_swap(vdev, (void *) &mhdr);
-                sg2[0].iov_base = &mhdr;
-                sg2[0].iov_len = n->guest_hdr_len;
-                out_num = iov_copy(&sg2[1], ARRAY_SIZE(sg2) - 1,
-                                   out_sg, out_num,
-                                   n->guest_hdr_len, -1);
-                if (out_num == VIRTQUEUE_MAX_SIZE) {
-                    goto drop;
-		}
-                out_num += 1;
-                out_sg = sg2;
-	    }
-        }
-        /*
-         * If host wants to see the guest header as is, we can
-         * pass it on unchanged. Otherwise, copy just the parts
-         * that host is interested in.
-         */
-        assert(n->host_hdr_len <= n->guest_hdr_len);
-        if (n->host_hdr_len != n->guest_hdr_len) {
-            unsigned sg_num = iov_copy(sg, ARRAY_SIZE(sg),
-                                       out_sg, out_num,
-                                       0, n->host_hdr_len);
-            sg_num += iov_copy(sg + sg_num, ARRAY_SIZE(sg) - sg_num,
-                             out_sg, out_num,
-                             n->guest_hdr_len, -1);
-            out_num = sg_num;
-            out_sg = sg;
-        }
-
-        ret = qemu_sendv_packet_async(qemu_get_subqueue(n->nic, queue_index),
-                                      out_sg, out_num, virtio_net_tx_complete);
-        if (ret == 0) {
-            virtio_queue_set_notification(q->tx_vq, 0);
-            q->async_tx.elem = elem;
-            return -EBUSY;
-        }
+    /* Ports, acknowledgment number and options */
+    return !memcmp(held_l4, l4, offsetof(struct tcp_header, th_seq)) &&
+           !memcmp(held_l4 + offsetof(struct tcp_header, th_ack),
+                   l4 + offsetof(struct tcp_header, th_ack),
+                   sizeof(uint32_t)) &&
+           !memcmp(held_l4 + sizeof(struct tcp_header),
+                   l4 + sizeof(struct tcp_header),
+                   pkt->l5_off - pkt->l4_off - sizeof(struct tcp_header));
+}
 
-drop:
-        virtqueue_push(q->tx_vq, elem, 0);
-        virtio_notify(vdev, q->tx_vq);
-        g_free(elem);
+static void virtio_net_gro_append(VirtIONetQueue *q, const uint8_t *buf,
+                                  const VirtIONetGROPkt *pkt)
+{
+    size_t payload = pkt->len - pkt->l5_off;
+    uint8_t *held_l4 = q->gro.buf + q->gro.l4_off;
 
-        if (++num_packets >= n->tx_burst) {
-            break;
-        }
+    memcpy(q->gro.buf + q->gro.size, buf + pkt->l5_off, payload);
+    q->gro.size += payload;
+    q->gro.next_seq += payload;
+    q->gro.segs++;
+
+    /* The last segment has the most recent window, and maybe PSH */
+    memcpy(held_l4 + offsetof(struct tcp_header, th_win),
+           buf + pkt->l4_off + offsetof(struct tcp_header, th_win),
+           sizeof(uint16_t));
+    if (pkt->push) {
+        stw_be_p(held_l4 + offsetof(struct tcp_header, th_offset_flags),
+                 lduw_be_p(held_l4 + offsetof(struct tcp_header,
+                                              th_offset_flags)) | TH_PUSH);
     }
-    return num_packets;
 }
 
-static void virtio_net_handle_tx_timer(VirtIODevice *vdev, VirtQueue *vq)
+static void virtio_net_gro_hold(VirtIONetQueue *q, const uint8_t *buf,
+                                const VirtIONetGROPkt *pkt)
 {
-    VirtIONet *n = VIRTIO_NET(vdev);
-    VirtIONetQueue *q = &n->vqs[vq2q(virtio_get_queue_index(vq))];
-
-    if (unlikely((n->status & VIRTIO_NET_S_LINK_UP) == 0)) {
-        virtio_net_drop_tx_queue_data(vdev, vq);
-        return;
+    if (!q->gro.buf) {
+        q->gro.buf = g_malloc(ETH_MAX_L2_HDR_LEN + VIRTIO_NET_GRO_MAX_LEN);
     }
 
-    /* This happens when device was stopped but VCPU wasn't. */
-    if (!vdev->vm_running) {
-        q->tx_waiting = 1;
-        return;
-    }
+    memcpy(q->gro.buf, buf, pkt->len);
+    q->gro.size = pkt->len;
+    q->gro.l3_off = pkt->l3_off;
+    q->gro.l4_off = pkt->l4_off;
+    q->gro.l5_off = pkt->l5_off;
+    q->gro.mss = pkt->len - pkt->l5_off;
+    q->gro.next_seq = pkt->seq + q->gro.mss;
+    q->gro.segs = 1;
+    q->gro.is_ip6 = pkt->is_ip6;
+    qemu_bh_schedule(q->gro.bh);
+}
 
-    if (q->tx_waiting) {
+/* Hand the held packet, if any, to the guest.  Returns false if it has
+ * to wait for RX buffers.
+ */
+static bool virtio_net_gro_flush(VirtIONetQueue *q)
+{
+    VirtIONet *n = q->n;
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    struct virtio_net_hdr hdr;
+    uint8_t *l3, *l4;
+    size_t l4_len;
+    uint32_t sum, cso;
+    ssize_t r;
+
+    if (!q->gro.size) {
+        return true;
+    }
+
+    /* Only drop it if the driver gave up the queue.  A stopped VM still
+     * gets it, see virtio_net_set_status().
+     */
+    if (!(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK) ||
+        !virtio_queue_ready(q->rx_vq) ||
+        vq2q(virtio_get_queue_index(q->rx_vq)) >= n->curr_queues) {
+        q->gro.size = 0;
+        return true;
+    }
+
+    if (q->gro.segs == 1) {
+        r = virtio_net_receive_buf(q, NULL, NULL, q->gro.buf, q->gro.size);
+        goto out;
+    }
+
+    l3 = q->gro.buf + q->gro.l3_off;
+    l4 = q->gro.buf + q->gro.l4_off;
+    l4_len = q->gro.size - q->gro.l4_off;
+    if (q->gro.is_ip6) {
+        stw_be_p(l3 + offsetof(struct ip6_header,
+                               ip6_ctlun.ip6_un1.ip6_un1_plen), l4_len);
+        sum = eth_calc_ip6_pseudo_hdr_csum((struct ip6_header *)l3, l4_len,
+                                           IP_PROTO_TCP, &cso);
+        hdr.gso_type = VIRTIO_NET_HDR_GSO_TCPV6;
+    } else {
+        stw_be_p(l3 + offsetof(struct ip_header, ip_len),
+                 q->gro.size - q->gro.l3_off);
+        eth_fix_ip4_checksum(l3, q->gro.l4_off - q->gro.l3_off);
+        sum = eth_calc_ip4_pseudo_hdr_csum((struct ip_header *)l3, l4_len,
+                                           &cso);
+        hdr.gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+    }
+
+    /* The guest completes the checksum from csum_start onwards */
+    stw_be_p(l4 + offsetof(struct tcp_header, th_sum),
+             (uint16_t)~net_checksum_finish(sum));
+    hdr.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    hdr.hdr_len = q->gro.l5_off;
+    hdr.gso_size = q->gro.mss;
+    hdr.csum_start = q->gro.l4_off;
+    hdr.csum_offset = offsetof(struct tcp_header, th_sum);
+    virtio_net_hdr_swap(VIRTIO_DEVICE(n), &hdr);
+
+    r = virtio_net_receive_buf(q, &hdr, NULL, q->gro.buf, q->gro.size);
+out:
+    if (r == 0) {
+        return false;
+    }
+    q->gro.size = 0;
+    return true;
+}
+
+static void virtio_net_gro_bh(void *opaque)
+{
+    VirtIONetQueue *q = opaque;
+
+    /* Guest memory must not change while the VM is stopped; the packet is
+     * retried when it runs again.
+     */
+    if (!VIRTIO_DEVICE(q->n)->vm_running) {
+        return;
+    }
+
+    rcu_read_lock();
+    virtio_net_gro_flush(q);
+    rcu_read_unlock();
+}
+
+static ssize_t virtio_net_gro_receive(VirtIONetQueue *q,
+                                      const VirtIONetRxHash *hash,
+                                      const uint8_t *buf, size_t size)
+{
+    VirtIONetGROPkt pkt;
+    bool mergeable;
+
+    if (!receive_filter(q->n, buf, size)) {
+        return size;
+    }
+
+    mergeable = virtio_net_gro_parse(q->n, buf, size, &pkt);
+    if (mergeable && q->gro.size && virtio_net_gro_match(q, buf, &pkt)) {
+        virtio_net_gro_append(q, buf, &pkt);
+        if (pkt.push || pkt.len - pkt.l5_off < q->gro.mss) {
+            virtio_net_gro_flush(q);
+        }
+        return size;
+    }
+
+    /* Anything else must not overtake the held packet */
+    if (!virtio_net_gro_flush(q)) {
+        return 0;
+    }
+
+    if (!mergeable || pkt.push) {
+        return virtio_net_receive_buf(q, NULL, hash, buf, size);
+    }
+    virtio_net_gro_hold(q, buf, &pkt);
+    return size;
+}
+
+static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
+                                      size_t size)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    VirtIONetRxHash hash, *phash = NULL;
+
+    if (!virtio_net_can_receive(nc)) {
+        return -1;
+    }
+
+    if (n->rss_data.redirect || n->rss_data.populate_hash) {
+        virtio_net_rss_hash(n, buf + n->host_hdr_len,
+                            size - n->host_hdr_len, &hash);
+        phash = &hash;
+    }
+
+    if (n->rss_data.redirect) {
+        q = &n->vqs[virtio_net_rss_queue(n, &hash)];
+        if (!virtio_queue_ready(q->rx_vq)) {
+            return size;
+        }
+    }
+
+    if (n->rx_gro && !n->has_vnet_hdr) {
+        return virtio_net_gro_receive(q, phash, buf, size);
+    }
+    return virtio_net_receive_buf(q, NULL, phash, buf, size);
+}
+
+static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf,
+                                  size_t size)
+{
+    ssize_t r;
+
+    rcu_read_lock();
+    r = virtio_net_receive_rcu(nc, buf, size);
+    rcu_read_unlock();
+    return r;
+}
+
+/* Receive a batch of packets from the backend, with a single interrupt
+ * for each RX queue they land on.
+ */
+static int virtio_net_receive_batch(NetClientState *nc,
+                                    const NetPacketVec *pkts, int count)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    int first = nc->queue_index, last = nc->queue_index + 1;
+    uint8_t *buf = NULL;
+    ssize_t r;
+    size_t size;
+    int i, j;
+
+    /* With RSS, all queues share the AioContext of @nc */
+    if (n->rss_data.redirect) {
+        first = 0;
+        last = n->curr_queues;
+    }
+
+    rcu_read_lock();
+    for (j = first; j < last; j++) {
+        n->vqs[j].rx_batching = true;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (pkts[i].iovcnt == 1) {
+            r = virtio_net_receive_rcu(nc, pkts[i].iov[0].iov_base,
+                                       pkts[i].iov[0].iov_len);
+        } else {
+            size = iov_size(pkts[i].iov, pkts[i].iovcnt);
+            if (size > NET_BUFSIZE) {
+                continue;
+            }
+            buf = g_realloc(buf, size);
+            iov_to_buf(pkts[i].iov, pkts[i].iovcnt, 0, buf, size);
+            r = virtio_net_receive_rcu(nc, buf, size);
+        }
+        if (r == 0) {
+            break;
+        }
+    }
+
+    for (j = first; j < last; j++) {
+        VirtIONetQueue *q = &n->vqs[j];
+
+        q->rx_batching = false;
+        if (q->rx_notify_pending) {
+            q->rx_notify_pending = false;
+            virtio_net_notify(n, q->rx_vq);
+        }
+    }
+    rcu_read_unlock();
+
+    g_free(buf);
+    return i;
+}
+
+static int32_t virtio_net_flush_tx(VirtIONetQueue *q);
+
+static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+
+    virtqueue_push(q->tx_vq, q->async_tx.elem, 0);
+    virtio_net_notify(n, q->tx_vq);
+
+    virtqueue_free_element(q->tx_vq, q->async_tx.elem);
+    q->async_tx.elem = NULL;
+
+    virtio_queue_set_notification(q->tx_vq, 1);
+    virtio_net_flush_tx(q);
+}
+
+/* TX */
+
+/* Send one buffer.  Returns 1 if @elem can be returned to the guest, 0 if
+ * the packet was queued by the backend and -EINVAL if the device was
+ * marked broken.
+ */
+static int virtio_net_tx_one(VirtIONetQueue *q, VirtQueueElement *elem)
+{
+    VirtIONet *n = q->n;
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
+    unsigned int out_num;
+    struct iovec sg[VIRTQUEUE_MAX_SIZE], sg2[VIRTQUEUE_MAX_SIZE + 1], *out_sg;
+    struct virtio_net_hdr_v1_hash mhdr;
+
+    out_num = elem->out_num;
+    out_sg = elem->out_sg;
+    if (out_num < 1) {
+        virtio_error(vdev, "virtio-net header not in first element");
+        return -EINVAL;
+    }
+
+    if (n->has_vnet_hdr) {
+        if (iov_to_buf(out_sg, out_num, 0, &mhdr, n->guest_hdr_len) <
+            n->guest_hdr_len) {
+            virtio_error(vdev, "virtio-net header incorrect");
+            return -EINVAL;
+        }
+        if (n->needs_vnet_hdr_swap) {
+            virtio_net_hdr_swap(vdev, (void *) &mhdr);
+            sg2[0].iov_base = &mhdr;
+            sg2[0].iov_len = n->guest_hdr_len;
+            out_num = iov_copy(&sg2[1], ARRAY_SIZE(sg2) - 1,
+                               out_sg, out_num,
+                               n->guest_hdr_len, -1);
+            if (out_num == VIRTQUEUE_MAX_SIZE) {
+                /* drop */
+                return 1;
+            }
+            out_num += 1;
+            out_sg = sg2;
+        }
+    }
+    /*
+     * If host wants to see the guest header as is, we can
+     * pass it on unchanged. Otherwise, copy just the parts
+     * that host is interested in.
+     */
+    assert(n->host_hdr_len <= n->guest_hdr_len);
+    if (n->host_hdr_len != n->guest_hdr_len) {
+        unsigned sg_num = iov_copy(sg, ARRAY_SIZE(sg),
+                                   out_sg, out_num,
+                                   0, n->host_hdr_len);
+        sg_num += iov_copy(sg + sg_num, ARRAY_SIZE(sg) - sg_num,
+                         out_sg, out_num,
+                         n->guest_hdr_len, -1);
+        out_num = sg_num;
+        out_sg = sg;
+    }
+
+    return qemu_sendv_packet_async(qemu_get_subqueue(n->nic, queue_index),
+                                   out_sg, out_num,
+                                   virtio_net_tx_complete) ? 1 : 0;
+}
+
+/* Send @count buffers.  Returns how many of them can be returned to the
+ * guest; if that is short of @count, *ret is the virtio_net_tx_one()
+ * result for the first buffer that cannot.
+ */
+static unsigned int virtio_net_tx_batch(VirtIONetQueue *q,
+                                        VirtQueueElement **elems,
+                                        unsigned int count, int *ret)
+{
+    VirtIONet *n = q->n;
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
+    NetPacketVec pkts[VIRTIO_NET_TX_BATCH];
+    unsigned int i, sent;
+
+    /* Buffers whose header must be rewritten go out one at a time */
+    if (n->host_hdr_len != n->guest_hdr_len || n->needs_vnet_hdr_swap) {
+        for (i = 0; i < count; i++) {
+            *ret = virtio_net_tx_one(q, elems[i]);
+            if (*ret <= 0) {
+                break;
+            }
+        }
+        return i;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (elems[i]->out_num < 1) {
+            virtio_error(vdev, "virtio-net header not in first element");
+            break;
+        }
+        if (n->has_vnet_hdr &&
+            iov_size(elems[i]->out_sg, elems[i]->out_num) < n->guest_hdr_len) {
+            virtio_error(vdev, "virtio-net header incorrect");
+            break;
+        }
+        pkts[i].iov = elems[i]->out_sg;
+        pkts[i].iovcnt = elems[i]->out_num;
+    }
+
+    sent = qemu_sendv_packet_batch_async(qemu_get_subqueue(n->nic,
+                                                           queue_index),
+                                         pkts, i, virtio_net_tx_complete);
+    if (sent < i) {
+        *ret = 0;
+        return sent;
+    }
+    *ret = i < count ? -EINVAL : 1;
+    return i;
+}
+
+static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
+{
+    VirtIONet *n = q->n;
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    VirtQueueElement *elems[VIRTIO_NET_TX_BATCH];
+    int32_t num_packets = 0;
+
+    if (!(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK)) {
+        return num_packets;
+    }
+
+    if (q->async_tx.elem) {
+        virtio_queue_set_notification(q->tx_vq, 0);
+        return num_packets;
+    }
+
+    q->tx_stats.flushes++;
+    while (num_packets < q->tx_burst) {
+        unsigned int count, done, i;
+        int ret = 1;
+
+        count = virtqueue_pop_batch(q->tx_vq, sizeof(VirtQueueElement),
+                                    (void **)elems,
+                                    MIN(VIRTIO_NET_TX_BATCH,
+                                        q->tx_burst - num_packets));
+        if (!count) {
+            break;
+        }
+
+        done = virtio_net_tx_batch(q, elems, count, &ret);
+
+        /* Complete the whole prefix that went out with one notification. */
+        if (done) {
+            virtqueue_push_batch(q->tx_vq, elems, NULL, done);
+            virtio_net_notify(n, q->tx_vq);
+            for (i = 0; i < done; i++) {
+                virtqueue_free_element(q->tx_vq, elems[i]);
+            }
+            num_packets += done;
+            q->tx_stats.packets += done;
+        }
+
+        if (ret < 0) {
+            for (i = done; i < count; i++) {
+                virtqueue_detach_element(q->tx_vq, elems[i], 0);
+                virtqueue_free_element(q->tx_vq, elems[i]);
+            }
+            return -EINVAL;
+        }
+
+        if (ret == 0) {
+            /* Hand back what we did not get to, newest first. */
+            for (i = count - 1; i > done; i--) {
+                virtqueue_unpop(q->tx_vq, elems[i], 0);
+                virtqueue_free_element(q->tx_vq, elems[i]);
+            }
+            virtio_queue_set_notification(q->tx_vq, 0);
+            q->async_tx.elem = elems[done];
+            return -EBUSY;
+        }
+    }
+
+    if (num_packets >= q->tx_burst) {
+        q->tx_stats.full_bursts++;
+    }
+    return num_packets;
+}
+
+/* tx=adaptive: tune the burst size and the time for which notifications
+ * stay disabled after a flush, from the number of packets it found.
+ * A full burst means there is a backlog, so the burst grows up to
+ * x-txburst; an empty flush lets it shrink back.  Many packets per
+ * flush mean that the guest is streaming, and waiting a little longer
+ * before re-enabling notifications saves exits; a single packet per
+ * flush means request/response traffic, where notifications should be
+ * re-enabled right away.
+ */
+static void virtio_net_tx_adapt(VirtIONetQueue *q, int32_t packets)
+{
+    VirtIONet *n = q->n;
+    int32_t min_burst = MIN(VIRTIO_NET_TX_BATCH, n->tx_burst);
+    int32_t burst = q->tx_burst;
+    int64_t delay = q->tx_adapt.delay;
+
+    if (packets >= burst) {
+        burst = MIN(burst * 2, n->tx_burst);
+    } else if (packets == 0) {
+        burst = MAX(burst / 2, min_burst);
+        delay /= 2;
+    } else if (packets >= VIRTIO_NET_TX_ADAPT_BULK) {
+        delay = MIN(MAX(delay * 2, VIRTIO_NET_TX_ADAPT_MIN_DELAY),
+                    n->tx_timeout);
+    } else if (packets == 1) {
+        delay /= 2;
+    }
+    if (delay < VIRTIO_NET_TX_ADAPT_MIN_DELAY) {
+        delay = 0;
+    }
+
+    if (burst != q->tx_burst || delay != q->tx_adapt.delay) {
+        trace_virtio_net_tx_adapt(q, packets, burst, delay);
+        q->tx_burst = burst;
+        q->tx_adapt.delay = delay;
+    }
+}
+
+static void virtio_net_handle_tx_timer(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtIONet *n = VIRTIO_NET(vdev);
+    VirtIONetQueue *q = &n->vqs[vq2q(virtio_get_queue_index(vq))];
+
+    q->tx_stats.kicks++;
+
+    if (unlikely((n->status & VIRTIO_NET_S_LINK_UP) == 0)) {
+        virtio_net_drop_tx_queue_data(vdev, vq);
+        return;
+    }
+
+    /* This happens when device was stopped but VCPU wasn't. */
+    if (!vdev->vm_running) {
+        q->tx_waiting = 1;
+        return;
+    }
+
+    if (q->tx_waiting) {
         virtio_queue_set_notification(vq, 1);
         timer_del(q->tx_timer);
         q->tx_waiting = 0;
@@ -1453,6 +2429,8 @@ static void virtio_net_handle_tx_bh(VirtIODevice *vdev, VirtQueue *vq)
     VirtIONet *n = VIRTIO_NET(vdev);
     VirtIONetQueue *q = &n->vqs[vq2q(virtio_get_queue_index(vq))];
 
+    q->tx_stats.kicks++;
+
     if (unlikely((n->status & VIRTIO_NET_S_LINK_UP) == 0)) {
         virtio_net_drop_tx_queue_data(vdev, vq);
         return;
@@ -1498,7 +2476,7 @@ static void virtio_net_tx_bh(void *opaque)
     VirtIONetQueue *q = opaque;
     VirtIONet *n = q->n;
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
-    int32_t ret;
+    int32_t ret, burst;
 
     /* This happens when device was stopped but BH wasn't. */
     if (!vdev->vm_running) {
@@ -1520,9 +2498,25 @@ static void virtio_net_tx_bh(void *opaque)
                  * broken */
     }
 
+    burst = q->tx_burst;
+    if (n->tx_mode == VIRTIO_NET_TX_MODE_ADAPTIVE) {
+        virtio_net_tx_adapt(q, ret);
+        if (ret < burst && q->tx_adapt.delay) {
+            /* Expect more packets soon: poll for them later, without
+             * taking notifications in the meantime. */
+            trace_virtio_net_tx_defer(q, q->tx_adapt.delay);
+            q->tx_stats.deferrals++;
+            timer_mod(q->tx_adapt.timer,
+                      qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+                      q->tx_adapt.delay);
+            q->tx_waiting = 1;
+            return;
+        }
+    }
+
     /* If we flush a full burst of packets, assume there are
      * more coming and immediately reschedule */
-    if (ret >= n->tx_burst) {
+    if (ret >= burst) {
         qemu_bh_schedule(q->tx_bh);
         q->tx_waiting = 1;
         return;
@@ -1549,7 +2543,7 @@ static void virtio_net_add_queue(VirtIONet *n, int index)
     n->vqs[index].rx_vq = virtio_add_queue(vdev, n->net_conf.rx_queue_size,
                                            virtio_net_handle_rx);
 
-    if (n->net_conf.tx && !strcmp(n->net_conf.tx, "timer")) {
+    if (n->tx_mode == VIRTIO_NET_TX_MODE_TIMER) {
         n->vqs[index].tx_vq =
             virtio_add_queue(vdev, n->net_conf.tx_queue_size,
                              virtio_net_handle_tx_timer);
@@ -1561,10 +2555,17 @@ static void virtio_net_add_queue(VirtIONet *n, int index)
             virtio_add_queue(vdev, n->net_conf.tx_queue_size,
                              virtio_net_handle_tx_bh);
         n->vqs[index].tx_bh = qemu_bh_new(virtio_net_tx_bh, &n->vqs[index]);
+        if (n->tx_mode == VIRTIO_NET_TX_MODE_ADAPTIVE) {
+            n->vqs[index].tx_adapt.timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
+                                                        virtio_net_tx_bh,
+                                                        &n->vqs[index]);
+        }
     }
+    n->vqs[index].gro.bh = qemu_bh_new(virtio_net_gro_bh, &n->vqs[index]);
 
     n->vqs[index].tx_waiting = 0;
     n->vqs[index].n = n;
+    virtio_net_tx_adapt_reset(&n->vqs[index]);
 }
 
 static void virtio_net_del_queue(VirtIONet *n, int index)
@@ -1584,7 +2585,17 @@ static void virtio_net_del_queue(VirtIONet *n, int index)
         qemu_bh_delete(q->tx_bh);
         q->tx_bh = NULL;
     }
+    if (q->tx_adapt.timer) {
+        timer_del(q->tx_adapt.timer);
+        timer_free(q->tx_adapt.timer);
+        q->tx_adapt.timer = NULL;
+    }
     q->tx_waiting = 0;
+    qemu_bh_delete(q->gro.bh);
+    q->gro.bh = NULL;
+    g_free(q->gro.buf);
+    q->gro.buf = NULL;
+    q->gro.size = 0;
     virtio_del_queue(vdev, index * 2 + 1);
 }
 
@@ -1633,6 +2644,466 @@ static void virtio_net_set_multiqueue(VirtIONet *n, int multiqueue)
     virtio_net_set_queues(n);
 }
 
+/*
+ * Dataplane: with iothread=, each queue pair is processed by an IOThread
+ * together with the backend it is attached to.  Both sides then run
+ * with the AioContext of that IOThread acquired, instead of the BQL.
+ * The control queue stays in the main loop.
+ *
+ * Without iothread=, a tap backend started with worker=on, or a netmap
+ * backend started with iothread=, supplies the IOThread of each queue
+ * pair instead.
+ */
+
+/* Context: QEMU global mutex held */
+static void virtio_net_dataplane_setup_iothreads(VirtIONet *n, Error **errp)
+{
+    char **ids;
+    int i, num;
+
+    ids = g_strsplit(n->net_conf.iothread, ":", -1);
+    num = g_strv_length(ids);
+    if (!num) {
+        error_setg(errp, "iothread needs at least one IOThread id");
+        g_strfreev(ids);
+        return;
+    }
+    /* RSS moves packets between queues, which must share a context */
+    if (num > 1 && virtio_has_feature(n->host_features, VIRTIO_NET_F_RSS)) {
+        error_setg(errp, "rss needs all queues in a single IOThread");
+        g_strfreev(ids);
+        return;
+    }
+
+    n->iothreads = g_new0(IOThread *, num);
+    for (i = 0; i < num; i++) {
+        IOThread *iothread = iothread_by_id(ids[i]);
+
+        if (!iothread) {
+            error_setg(errp, "Cannot find iothread '%s'", ids[i]);
+            break;
+        }
+        object_ref(OBJECT(iothread));
+        n->iothreads[n->num_iothreads++] = iothread;
+    }
+    g_strfreev(ids);
+}
+
+static IOThread *virtio_net_peer_worker(NetClientState *peer)
+{
+    if (!peer) {
+        return NULL;
+    }
+    switch (peer->info->type) {
+    case NET_CLIENT_DRIVER_TAP:
+        return tap_get_worker(peer);
+#ifdef CONFIG_NETMAP
+    case NET_CLIENT_DRIVER_NETMAP:
+        return netmap_get_iothread(peer);
+#endif
+    default:
+        return NULL;
+    }
+}
+
+/* Context: QEMU global mutex held */
+static void virtio_net_dataplane_setup_workers(VirtIONet *n, Error **errp)
+{
+    int i, num = n->nic_conf.peers.queues;
+
+    /* RSS moves packets between queues, which must share a context */
+    if (virtio_has_feature(n->host_features, VIRTIO_NET_F_RSS)) {
+        num = 1;
+    }
+
+    n->iothreads = g_new0(IOThread *, num);
+    for (i = 0; i < num; i++) {
+        NetClientState *peer = n->nic_conf.peers.ncs[i];
+        IOThread *worker = virtio_net_peer_worker(peer);
+
+        if (!worker) {
+            error_setg(errp, "netdev '%s' has no worker thread",
+                       peer ? peer->name : "");
+            return;
+        }
+        object_ref(OBJECT(worker));
+        n->iothreads[n->num_iothreads++] = worker;
+    }
+}
+
+/* Context: QEMU global mutex held */
+static void virtio_net_dataplane_setup(VirtIONet *n, Error **errp)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    BusState *qbus = qdev_get_parent_bus(DEVICE(vdev));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int i;
+
+    if (!k->set_guest_notifiers || !k->ioeventfd_assign) {
+        error_setg(errp,
+                   "device is incompatible with iothread "
+                   "(transport does not support notifiers)");
+        return;
+    }
+    if (!virtio_device_ioeventfd_enabled(vdev)) {
+        error_setg(errp, "ioeventfd is required for iothread");
+        return;
+    }
+
+    for (i = 0; i < n->nic_conf.peers.queues; i++) {
+        NetClientState *peer = n->nic_conf.peers.ncs[i];
+
+        if (!peer) {
+            continue;
+        }
+        if (get_vhost_net(peer)) {
+            error_setg(errp, "iothread is incompatible with vhost");
+            return;
+        }
+        if (!peer->info->set_aio_context) {
+            error_setg(errp, "netdev '%s' does not support iothread",
+                       peer->name);
+            return;
+        }
+        if (!QTAILQ_EMPTY(&peer->filters)) {
+            error_setg(errp, "iothread is incompatible with the filters "
+                       "of netdev '%s'", peer->name);
+            return;
+        }
+        /* Lets a netmap backend know that we will move it. */
+        virtio_net_peer_worker(peer);
+    }
+
+    if (n->net_conf.iothread) {
+        virtio_net_dataplane_setup_iothreads(n, errp);
+    } else {
+        virtio_net_dataplane_setup_workers(n, errp);
+    }
+
+    /* The data queues use plain irqfds, with no masking support. */
+    vdev->use_guest_notifier_mask = false;
+}
+
+/* Context: QEMU global mutex held */
+static void virtio_net_dataplane_cleanup(VirtIONet *n)
+{
+    int i;
+
+    assert(!n->dataplane_started);
+    for (i = 0; i < n->num_iothreads; i++) {
+        object_unref(OBJECT(n->iothreads[i]));
+    }
+    g_free(n->iothreads);
+    n->iothreads = NULL;
+    n->num_iothreads = 0;
+}
+
+static void virtio_net_dataplane_tx_bh(void *opaque)
+{
+    VirtIONetQueue *q = opaque;
+
+    aio_context_acquire(q->ctx);
+    virtio_net_tx_bh(q);
+    aio_context_release(q->ctx);
+}
+
+static void virtio_net_dataplane_gro_bh(void *opaque)
+{
+    VirtIONetQueue *q = opaque;
+
+    aio_context_acquire(q->ctx);
+    virtio_net_gro_bh(q);
+    aio_context_release(q->ctx);
+}
+
+static void virtio_net_dataplane_tx_timer(void *opaque)
+{
+    VirtIONetQueue *q = opaque;
+
+    aio_context_acquire(q->ctx);
+    virtio_net_tx_timer(q);
+    aio_context_release(q->ctx);
+}
+
+static bool virtio_net_dataplane_handle_rx(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtIONet *n = VIRTIO_NET(vdev);
+    VirtIONetQueue *q = &n->vqs[vq2q(virtio_get_queue_index(vq))];
+
+    assert(n->dataplane_started);
+    aio_context_acquire(q->ctx);
+    virtio_net_handle_rx(vdev, vq);
+    aio_context_release(q->ctx);
+    return true;
+}
+
+static bool virtio_net_dataplane_handle_tx(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtIONet *n = VIRTIO_NET(vdev);
+    VirtIONetQueue *q = &n->vqs[vq2q(virtio_get_queue_index(vq))];
+
+    assert(n->dataplane_started);
+    aio_context_acquire(q->ctx);
+    if (q->tx_timer) {
+        virtio_net_handle_tx_timer(vdev, vq);
+    } else {
+        virtio_net_handle_tx_bh(vdev, vq);
+    }
+    aio_context_release(q->ctx);
+    return true;
+}
+
+static bool virtio_net_dataplane_handle_ctrl(VirtIODevice *vdev,
+                                             VirtQueue *vq)
+{
+    virtio_net_handle_ctrl(vdev, vq);
+    return true;
+}
+
+/* Free the TX bottom half or timer and the RX coalescing bottom half of
+ * @q.  Must run in the thread that would otherwise execute them.
+ */
+static void virtio_net_queue_detach_bhs(VirtIONetQueue *q)
+{
+    if (q->tx_timer) {
+        timer_del(q->tx_timer);
+        timer_free(q->tx_timer);
+        q->tx_timer = NULL;
+    } else {
+        qemu_bh_delete(q->tx_bh);
+        q->tx_bh = NULL;
+    }
+    if (q->tx_adapt.timer) {
+        timer_del(q->tx_adapt.timer);
+        timer_free(q->tx_adapt.timer);
+        q->tx_adapt.timer = NULL;
+    }
+    qemu_bh_delete(q->gro.bh);
+    q->gro.bh = NULL;
+}
+
+/* Create the bottom halves and timer of @q in @ctx, or in the main loop
+ * if @ctx is NULL, and carry over any pending transmission or held
+ * RX packet.
+ */
+static void virtio_net_queue_attach_bhs(VirtIONetQueue *q, AioContext *ctx)
+{
+    VirtIONet *n = q->n;
+
+    q->ctx = ctx;
+    if (n->tx_mode == VIRTIO_NET_TX_MODE_TIMER) {
+        if (ctx) {
+            q->tx_timer = aio_timer_new(ctx, QEMU_CLOCK_VIRTUAL, SCALE_NS,
+                                        virtio_net_dataplane_tx_timer, q);
+        } else {
+            q->tx_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
+                                       virtio_net_tx_timer, q);
+        }
+        if (q->tx_waiting) {
+            timer_mod(q->tx_timer,
+                      qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + n->tx_timeout);
+        }
+    } else {
+        if (ctx) {
+            q->tx_bh = aio_bh_new(ctx, virtio_net_dataplane_tx_bh, q);
+        } else {
+            q->tx_bh = qemu_bh_new(virtio_net_tx_bh, q);
+        }
+        if (n->tx_mode == VIRTIO_NET_TX_MODE_ADAPTIVE) {
+            if (ctx) {
+                q->tx_adapt.timer = aio_timer_new(ctx, QEMU_CLOCK_VIRTUAL,
+                                                  SCALE_NS,
+                                                  virtio_net_dataplane_tx_bh,
+                                                  q);
+            } else {
+                q->tx_adapt.timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
+                                                 virtio_net_tx_bh, q);
+            }
+        }
+        if (q->tx_waiting) {
+            qemu_bh_schedule(q->tx_bh);
+        }
+    }
+
+    if (ctx) {
+        q->gro.bh = aio_bh_new(ctx, virtio_net_dataplane_gro_bh, q);
+    } else {
+        q->gro.bh = qemu_bh_new(virtio_net_gro_bh, q);
+    }
+    if (q->gro.size) {
+        qemu_bh_schedule(q->gro.bh);
+    }
+}
+
+/* Context: BH in IOThread */
+static void virtio_net_dataplane_stop_bh(void *opaque)
+{
+    VirtIONetQueue *q = opaque;
+
+    virtio_queue_aio_set_host_notifier_handler(q->rx_vq, q->ctx, NULL);
+    virtio_queue_aio_set_host_notifier_handler(q->tx_vq, q->ctx, NULL);
+    virtio_net_queue_detach_bhs(q);
+}
+
+/* Context: QEMU global mutex held */
+static int virtio_net_dataplane_start_queue(VirtIONet *n, int index)
+{
+    VirtIONetQueue *q = &n->vqs[index];
+    NetClientState *nc = qemu_get_subqueue(n->nic, index);
+    AioContext *ctx;
+    int r;
+
+    ctx = iothread_get_aio_context(n->iothreads[index % n->num_iothreads]);
+
+    /* Nothing runs in ctx on our behalf until we release it. */
+    aio_context_acquire(ctx);
+    if (nc->peer && !n->nic->peer_deleted) {
+        r = qemu_net_set_aio_context(nc->peer, ctx);
+        if (r < 0) {
+            error_report("virtio-net: netdev '%s' cannot run in an IOThread "
+                         "(%s)", nc->peer->name, strerror(-r));
+            aio_context_release(ctx);
+            return r;
+        }
+    }
+
+    virtio_net_queue_detach_bhs(q);
+    virtio_net_queue_attach_bhs(q, ctx);
+    virtio_queue_aio_set_host_notifier_handler(q->rx_vq, ctx,
+                                               virtio_net_dataplane_handle_rx);
+    virtio_queue_aio_set_host_notifier_handler(q->tx_vq, ctx,
+                                               virtio_net_dataplane_handle_tx);
+    aio_context_release(ctx);
+    return 0;
+}
+
+/* Context: QEMU global mutex held */
+static void virtio_net_dataplane_stop_queue(VirtIONet *n, int index)
+{
+    VirtIONetQueue *q = &n->vqs[index];
+    NetClientState *nc = qemu_get_subqueue(n->nic, index);
+    AioContext *ctx = q->ctx;
+
+    aio_context_acquire(ctx);
+    /* Main loop handlers of the backend only run once we return. */
+    if (nc->peer && !n->nic->peer_deleted) {
+        qemu_net_set_aio_context(nc->peer, NULL);
+    }
+    aio_wait_bh_oneshot(ctx, virtio_net_dataplane_stop_bh, q);
+    virtio_net_queue_attach_bhs(q, NULL);
+    aio_context_release(ctx);
+}
+
+/* Context: QEMU global mutex held */
+static int virtio_net_dataplane_start(VirtIODevice *vdev)
+{
+    VirtIONet *n = VIRTIO_NET(vdev);
+    BusState *qbus = qdev_get_parent_bus(DEVICE(vdev));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int queues = n->multiqueue ? n->max_queues : 1;
+    int ctrl = virtio_get_queue_index(n->ctrl_vq);
+    int i, r;
+
+    if (!n->iothreads) {
+        return virtio_device_start_ioeventfd_impl(vdev);
+    }
+    if (n->dataplane_started) {
+        return 0;
+    }
+
+    /* Set up guest notifiers (irq) of the data queues */
+    r = k->set_guest_notifiers(qbus->parent, queues * 2, true);
+    if (r != 0) {
+        error_report("virtio-net failed to set guest notifier (%d), "
+                     "ensure -accel kvm is set.", r);
+        return -ENOSYS;
+    }
+
+    /* Set up virtqueue notify */
+    for (i = 0; i < queues * 2; i++) {
+        r = virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), i, true);
+        if (r != 0) {
+            goto fail_host_notifiers;
+        }
+    }
+    r = virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), ctrl, true);
+    if (r != 0) {
+        goto fail_host_notifiers;
+    }
+
+    n->dataplane_started = true;
+
+    for (i = 0; i < queues; i++) {
+        r = virtio_net_dataplane_start_queue(n, i);
+        if (r < 0) {
+            while (i--) {
+                virtio_net_dataplane_stop_queue(n, i);
+            }
+            n->dataplane_started = false;
+            virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), ctrl, false);
+            virtio_bus_cleanup_host_notifier(VIRTIO_BUS(qbus), ctrl);
+            i = queues * 2;
+            goto fail_host_notifiers;
+        }
+    }
+    virtio_queue_aio_set_host_notifier_handler(n->ctrl_vq,
+                                               qemu_get_aio_context(),
+                                               virtio_net_dataplane_handle_ctrl);
+
+    /* Kick right away to begin processing buffers already in the vrings */
+    for (i = 0; i < queues * 2; i++) {
+        event_notifier_set(virtio_queue_get_host_notifier(
+                               virtio_get_queue(vdev, i)));
+    }
+    event_notifier_set(virtio_queue_get_host_notifier(n->ctrl_vq));
+    return 0;
+
+fail_host_notifiers:
+    error_report("virtio-net failed to start dataplane (%d)", r);
+    while (i--) {
+        virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), i, false);
+        virtio_bus_cleanup_host_notifier(VIRTIO_BUS(qbus), i);
+    }
+    k->set_guest_notifiers(qbus->parent, queues * 2, false);
+    return -ENOSYS;
+}
+
+/* Context: QEMU global mutex held */
+static void virtio_net_dataplane_stop(VirtIODevice *vdev)
+{
+    VirtIONet *n = VIRTIO_NET(vdev);
+    BusState *qbus = qdev_get_parent_bus(DEVICE(vdev));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int queues = n->multiqueue ? n->max_queues : 1;
+    int ctrl = virtio_get_queue_index(n->ctrl_vq);
+    int i;
+
+    if (!n->iothreads) {
+        virtio_device_stop_ioeventfd_impl(vdev);
+        return;
+    }
+    if (!n->dataplane_started) {
+        return;
+    }
+
+    for (i = 0; i < queues; i++) {
+        virtio_net_dataplane_stop_queue(n, i);
+    }
+    virtio_queue_aio_set_host_notifier_handler(n->ctrl_vq,
+                                               qemu_get_aio_context(), NULL);
+    n->dataplane_started = false;
+
+    for (i = 0; i < queues * 2; i++) {
+        virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), i, false);
+        virtio_bus_cleanup_host_notifier(VIRTIO_BUS(qbus), i);
+    }
+    virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), ctrl, false);
+    virtio_bus_cleanup_host_notifier(VIRTIO_BUS(qbus), ctrl);
+
+    /* Clean up guest notifiers (irq) */
+    k->set_guest_notifiers(qbus->parent, queues * 2, false);
+}
+
 static int virtio_net_post_load_device(void *opaque, int version_id)
 {
     VirtIONet *n = opaque;
@@ -1641,7 +3112,9 @@ static int virtio_net_post_load_device(void *opaque, int version_id)
 
     virtio_net_set_mrg_rx_bufs(n, n->mergeable_rx_bufs,
                                virtio_vdev_has_feature(vdev,
-                                                       VIRTIO_F_VERSION_1));
+                                                       VIRTIO_F_VERSION_1),
+                               virtio_vdev_has_feature(vdev,
+                                            VIRTIO_NET_F_HASH_REPORT));
 
     /* MAC_TABLE_ENTRIES may be different from the saved image */
     if (n->mac_table.in_use > MAC_TABLE_ENTRIES) {
@@ -1840,6 +3313,55 @@ static const VMStateDescription vmstate_virtio_net_has_vnet = {
     },
 };
 
+static bool virtio_net_rss_needed(void *opaque)
+{
+    VirtIONet *n = opaque;
+
+    return n->rss_data.redirect || n->rss_data.populate_hash;
+}
+
+static int virtio_net_rss_post_load(void *opaque, int version_id)
+{
+    VirtIONet *n = opaque;
+    VirtioNetRssData *rss = &n->rss_data;
+    int i;
+
+    if (!rss->redirect) {
+        return 0;
+    }
+    if (rss->indirections_len > VIRTIO_NET_RSS_MAX_TABLE_LEN ||
+        !is_power_of_2(rss->indirections_len) ||
+        rss->default_queue >= n->curr_queues) {
+        return -EINVAL;
+    }
+    for (i = 0; i < rss->indirections_len; i++) {
+        if (rss->indirections_table[i] >= n->curr_queues) {
+            return -EINVAL;
+        }
+    }
+    return 0;
+}
+
+static const VMStateDescription vmstate_virtio_net_rss = {
+    .name = "virtio-net-device/rss",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = virtio_net_rss_needed,
+    .post_load = virtio_net_rss_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_BOOL(rss_data.redirect, VirtIONet),
+        VMSTATE_BOOL(rss_data.populate_hash, VirtIONet),
+        VMSTATE_UINT32(rss_data.hash_types, VirtIONet),
+        VMSTATE_UINT8_ARRAY(rss_data.key, VirtIONet,
+                            VIRTIO_NET_RSS_MAX_KEY_SIZE),
+        VMSTATE_UINT16(rss_data.indirections_len, VirtIONet),
+        VMSTATE_UINT16_ARRAY(rss_data.indirections_table, VirtIONet,
+                             VIRTIO_NET_RSS_MAX_TABLE_LEN),
+        VMSTATE_UINT16(rss_data.default_queue, VirtIONet),
+        VMSTATE_END_OF_LIST()
+    },
+};
+
 static const VMStateDescription vmstate_virtio_net_device = {
     .name = "virtio-net-device",
     .version_id = VIRTIO_NET_VM_VERSION,
@@ -1890,6 +3412,10 @@ static const VMStateDescription vmstate_virtio_net_device = {
                             has_ctrl_guest_offloads),
         VMSTATE_END_OF_LIST()
    },
+    .subsections = (const VMStateDescription * []) {
+        &vmstate_virtio_net_rss,
+        NULL
+    },
 };
 
 static NetClientInfo net_virtio_info = {
@@ -1897,6 +3423,7 @@ static NetClientInfo net_virtio_info = {
     .size = sizeof(NICState),
     .can_receive = virtio_net_can_receive,
     .receive = virtio_net_receive,
+    .receive_batch = virtio_net_receive_batch,
     .link_status_changed = virtio_net_set_link_status,
     .query_rx_filter = virtio_net_query_rxfilter,
 };
@@ -2014,16 +3541,37 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
         virtio_cleanup(vdev);
         return;
     }
+
+    if (n->net_conf.iothread ||
+        virtio_net_peer_worker(n->nic_conf.peers.ncs[0])) {
+        Error *local_err = NULL;
+
+        virtio_net_dataplane_setup(n, &local_err);
+        if (local_err) {
+            error_propagate(errp, local_err);
+            virtio_net_dataplane_cleanup(n);
+            virtio_cleanup(vdev);
+            return;
+        }
+    }
+
     n->vqs = g_malloc0(sizeof(VirtIONetQueue) * n->max_queues);
     n->curr_queues = 1;
     n->tx_timeout = n->net_conf.txtimer;
+    n->tx_burst = n->net_conf.txburst;
+
+    n->tx_mode = VIRTIO_NET_TX_MODE_BH;
+    if (n->net_conf.tx) {
+        int mode = qapi_enum_parse(&VirtioNetTxMode_lookup, n->net_conf.tx,
+                                   -1, NULL);
 
-    if (n->net_conf.tx && strcmp(n->net_conf.tx, "timer")
-                       && strcmp(n->net_conf.tx, "bh")) {
-        warn_report("virtio-net: "
-                    "Unknown option tx=%s, valid options: \"timer\" \"bh\"",
-                    n->net_conf.tx);
-        error_printf("Defaulting to \"bh\"");
+        if (mode < 0) {
+            warn_report("virtio-net: Unknown option tx=%s, valid options: "
+                        "\"timer\" \"bh\" \"adaptive\"", n->net_conf.tx);
+            error_printf("Defaulting to \"bh\"");
+        } else {
+            n->tx_mode = mode;
+        }
     }
 
     n->net_conf.tx_queue_size = MIN(virtio_net_max_tx_queue_size(n),
@@ -2064,8 +3612,7 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
     qemu_format_nic_info_str(qemu_get_queue(n->nic), n->nic_conf.macaddr.a);
 
     n->vqs[0].tx_waiting = 0;
-    n->tx_burst = n->net_conf.txburst;
-    virtio_net_set_mrg_rx_bufs(n, 0, 0);
+    virtio_net_set_mrg_rx_bufs(n, 0, 0, 0);
     n->promisc = 1; /* for compatibility */
 
     n->mac_table.macs = g_malloc0(MAC_TABLE_ENTRIES * ETH_ALEN);
@@ -2076,6 +3623,7 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
     nc->rxfilter_notify_enabled = 1;
 
     n->qdev = dev;
+    QTAILQ_INSERT_TAIL(&virtio_net_devices, n, next);
 }
 
 static void virtio_net_device_unrealize(DeviceState *dev, Error **errp)
@@ -2087,6 +3635,7 @@ static void virtio_net_device_unrealize(DeviceState *dev, Error **errp)
     /* This will stop vhost backend if appropriate. */
     virtio_net_set_status(vdev, 0);
 
+    QTAILQ_REMOVE(&virtio_net_devices, n, next);
     g_free(n->netclient_name);
     n->netclient_name = NULL;
     g_free(n->netclient_type);
@@ -2104,6 +3653,7 @@ static void virtio_net_device_unrealize(DeviceState *dev, Error **errp)
     timer_free(n->announce_timer);
     g_free(n->vqs);
     qemu_del_nic(n->nic);
+    virtio_net_dataplane_cleanup(n);
     virtio_cleanup(vdev);
 }
 
@@ -2112,10 +3662,10 @@ static void virtio_net_instance_init(Object *obj)
     VirtIONet *n = VIRTIO_NET(obj);
 
     /*
-     * The default config_size is sizeof(struct virtio_net_config).
+     * The default config_size is sizeof(VirtIONetConfig).
      * Can be overriden with virtio_net_set_config_size.
      */
-    n->config_size = sizeof(struct virtio_net_config);
+    n->config_size = sizeof(VirtIONetConfig);
     device_add_bootindex_property(obj, &n->nic_conf.bootindex,
                                   "bootindex", "/ethernet-phy@0",
                                   DEVICE(n), NULL);
@@ -2143,6 +3693,76 @@ static const VMStateDescription vmstate_virtio_net = {
     .pre_save = virtio_net_pre_save,
 };
 
+static VirtioNetTxQueueInfo *virtio_net_query_tx_queue(VirtIONet *n, int i)
+{
+    VirtioNetTxQueueInfo *info = g_new0(VirtioNetTxQueueInfo, 1);
+    VirtIONetQueue *q = &n->vqs[i];
+
+    if (q->ctx) {
+        aio_context_acquire(q->ctx);
+    }
+    info->index = i;
+    info->burst = q->tx_burst;
+    if (n->tx_mode == VIRTIO_NET_TX_MODE_TIMER) {
+        info->delay = n->tx_timeout;
+    } else {
+        info->delay = q->tx_adapt.delay;
+    }
+    info->kicks = q->tx_stats.kicks;
+    info->flushes = q->tx_stats.flushes;
+    info->packets = q->tx_stats.packets;
+    info->full_bursts = q->tx_stats.full_bursts;
+    info->deferrals = q->tx_stats.deferrals;
+    if (q->ctx) {
+        aio_context_release(q->ctx);
+    }
+
+    return info;
+}
+
+VirtioNetTxInfoList *qmp_query_virtio_net_tx(bool has_name, const char *name,
+                                             Error **errp)
+{
+    VirtioNetTxInfoList *list = NULL, **tail = &list;
+    VirtIONet *n;
+
+    QTAILQ_FOREACH(n, &virtio_net_devices, next) {
+        const char *nc_name = qemu_get_queue(n->nic)->name;
+        VirtioNetTxQueueInfoList **qtail;
+        VirtioNetTxInfoList *entry;
+        VirtioNetTxInfo *info;
+        int i;
+
+        if (has_name && strcmp(nc_name, name) != 0) {
+            continue;
+        }
+
+        info = g_new0(VirtioNetTxInfo, 1);
+        info->name = g_strdup(nc_name);
+        info->mode = n->tx_mode;
+        qtail = &info->queues;
+        for (i = 0; i < (n->multiqueue ? n->max_queues : 1); i++) {
+            VirtioNetTxQueueInfoList *qentry;
+
+            qentry = g_new0(VirtioNetTxQueueInfoList, 1);
+            qentry->value = virtio_net_query_tx_queue(n, i);
+            *qtail = qentry;
+            qtail = &qentry->next;
+        }
+
+        entry = g_new0(VirtioNetTxInfoList, 1);
+        entry->value = info;
+        *tail = entry;
+        tail = &entry->next;
+    }
+
+    if (has_name && !list) {
+        error_setg(errp, "net client(%s) isn't a virtio-net device", name);
+    }
+
+    return list;
+}
+
 static Property virtio_net_properties[] = {
     DEFINE_PROP_BIT64("csum", VirtIONet, host_features,
                     VIRTIO_NET_F_CSUM, true),
@@ -2184,6 +3804,12 @@ static Property virtio_net_properties[] = {
     DEFINE_PROP_BIT64("ctrl_guest_offloads", VirtIONet, host_features,
                     VIRTIO_NET_F_CTRL_GUEST_OFFLOADS, true),
     DEFINE_PROP_BIT64("mq", VirtIONet, host_features, VIRTIO_NET_F_MQ, false),
+    DEFINE_PROP_BIT64("packed", VirtIONet, host_features,
+                      VIRTIO_F_RING_PACKED, false),
+    DEFINE_PROP_BIT64("rss", VirtIONet, host_features,
+                      VIRTIO_NET_F_RSS, false),
+    DEFINE_PROP_BIT64("hash", VirtIONet, host_features,
+                      VIRTIO_NET_F_HASH_REPORT, false),
     DEFINE_NIC_PROPERTIES(VirtIONet, nic_conf),
     DEFINE_PROP_UINT32("x-txtimer", VirtIONet, net_conf.txtimer,
                        TX_TIMER_INTERVAL),
@@ -2198,6 +3824,8 @@ static Property virtio_net_properties[] = {
                      true),
     DEFINE_PROP_INT32("speed", VirtIONet, net_conf.speed, SPEED_UNKNOWN),
     DEFINE_PROP_STRING("duplex", VirtIONet, net_conf.duplex_str),
+    DEFINE_PROP_STRING("iothread", VirtIONet, net_conf.iothread),
+    DEFINE_PROP_BOOL("rx-gro", VirtIONet, rx_gro, false),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -2220,6 +3848,8 @@ static void virtio_net_class_init(ObjectClass *klass, void *data)
     vdc->set_status = virtio_net_set_status;
     vdc->guest_notifier_mask = virtio_net_guest_notifier_mask;
     vdc->guest_notifier_pending = virtio_net_guest_notifier_pending;
+    vdc->start_ioeventfd = virtio_net_dataplane_start;
+    vdc->stop_ioeventfd = virtio_net_dataplane_stop;
     vdc->legacy_features |= (0x1 << VIRTIO_NET_F_GSO);
     vdc->vmsd = &vmstate_virtio_net_device;
 }
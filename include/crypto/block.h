@@ -75,6 +75,7 @@ typedef enum {
  * @readfunc: callback for reading data from the volume
  * @opaque: data to pass to @readfunc
  * @flags: bitmask of QCryptoBlockOpenFlags values
+ * @n_threads: allow concurrent I/O from up to @n_threads threads
  * @errp: pointer to a NULL-initialized error object
  *
  * Create a new block encryption object for an existing
@@ -94,6 +95,10 @@ typedef enum {
  * metadata such as the payload offset. There will be
  * no cipher or ivgen objects available.
  *
+ * Up to @n_threads calls to qcrypto_block_encrypt() and
+ * qcrypto_block_decrypt() may run at the same time, each
+ * with its own cipher object.
+ *
  * If any part of initializing the encryption context
  * fails an error will be returned. This could be due
  * to the volume being in the wrong format, a cipher
@@ -107,6 +112,7 @@ QCryptoBlock *qcrypto_block_open(QCryptoBlockOpenOptions *options,
                                  QCryptoBlockReadFunc readfunc,
                                  void *opaque,
                                  unsigned int flags,
+                                 size_t n_threads,
                                  Error **errp);
 
 /**
@@ -170,6 +176,9 @@ QCryptoBlockInfo *qcrypto_block_get_info(QCryptoBlock *block,
  * plain text back into @buf. @len and @offset must be
  * a multiple of the encryption format sector size.
  *
+ * This can be called from several threads at once, see
+ * qcrypto_block_open().
+ *
  * Returns 0 on success, -1 on failure
  */
 int qcrypto_block_decrypt(QCryptoBlock *block,
@@ -190,6 +199,9 @@ int qcrypto_block_decrypt(QCryptoBlock *block,
  * cipher text back into @buf. @len and @offset must be
  * a multiple of the encryption format sector size.
  *
+ * This can be called from several threads at once, see
+ * qcrypto_block_open().
+ *
  * Returns 0 on success, -1 on failure
  */
 int qcrypto_block_encrypt(QCryptoBlock *block,
@@ -26,8 +26,25 @@
 #include "net/netmap.h"
 #include "net/net.h"
 #include "exec/memory.h"
+#include "qemu/event_notifier.h"
+#include "sysemu/iothread.h"
+#include "qemu/stats64.h"
 #include "net/netmap_virt.h" /* from netmap sources */
 
+/* Number of buckets of the kick interval histogram: bucket 0 counts
+ * intervals shorter than 1us, bucket i > 0 intervals in [2^(i-1), 2^i) us,
+ * and the last bucket everything longer. */
+#define PTNETMAP_KICK_HIST_BUCKETS 24
+
+/* Per-ring statistics, maintained by the userspace sync loop and read
+ * by the monitor. */
+typedef struct PTNetmapRingStats {
+    Stat64 kicks;           /* guest --> host notifications */
+    Stat64 interrupts;      /* host --> guest notifications */
+    int64_t last_kick_ns;   /* only used by the sync loop */
+    Stat64 kick_hist[PTNETMAP_KICK_HIST_BUCKETS];
+} PTNetmapRingStats;
+
 typedef struct PTNetmapState {
     struct NetmapState *netmap;
 
@@ -35,25 +52,64 @@ typedef struct PTNetmapState {
     bool worker_started;
     QemuThread th;
 
+    /* True if the sync loop runs in userspace rather than in the
+     * kernel, and how to stop it. */
+    bool uloop;
+    bool uloop_stopping;
+    EventNotifier uloop_stop;
+
+    /* Set by the kernel sync loop if SYNC_KLOOP_START failed, so that
+     * 'fallback_bh' starts the userspace loop in its place. */
+    struct SyncKloopThreadCtx *failed_ctx;
+    QEMUBH *fallback_bh;
+
+    /* Statistics of the userspace sync loop, one entry per ring. */
+    PTNetmapRingStats *ring_stats;
+    unsigned int num_ring_stats;
+    Stat64 uloop_polls;     /* idle periods ended while busy-polling */
+    Stat64 uloop_sleeps;    /* idle periods ended by sleeping */
+
     /* Feature acknowledgement support. */
     unsigned long features;
     unsigned long acked_features;
 
-    /* Info about netmap memory. */
-    uint32_t memsize;
+    /* Info about the netmap memory seen by the guest, and the offset of
+     * the netmap_if of the port in there. */
+    uint64_t memsize;
     void *mem;
+    uint64_t nifp_offset;
+
+    /* True if the guest memory is not the netmap memory of the port, but
+     * a copy restored by an incoming migration. The guest rings are then
+     * served by the userspace sync loop, which copies the frames and keeps
+     * the guest ring pointers in 'shadow_ktoa', until the guest registers
+     * its netmap interface again. */
+    bool shadow;
+    struct nm_csb_ktoa *shadow_ktoa;
+    unsigned int num_shadow_rings;
+
+    /* True if the next start of the sync loop resumes the rings from the
+     * CSB, rather than initializing the CSB. */
+    bool resume;
 } PTNetmapState;
 
 uint32_t ptnetmap_ack_features(PTNetmapState *pt, uint32_t wanted_features);
 int ptnetmap_kloop_start(PTNetmapState *pt, void *csb_gh, void *csb_hg,
                     unsigned int num_entries, int *ioeventfds, int *irqfds);
 int ptnetmap_kloop_stop(PTNetmapState *pt);
+void ptnetmap_dirty_rings(PTNetmapState *pt, void *csb_gh, void *csb_hg,
+                          unsigned int num_entries);
+void ptnetmap_unshadow(PTNetmapState *pt);
 PTNetmapState *get_ptnetmap(NetClientState *nc);
 int netmap_get_port_info(NetClientState *nc, struct nmreq_port_info_get *nif);
 int netmap_get_hostmemid(NetClientState *nc);
 uint32_t netmap_get_nifp_offset(NetClientState *nc);
+IOThread *netmap_get_iothread(NetClientState *nc);
 
-int ptnetmap_memdev_create(void *mem_ptr, struct nmreq_pools_info *pi);
+int ptnetmap_memdev_create(void *mem_ptr, struct nmreq_pools_info *pi,
+                           bool shadow, void **guest_mem);
+void ptnetmap_memdev_set_dirty(void *ptr, uint64_t len);
+int ptnetmap_memdev_unshadow(void *guest_mem, void *mem_ptr);
 
 #undef PTNET_DEBUG /* enable to add debug logs for ptnetmap netif and memdev */
 
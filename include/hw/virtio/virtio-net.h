@@ -17,6 +17,8 @@
 #include "qemu/units.h"
 #include "standard-headers/linux/virtio_net.h"
 #include "hw/virtio/virtio.h"
+#include "sysemu/iothread.h"
+#include "qapi/qapi-types-net.h"
 
 #define TYPE_VIRTIO_NET "virtio-net-device"
 #define VIRTIO_NET(obj) \
@@ -42,8 +44,119 @@ typedef struct virtio_net_conf
     int32_t speed;
     char *duplex_str;
     uint8_t duplex;
+    char *iothread;
 } virtio_net_conf;
 
+/*
+ * RSS and hash reporting, as proposed for virtio 1.1. The Linux headers
+ * imported into standard-headers do not have them yet.
+ */
+#ifndef VIRTIO_NET_F_RSS
+#define VIRTIO_NET_F_HASH_REPORT  57    /* Supports hash report */
+#define VIRTIO_NET_F_RSS          60    /* Supports RSS RX steering */
+
+/* supported/enabled hash types */
+#define VIRTIO_NET_RSS_HASH_TYPE_IPv4          (1 << 0)
+#define VIRTIO_NET_RSS_HASH_TYPE_TCPv4         (1 << 1)
+#define VIRTIO_NET_RSS_HASH_TYPE_UDPv4         (1 << 2)
+#define VIRTIO_NET_RSS_HASH_TYPE_IPv6          (1 << 3)
+#define VIRTIO_NET_RSS_HASH_TYPE_TCPv6         (1 << 4)
+#define VIRTIO_NET_RSS_HASH_TYPE_UDPv6         (1 << 5)
+#define VIRTIO_NET_RSS_HASH_TYPE_IP_EX         (1 << 6)
+#define VIRTIO_NET_RSS_HASH_TYPE_TCP_EX        (1 << 7)
+#define VIRTIO_NET_RSS_HASH_TYPE_UDP_EX        (1 << 8)
+
+/*
+ * This header comes first in the scatter-gather list when
+ * VIRTIO_NET_F_HASH_REPORT is negotiated.
+ */
+struct virtio_net_hdr_v1_hash {
+    struct virtio_net_hdr_v1 hdr;
+    uint32_t hash_value;
+#define VIRTIO_NET_HASH_REPORT_NONE            0
+#define VIRTIO_NET_HASH_REPORT_IPv4            1
+#define VIRTIO_NET_HASH_REPORT_TCPv4           2
+#define VIRTIO_NET_HASH_REPORT_UDPv4           3
+#define VIRTIO_NET_HASH_REPORT_IPv6            4
+#define VIRTIO_NET_HASH_REPORT_TCPv6           5
+#define VIRTIO_NET_HASH_REPORT_UDPv6           6
+#define VIRTIO_NET_HASH_REPORT_IPv6_EX         7
+#define VIRTIO_NET_HASH_REPORT_TCPv6_EX        8
+#define VIRTIO_NET_HASH_REPORT_UDPv6_EX        9
+    uint16_t hash_report;
+    uint16_t padding;
+};
+
+/*
+ * The command VIRTIO_NET_CTRL_MQ_RSS_CONFIG has the same effect as
+ * VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET does and additionally configures
+ * the receive steering to use a hash calculated for incoming packet
+ * to decide on receive virtqueue to place the packet. The command
+ * also provides parameters to calculate a hash and receive virtqueue.
+ */
+struct virtio_net_rss_config {
+    uint32_t hash_types;
+    uint16_t indirection_table_mask;
+    uint16_t unclassified_queue;
+    uint16_t indirection_table[1/* + indirection_table_mask */];
+    uint16_t max_tx_vq;
+    uint8_t hash_key_length;
+    uint8_t hash_key_data[/* hash_key_length */];
+};
+
+#define VIRTIO_NET_CTRL_MQ_RSS_CONFIG          1
+
+/*
+ * The command VIRTIO_NET_CTRL_MQ_HASH_CONFIG requests the device
+ * to include in the virtio header of the packet the value of the
+ * calculated hash and the report type of hash. It also provides
+ * parameters for hash calculation. The command requires feature
+ * VIRTIO_NET_F_HASH_REPORT to be negotiated to extend the
+ * layout of virtio header as defined in virtio_net_hdr_v1_hash.
+ */
+struct virtio_net_hash_config {
+    uint32_t hash_types;
+    /* for compatibility with virtio_net_rss_config */
+    uint16_t reserved[4];
+    uint8_t hash_key_length;
+    uint8_t hash_key_data[/* hash_key_length */];
+};
+
+#define VIRTIO_NET_CTRL_MQ_HASH_CONFIG         2
+
+/* struct virtio_net_config, with the fields added for RSS */
+typedef struct VirtIONetConfig {
+    uint8_t mac[ETH_ALEN];
+    uint16_t status;
+    uint16_t max_virtqueue_pairs;
+    uint16_t mtu;
+    uint32_t speed;
+    uint8_t duplex;
+    /* maximum size of RSS key */
+    uint8_t rss_max_key_size;
+    /* maximum number of indirection table entries */
+    uint16_t rss_max_indirection_table_length;
+    /* bitmask of supported VIRTIO_NET_RSS_HASH_ types */
+    uint32_t supported_hash_types;
+} QEMU_PACKED VirtIONetConfig;
+#else
+typedef struct virtio_net_config VirtIONetConfig;
+#endif
+
+/* Limits of the RSS configuration accepted from the guest */
+#define VIRTIO_NET_RSS_MAX_KEY_SIZE     40
+#define VIRTIO_NET_RSS_MAX_TABLE_LEN    128
+
+typedef struct VirtioNetRssData {
+    bool redirect;              /* steer packets with the table below */
+    bool populate_hash;         /* report the hash in the RX header */
+    uint32_t hash_types;        /* VIRTIO_NET_RSS_HASH_TYPE_* */
+    uint8_t key[VIRTIO_NET_RSS_MAX_KEY_SIZE];
+    uint16_t indirections_len;  /* a power of 2 */
+    uint16_t indirections_table[VIRTIO_NET_RSS_MAX_TABLE_LEN];
+    uint16_t default_queue;     /* for packets that are not hashed */
+} VirtioNetRssData;
+
 /* Maximum packet size we can receive from tap device: header + 64k */
 #define VIRTIO_NET_MAX_BUFSIZE (sizeof(struct virtio_net_hdr) + (64 * KiB))
 
@@ -53,10 +166,40 @@ typedef struct VirtIONetQueue {
     QEMUTimer *tx_timer;
     QEMUBH *tx_bh;
     uint32_t tx_waiting;
+    int32_t tx_burst;
+    /* tx=adaptive: flush again after @delay, notifications still off */
+    struct {
+        QEMUTimer *timer;
+        int64_t delay;
+    } tx_adapt;
+    struct {
+        uint64_t kicks;
+        uint64_t flushes;
+        uint64_t packets;
+        uint64_t full_bursts;
+        uint64_t deferrals;
+    } tx_stats;
     struct {
         VirtQueueElement *elem;
     } async_tx;
+    /* Inside a batch from the backend, notify once at the end */
+    bool rx_batching;
+    bool rx_notify_pending;
+    /* RX coalescing: a TCP packet built from one or more segments */
+    struct {
+        uint8_t *buf;
+        size_t size;        /* 0 when nothing is held */
+        size_t l3_off;
+        size_t l4_off;
+        size_t l5_off;
+        uint32_t next_seq;
+        uint16_t mss;
+        uint16_t segs;
+        bool is_ip6;
+        QEMUBH *bh;
+    } gro;
     struct VirtIONet *n;
+    AioContext *ctx;    /* NULL when processed in the main loop */
 } VirtIONetQueue;
 
 typedef struct VirtIONet {
@@ -68,6 +211,7 @@ typedef struct VirtIONet {
     NICState *nic;
     uint32_t tx_timeout;
     int32_t tx_burst;
+    VirtioNetTxMode tx_mode;
     uint32_t has_vnet_hdr;
     size_t host_hdr_len;
     size_t guest_hdr_len;
@@ -103,6 +247,13 @@ typedef struct VirtIONet {
     int announce_counter;
     bool needs_vnet_hdr_swap;
     bool mtu_bypass_backend;
+    bool rx_gro;
+    VirtioNetRssData rss_data;
+    /* Queue pair i is processed by iothreads[i % num_iothreads] */
+    IOThread **iothreads;
+    int num_iothreads;
+    bool dataplane_started;
+    QTAILQ_ENTRY(VirtIONet) next;
 } VirtIONet;
 
 void virtio_net_set_netclient_name(VirtIONet *n, const char *name,
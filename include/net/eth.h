@@ -177,11 +177,14 @@ struct tcp_hdr {
 #define TH_PUSH 0x08
 #define TH_ACK  0x10
 #define TH_URG  0x20
+#define TH_ECE  0x40
+#define TH_CWR  0x80
     u_short th_win;      /* window */
     u_short th_sum;      /* checksum */
     u_short th_urp;      /* urgent pointer */
 };
 
+#define ip6_plen     ip6_ctlun.ip6_un1.ip6_un1_plen
 #define ip6_nxt      ip6_ctlun.ip6_un1.ip6_un1_nxt
 #define ip6_ecn_acc  ip6_ctlun.ip6_un3.ip6_un3_ecn
 
@@ -233,6 +236,7 @@ struct tcp_hdr {
     (sizeof(struct eth_header) + 2 * sizeof(struct vlan_header))
 
 #define ETH_MAX_IP4_HDR_LEN   (60)
+#define ETH_MAX_TCP_HDR_LEN   (60)
 #define ETH_MAX_IP_DGRAM_LEN  (0xFFFF)
 
 #define IP_FRAG_UNIT_SIZE     (8)
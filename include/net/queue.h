@@ -29,6 +29,12 @@
 typedef struct NetPacket NetPacket;
 typedef struct NetQueue NetQueue;
 
+/* One packet of a batch */
+typedef struct NetPacketVec {
+    const struct iovec *iov;
+    int iovcnt;
+} NetPacketVec;
+
 typedef void (NetPacketSent) (NetClientState *sender, ssize_t ret);
 
 #define QEMU_NET_PACKET_FLAG_NONE  0
@@ -45,7 +51,19 @@ typedef ssize_t (NetQueueDeliverFunc)(NetClientState *sender,
                                       int iovcnt,
                                       void *opaque);
 
-NetQueue *qemu_new_net_queue(NetQueueDeliverFunc *deliver, void *opaque);
+/* Returns the number of packets consumed (delivered or discarded).
+ * A short count means that pkts[ret] should be queued for future
+ * redelivery, together with the packets after it.
+ */
+typedef int (NetQueueDeliverBatchFunc)(NetClientState *sender,
+                                       unsigned flags,
+                                       const NetPacketVec *pkts,
+                                       int count,
+                                       void *opaque);
+
+NetQueue *qemu_new_net_queue(NetQueueDeliverFunc *deliver,
+                             NetQueueDeliverBatchFunc *deliver_batch,
+                             void *opaque);
 
 void qemu_net_queue_append_iov(NetQueue *queue,
                                NetClientState *sender,
@@ -70,6 +88,13 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
                                 int iovcnt,
                                 NetPacketSent *sent_cb);
 
+int qemu_net_queue_send_batch(NetQueue *queue,
+                              NetClientState *sender,
+                              unsigned flags,
+                              const NetPacketVec *pkts,
+                              int count,
+                              NetPacketSent *sent_cb);
+
 void qemu_net_queue_purge(NetQueue *queue, NetClientState *from);
 bool qemu_net_queue_flush(NetQueue *queue);
 
@@ -28,6 +28,7 @@
 
 #include "qemu-common.h"
 #include "standard-headers/linux/virtio_net.h"
+#include "sysemu/iothread.h"
 
 int tap_enable(NetClientState *nc);
 int tap_disable(NetClientState *nc);
@@ -36,5 +37,6 @@ int tap_get_fd(NetClientState *nc);
 
 struct vhost_net;
 struct vhost_net *tap_get_vhost_net(NetClientState *nc);
+IOThread *tap_get_worker(NetClientState *nc);
 
 #endif /* QEMU_NET_TAP_H */
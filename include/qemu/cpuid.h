@@ -48,6 +48,9 @@
 #ifndef bit_BMI2
 #define bit_BMI2        (1 << 8)
 #endif
+#ifndef bit_AVX512F
+#define bit_AVX512F     (1 << 16)
+#endif
 
 /* Leaf 0x80000001, %ecx */
 #ifndef bit_LZCNT
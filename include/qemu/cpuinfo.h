@@ -0,0 +1,28 @@
+/*
+ * cpuinfo.h - the ISA extensions of an x86 host usable by QEMU
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_CPUINFO_H
+#define QEMU_CPUINFO_H
+
+/* The users keep the flags of the accelerators they have, and drop the
+ * least significant one to test the next, so the most preferred ISA
+ * must have the least significant bit.
+ */
+#define CPUINFO_AVX512F 1
+#define CPUINFO_AVX2    2
+#define CPUINFO_SSE4    4   /* SSE4.1 */
+#define CPUINFO_SSE2    8
+
+#ifdef CONFIG_AVX2_OPT
+/* Return the CPUINFO_* flags of the host.  The ISA must not only be
+ * available but usable, i.e. the OS saves the registers it needs.
+ * This may be called from constructors.
+ */
+unsigned cpuinfo_get(void);
+#endif
+
+#endif /* QEMU_CPUINFO_H */
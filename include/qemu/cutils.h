@@ -161,6 +161,9 @@ int qemu_strtosz_metric(const char *nptr, char **end, uint64_t *result);
 bool buffer_is_zero(const void *buf, size_t len);
 bool test_buffer_is_zero_next_accel(void);
 
+void pkt_copy(void *dst, const void *src, size_t len);
+bool test_pkt_copy_next_accel(void);
+
 /*
  * Implementation of ULEB128 (http://en.wikipedia.org/wiki/LEB128)
  * Input is limited to 14-bit numbers
@@ -17,27 +17,221 @@
 
 #include "qemu/osdep.h"
 #include "qemu-common.h"
+#include "qemu/cpuinfo.h"
 #include "net/checksum.h"
 #include "net/eth.h"
 
-uint32_t net_checksum_add_cont(int len, uint8_t *buf, int seq)
+/* All the variants below add up the buffer as native-endian 16-bit words,
+ * with a trailing odd byte padded with zero, and return the sum folded to
+ * 16 bits.  The ones' complement sum does not depend on the byte order,
+ * so net_checksum_add_cont() only has to swap the result at the end.
+ * Folding never turns a non-zero sum into zero, so the result stays
+ * interchangeable with the unfolded sum for net_checksum_finish().
+ */
+
+static inline uint32_t net_checksum_fold64(uint64_t sum)
+{
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    return sum;
+}
+
+static inline uint64_t net_checksum_word64(uint64_t w)
+{
+    return (w & 0xffffffff) + (w >> 32);
+}
+
+static uint32_t net_checksum_int(const uint8_t *buf, size_t len)
 {
-    uint32_t sum1 = 0, sum2 = 0;
-    int i;
+    uint64_t sum = 0;
 
-    for (i = 0; i < len - 1; i += 2) {
-        sum1 += (uint32_t)buf[i];
-        sum2 += (uint32_t)buf[i + 1];
+    for (; len >= 32; buf += 32, len -= 32) {
+        sum += net_checksum_word64(ldq_he_p(buf));
+        sum += net_checksum_word64(ldq_he_p(buf + 8));
+        sum += net_checksum_word64(ldq_he_p(buf + 16));
+        sum += net_checksum_word64(ldq_he_p(buf + 24));
     }
-    if (i < len) {
-        sum1 += (uint32_t)buf[i];
+    for (; len >= 8; buf += 8, len -= 8) {
+        sum += net_checksum_word64(ldq_he_p(buf));
+    }
+    if (len) {
+        uint8_t tail[8] = { 0 };
+
+        memcpy(tail, buf, len);
+        sum += net_checksum_word64(ldq_he_p(tail));
     }
 
+    return net_checksum_fold64(sum);
+}
+
+#if defined(CONFIG_AVX2_OPT) || defined(__SSE2__)
+/* Do not use push_options pragmas unnecessarily, because clang
+ * does not support them.
+ */
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("sse2")
+#endif
+#include <emmintrin.h>
+
+/* Blocks added to the 32-bit lanes before they are widened: each block
+ * adds two 16-bit words to every lane.
+ */
+#define CSUM_LANE_BLOCKS 16384
+
+static uint32_t net_checksum_sse2(const uint8_t *buf, size_t len)
+{
+    __m128i zero = _mm_setzero_si128();
+    uint64_t sum = 0;
+
+    while (len >= 16) {
+        size_t blocks = MIN(len / 16, CSUM_LANE_BLOCKS);
+        __m128i acc = zero;
+        uint64_t lanes[2];
+
+        len -= blocks * 16;
+        do {
+            __m128i v = _mm_loadu_si128((const __m128i *)buf);
+
+            acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(v, zero));
+            acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(v, zero));
+            buf += 16;
+        } while (--blocks);
+
+        acc = _mm_add_epi64(_mm_unpacklo_epi32(acc, zero),
+                            _mm_unpackhi_epi32(acc, zero));
+        _mm_storeu_si128((__m128i *)lanes, acc);
+        sum += lanes[0] + lanes[1];
+    }
+
+    return net_checksum_fold64(sum + net_checksum_int(buf, len));
+}
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC pop_options
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static uint32_t net_checksum_avx2(const uint8_t *buf, size_t len)
+{
+    __m256i zero = _mm256_setzero_si256();
+    uint64_t sum = 0;
+
+    while (len >= 32) {
+        size_t blocks = MIN(len / 32, CSUM_LANE_BLOCKS);
+        __m256i acc = zero;
+        uint64_t lanes[4];
+
+        len -= blocks * 32;
+        do {
+            __m256i v = _mm256_loadu_si256((const __m256i *)buf);
+
+            acc = _mm256_add_epi32(acc, _mm256_unpacklo_epi16(v, zero));
+            acc = _mm256_add_epi32(acc, _mm256_unpackhi_epi16(v, zero));
+            buf += 32;
+        } while (--blocks);
+
+        acc = _mm256_add_epi64(_mm256_unpacklo_epi32(acc, zero),
+                               _mm256_unpackhi_epi32(acc, zero));
+        _mm256_storeu_si256((__m256i *)lanes, acc);
+        sum += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+
+    return net_checksum_fold64(sum + net_checksum_int(buf, len));
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX2_OPT */
+
+/* Make sure that these variables are appropriately initialized when
+ * SSE2 is enabled on the compiler command-line, but the compiler is
+ * too old to support CONFIG_AVX2_OPT.
+ */
+#ifdef CONFIG_AVX2_OPT
+# define INIT_CACHE 0
+# define INIT_ACCEL net_checksum_int
+#else
+# ifndef __SSE2__
+#  error "ISA selection confusion"
+# endif
+# define INIT_CACHE CPUINFO_SSE2
+# define INIT_ACCEL net_checksum_sse2
+#endif
+
+static unsigned cpuid_cache = INIT_CACHE;
+static uint32_t (*net_checksum_accel)(const uint8_t *, size_t) = INIT_ACCEL;
+
+static void init_accel(unsigned cache)
+{
+    uint32_t (*fn)(const uint8_t *, size_t) = net_checksum_int;
+    if (cache & CPUINFO_SSE2) {
+        fn = net_checksum_sse2;
+    }
+#ifdef CONFIG_AVX2_OPT
+    if (cache & CPUINFO_AVX2) {
+        fn = net_checksum_avx2;
+    }
+#endif
+    net_checksum_accel = fn;
+}
+
+#ifdef CONFIG_AVX2_OPT
+static void __attribute__((constructor)) init_cpuid_cache(void)
+{
+    cpuid_cache = cpuinfo_get() & (CPUINFO_SSE2 | CPUINFO_AVX2);
+    init_accel(cpuid_cache);
+}
+#endif /* CONFIG_AVX2_OPT */
+
+bool test_net_checksum_next_accel(void)
+{
+    /* If no bits set, we just tested net_checksum_int, and there
+       are no more acceleration options to test.  */
+    if (cpuid_cache == 0) {
+        return false;
+    }
+    /* Disable the accelerator we used before and select a new one.  */
+    cpuid_cache &= cpuid_cache - 1;
+    init_accel(cpuid_cache);
+    return true;
+}
+
+static uint32_t select_accel_fn(const uint8_t *buf, size_t len)
+{
+    if (likely(len >= 64)) {
+        return net_checksum_accel(buf, len);
+    }
+    return net_checksum_int(buf, len);
+}
+
+#else
+#define select_accel_fn  net_checksum_int
+bool test_net_checksum_next_accel(void)
+{
+    return false;
+}
+#endif
+
+uint32_t net_checksum_add_cont(int len, uint8_t *buf, int seq)
+{
+    uint32_t sum;
+
+    if (len <= 0) {
+        return 0;
+    }
+
+    /* From native to network byte order, then swap again if the buffer
+     * starts at an odd offset of the checksummed data.
+     */
+    sum = be16_to_cpu(select_accel_fn(buf, len));
     if (seq & 1) {
-        return sum1 + (sum2 << 8);
-    } else {
-        return sum2 + (sum1 << 8);
+        sum = bswap16(sum);
     }
+    return sum;
 }
 
 uint16_t net_checksum_finish(uint32_t sum)
@@ -386,7 +386,8 @@ static void colo_rewriter_setup(NetFilterState *nf, Error **errp)
                                                       connection_key_equal,
                                                       g_free,
                                                       connection_destroy);
-    s->incoming_queue = qemu_new_net_queue(qemu_netfilter_pass_to_next, nf);
+    s->incoming_queue = qemu_new_net_queue(qemu_netfilter_pass_to_next, NULL,
+                                           nf);
 }
 
 static bool filter_rewriter_get_vnet_hdr(Object *obj, Error **errp)
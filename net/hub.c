@@ -16,16 +16,30 @@
 #include "qapi/error.h"
 #include "monitor/monitor.h"
 #include "net/net.h"
+#include "net/eth.h"
 #include "clients.h"
 #include "hub.h"
 #include "qemu/iov.h"
 #include "qemu/error-report.h"
+#include "qemu/timer.h"
 #include "sysemu/qtest.h"
 
 /*
  * A hub broadcasts incoming packets to all its ports except the source port.
  * Hubs can be used to provide independent emulated network segments.
+ *
+ * With learning=on, a hub behaves like a learning switch instead: it
+ * remembers the port behind each source MAC address and sends unicast
+ * frames for a known destination to that port alone.  Everything else
+ * is still flooded.
+ */
+
+/* Forget a MAC address that has not been seen for this long */
+#define NET_HUB_FDB_AGEING_NS (300 * NANOSECONDS_PER_SECOND)
+/* Size of the MAC address table; when it is full, a new address replaces
+ * the aged entries or, if there are none, the least recently seen one.
  */
+#define NET_HUB_FDB_MAX 4096
 
 typedef struct NetHub NetHub;
 
@@ -34,27 +48,164 @@ typedef struct NetHubPort {
     QLIST_ENTRY(NetHubPort) next;
     NetHub *hub;
     int id;
+    uint64_t rx_packets;    /* from our peer into the hub */
+    uint64_t rx_bytes;
+    uint64_t tx_packets;    /* from the hub to our peer */
+    uint64_t tx_bytes;
+    uint64_t tx_flooded;    /* of which unknown or multicast destination */
 } NetHubPort;
 
+typedef struct NetHubFdbEntry {
+    uint64_t mac;           /* key */
+    NetHubPort *port;
+    int64_t last_seen;
+} NetHubFdbEntry;
+
 struct NetHub {
     int id;
     QLIST_ENTRY(NetHub) next;
     int num_ports;
     QLIST_HEAD(, NetHubPort) ports;
+    bool learning;
+    GHashTable *fdb;        /* MAC address -> NetHubFdbEntry */
 };
 
 static QLIST_HEAD(, NetHub) hubs = QLIST_HEAD_INITIALIZER(&hubs);
 
+static uint64_t net_hub_mac(const uint8_t *addr)
+{
+    return ((uint64_t)addr[0] << 40) | ((uint64_t)addr[1] << 32) |
+           ((uint64_t)addr[2] << 24) | ((uint64_t)addr[3] << 16) |
+           ((uint64_t)addr[4] << 8) | addr[5];
+}
+
+static gboolean net_hub_fdb_entry_is_stale(gpointer key, gpointer value,
+                                           gpointer opaque)
+{
+    NetHubFdbEntry *entry = value;
+    int64_t now = *(int64_t *)opaque;
+
+    return now - entry->last_seen > NET_HUB_FDB_AGEING_NS;
+}
+
+static void net_hub_fdb_make_room(NetHub *hub, int64_t now)
+{
+    GHashTableIter iter;
+    NetHubFdbEntry *entry, *oldest = NULL;
+
+    if (g_hash_table_foreach_remove(hub->fdb, net_hub_fdb_entry_is_stale,
+                                    &now)) {
+        return;
+    }
+
+    g_hash_table_iter_init(&iter, hub->fdb);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&entry)) {
+        if (!oldest || entry->last_seen < oldest->last_seen) {
+            oldest = entry;
+        }
+    }
+    g_hash_table_remove(hub->fdb, &oldest->mac);
+}
+
+static void net_hub_learn(NetHub *hub, NetHubPort *source_port,
+                          const uint8_t *src, int64_t now)
+{
+    uint64_t mac = net_hub_mac(src);
+    NetHubFdbEntry *entry;
+
+    if (src[0] & 1) {
+        return;
+    }
+
+    entry = g_hash_table_lookup(hub->fdb, &mac);
+    if (!entry) {
+        if (g_hash_table_size(hub->fdb) >= NET_HUB_FDB_MAX) {
+            net_hub_fdb_make_room(hub, now);
+        }
+        entry = g_new(NetHubFdbEntry, 1);
+        entry->mac = mac;
+        g_hash_table_insert(hub->fdb, &entry->mac, entry);
+    }
+    entry->port = source_port;
+    entry->last_seen = now;
+}
+
+/* The only port that should see a frame for @dst, or NULL to flood it */
+static NetHubPort *net_hub_lookup(NetHub *hub, const uint8_t *dst,
+                                  int64_t now)
+{
+    uint64_t mac = net_hub_mac(dst);
+    NetHubFdbEntry *entry;
+
+    if (dst[0] & 1) {
+        return NULL;
+    }
+
+    entry = g_hash_table_lookup(hub->fdb, &mac);
+    if (!entry) {
+        return NULL;
+    }
+    if (now - entry->last_seen > NET_HUB_FDB_AGEING_NS) {
+        g_hash_table_remove(hub->fdb, &mac);
+        return NULL;
+    }
+    return entry->port;
+}
+
+/* Learn from the Ethernet header @eth and pick the destination port.
+ * Returns false if the frame must be dropped, true otherwise with *dest
+ * set to NULL for flooding.
+ */
+static bool net_hub_forward(NetHub *hub, NetHubPort *source_port,
+                            const uint8_t *eth, size_t len,
+                            NetHubPort **dest)
+{
+    int64_t now;
+
+    *dest = NULL;
+    source_port->rx_packets++;
+    source_port->rx_bytes += len;
+    if (!hub->learning || len < 2 * ETH_ALEN) {
+        return true;
+    }
+
+    now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    net_hub_learn(hub, source_port, eth + ETH_ALEN, now);
+    *dest = net_hub_lookup(hub, eth, now);
+
+    /* Filtered, like a switch does for a destination behind the source */
+    return *dest != source_port;
+}
+
+static void net_hub_count_tx(NetHubPort *port, size_t len, bool flooded)
+{
+    port->tx_packets++;
+    port->tx_bytes += len;
+    if (flooded) {
+        port->tx_flooded++;
+    }
+}
+
 static ssize_t net_hub_receive(NetHub *hub, NetHubPort *source_port,
                                const uint8_t *buf, size_t len)
 {
-    NetHubPort *port;
+    NetHubPort *port, *dest;
+
+    if (!net_hub_forward(hub, source_port, buf, len, &dest)) {
+        return len;
+    }
+    if (dest) {
+        net_hub_count_tx(dest, len, false);
+        qemu_send_packet(&dest->nc, buf, len);
+        return len;
+    }
 
     QLIST_FOREACH(port, &hub->ports, next) {
         if (port == source_port) {
             continue;
         }
 
+        net_hub_count_tx(port, len, true);
         qemu_send_packet(&port->nc, buf, len);
     }
     return len;
@@ -63,19 +214,43 @@ static ssize_t net_hub_receive(NetHub *hub, NetHubPort *source_port,
 static ssize_t net_hub_receive_iov(NetHub *hub, NetHubPort *source_port,
                                    const struct iovec *iov, int iovcnt)
 {
-    NetHubPort *port;
+    NetHubPort *port, *dest;
     ssize_t len = iov_size(iov, iovcnt);
+    uint8_t eth[2 * ETH_ALEN];
+
+    iov_to_buf(iov, iovcnt, 0, eth, sizeof(eth));
+    if (!net_hub_forward(hub, source_port, eth, len, &dest)) {
+        return len;
+    }
+    if (dest) {
+        net_hub_count_tx(dest, len, false);
+        qemu_sendv_packet(&dest->nc, iov, iovcnt);
+        return len;
+    }
 
     QLIST_FOREACH(port, &hub->ports, next) {
         if (port == source_port) {
             continue;
         }
 
+        net_hub_count_tx(port, len, true);
         qemu_sendv_packet(&port->nc, iov, iovcnt);
     }
     return len;
 }
 
+static NetHub *net_hub_find(int id)
+{
+    NetHub *hub;
+
+    QLIST_FOREACH(hub, &hubs, next) {
+        if (hub->id == id) {
+            return hub;
+        }
+    }
+    return NULL;
+}
+
 static NetHub *net_hub_new(int id)
 {
     NetHub *hub;
@@ -84,6 +259,9 @@ static NetHub *net_hub_new(int id)
     hub->id = id;
     hub->num_ports = 0;
     QLIST_INIT(&hub->ports);
+    hub->learning = false;
+    hub->fdb = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+                                     NULL, g_free);
 
     QLIST_INSERT_HEAD(&hubs, hub, next);
 
@@ -125,10 +303,20 @@ static ssize_t net_hub_port_receive_iov(NetClientState *nc,
     return net_hub_receive_iov(port->hub, port, iov, iovcnt);
 }
 
+static gboolean net_hub_fdb_entry_is_port(gpointer key, gpointer value,
+                                          gpointer opaque)
+{
+    NetHubFdbEntry *entry = value;
+
+    return entry->port == opaque;
+}
+
 static void net_hub_port_cleanup(NetClientState *nc)
 {
     NetHubPort *port = DO_UPCAST(NetHubPort, nc, nc);
 
+    g_hash_table_foreach_remove(port->hub->fdb, net_hub_fdb_entry_is_port,
+                                port);
     QLIST_REMOVE(port, next);
 }
 
@@ -179,12 +367,7 @@ NetClientState *net_hub_add_port(int hub_id, const char *name,
     NetHub *hub;
     NetHubPort *port;
 
-    QLIST_FOREACH(hub, &hubs, next) {
-        if (hub->id == hub_id) {
-            break;
-        }
-    }
-
+    hub = net_hub_find(hub_id);
     if (!hub) {
         hub = net_hub_new(hub_id);
     }
@@ -250,7 +433,12 @@ void net_hub_info(Monitor *mon)
     NetHubPort *port;
 
     QLIST_FOREACH(hub, &hubs, next) {
-        monitor_printf(mon, "hub %d\n", hub->id);
+        if (hub->learning) {
+            monitor_printf(mon, "hub %d (learning, %u MAC addresses)\n",
+                           hub->id, g_hash_table_size(hub->fdb));
+        } else {
+            monitor_printf(mon, "hub %d\n", hub->id);
+        }
         QLIST_FOREACH(port, &hub->ports, next) {
             monitor_printf(mon, " \\ %s", port->nc.name);
             if (port->nc.peer) {
@@ -259,6 +447,12 @@ void net_hub_info(Monitor *mon)
             } else {
                 monitor_printf(mon, "\n");
             }
+            monitor_printf(mon, "   rx %" PRIu64 " packets %" PRIu64
+                           " bytes, tx %" PRIu64 " packets %" PRIu64
+                           " bytes (%" PRIu64 " flooded)\n",
+                           port->rx_packets, port->rx_bytes,
+                           port->tx_packets, port->tx_bytes,
+                           port->tx_flooded);
         }
     }
 }
@@ -292,6 +486,8 @@ int net_init_hubport(const Netdev *netdev, const char *name,
 {
     const NetdevHubPortOptions *hubport;
     NetClientState *hubpeer = NULL;
+    NetClientState *nc;
+    NetHub *hub;
 
     assert(netdev->type == NET_CLIENT_DRIVER_HUBPORT);
     assert(!peer);
@@ -305,7 +501,18 @@ int net_init_hubport(const Netdev *netdev, const char *name,
         }
     }
 
-    net_hub_add_port(hubport->hubid, name, hubpeer);
+    /* The first port of a hub decides whether it learns */
+    hub = net_hub_find(hubport->hubid);
+    if (hub && hubport->has_learning && hubport->learning != hub->learning) {
+        error_setg(errp, "hub %d already has learning=%s", hub->id,
+                   hub->learning ? "on" : "off");
+        return -1;
+    }
+
+    nc = net_hub_add_port(hubport->hubid, name, hubpeer);
+    if (!hub && hubport->has_learning) {
+        DO_UPCAST(NetHubPort, nc, nc)->hub->learning = hubport->learning;
+    }
 
     return 0;
 }
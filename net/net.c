@@ -43,6 +43,7 @@
 #include "qemu/config-file.h"
 #include "hw/qdev.h"
 #include "qemu/iov.h"
+#include "qemu/host-utils.h"
 #include "qemu/main-loop.h"
 #include "qemu/option.h"
 #include "qapi/error.h"
@@ -236,6 +237,11 @@ static ssize_t qemu_deliver_packet_iov(NetClientState *sender,
                                        const struct iovec *iov,
                                        int iovcnt,
                                        void *opaque);
+static int qemu_deliver_packet_batch(NetClientState *sender,
+                                     unsigned flags,
+                                     const NetPacketVec *pkts,
+                                     int count,
+                                     void *opaque);
 
 static void qemu_net_client_setup(NetClientState *nc,
                                   NetClientInfo *info,
@@ -259,7 +265,10 @@ static void qemu_net_client_setup(NetClientState *nc,
     }
     QTAILQ_INSERT_TAIL(&net_clients, nc, next);
 
-    nc->incoming_queue = qemu_new_net_queue(qemu_deliver_packet_iov, nc);
+    nc->incoming_queue = qemu_new_net_queue(qemu_deliver_packet_iov,
+                                            info->receive_batch ?
+                                            qemu_deliver_packet_batch : NULL,
+                                            nc);
     nc->destructor = destructor;
     QTAILQ_INIT(&nc->filters);
 }
@@ -496,6 +505,23 @@ void qemu_set_vnet_hdr_len(NetClientState *nc, int len)
     nc->info->set_vnet_hdr_len(nc, len);
 }
 
+/*
+ * Move the event handlers of a backend to @ctx, or back to the main loop
+ * if @ctx is NULL.  From then on, the backend delivers packets to its peer
+ * from the thread running @ctx, with @ctx acquired.
+ *
+ * Must be called with the BQL held and with the AioContext the backend
+ * currently runs in (if not the main loop) acquired exactly once.
+ */
+int qemu_net_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    if (!nc || !nc->info->set_aio_context) {
+        return -ENOSYS;
+    }
+
+    return nc->info->set_aio_context(nc, ctx);
+}
+
 int qemu_set_vnet_le(NetClientState *nc, bool is_le)
 {
 #ifdef HOST_WORDS_BIGENDIAN
@@ -741,6 +767,41 @@ static ssize_t qemu_deliver_packet_iov(NetClientState *sender,
     return ret;
 }
 
+static int qemu_deliver_packet_batch(NetClientState *sender,
+                                     unsigned flags,
+                                     const NetPacketVec *pkts,
+                                     int count,
+                                     void *opaque)
+{
+    NetClientState *nc = opaque;
+    int ret;
+
+    if (nc->link_down) {
+        return count;
+    }
+
+    if (nc->receive_disabled) {
+        return 0;
+    }
+
+    if (flags & QEMU_NET_PACKET_FLAG_RAW) {
+        for (ret = 0; ret < count; ret++) {
+            if (qemu_deliver_packet_iov(sender, flags, pkts[ret].iov,
+                                        pkts[ret].iovcnt, opaque) == 0) {
+                break;
+            }
+        }
+        return ret;
+    }
+
+    ret = nc->info->receive_batch(nc, pkts, count);
+    if (ret < count) {
+        nc->receive_disabled = 1;
+    }
+
+    return ret;
+}
+
 ssize_t qemu_sendv_packet_async(NetClientState *sender,
                                 const struct iovec *iov, int iovcnt,
                                 NetPacketSent *sent_cb)
@@ -777,6 +838,43 @@ ssize_t qemu_sendv_packet_async(NetClientState *sender,
                                    iov, iovcnt, sent_cb);
 }
 
+/* Send @count packets in one go.  Returns the number of packets that
+ * were sent or discarded.  If that is short of @count, pkts[ret] was
+ * queued, the caller must wait for @sent_cb before sending more, and
+ * the packets after it were not looked at.
+ */
+int qemu_sendv_packet_batch_async(NetClientState *sender,
+                                  const NetPacketVec *pkts, int count,
+                                  NetPacketSent *sent_cb)
+{
+    int i;
+
+    if (sender->link_down || !sender->peer) {
+        return count;
+    }
+
+    /* Filters, and the size check, deal with one packet at a time */
+    for (i = 0; i < count; i++) {
+        if (iov_size(pkts[i].iov, pkts[i].iovcnt) > NET_BUFSIZE) {
+            break;
+        }
+    }
+    if (i < count || !QTAILQ_EMPTY(&sender->filters) ||
+        !QTAILQ_EMPTY(&sender->peer->filters)) {
+        for (i = 0; i < count; i++) {
+            if (!qemu_sendv_packet_async(sender, pkts[i].iov, pkts[i].iovcnt,
+                                         sent_cb) && sent_cb) {
+                return i;
+            }
+        }
+        return count;
+    }
+
+    return qemu_net_queue_send_batch(sender->peer->incoming_queue, sender,
+                                     QEMU_NET_PACKET_FLAG_NONE,
+                                     pkts, count, sent_cb);
+}
+
 ssize_t
 qemu_sendv_packet(NetClientState *nc, const struct iovec *iov, int iovcnt)
 {
@@ -1241,6 +1339,36 @@ static void netfilter_print_info(Monitor *mon, NetFilterState *nf)
     monitor_printf(mon, "\n");
 }
 
+void net_batch_hist_add(NetBatchHist *hist, unsigned int count)
+{
+    int bucket;
+
+    assert(count);
+    bucket = 31 - clz32(count);
+    hist->buckets[MIN(bucket, NET_BATCH_HIST_BUCKETS - 1)]++;
+}
+
+void net_batch_hist_print(Monitor *mon, const char *name,
+                          const NetBatchHist *hist)
+{
+    int i;
+
+    monitor_printf(mon, "  %s batches:", name);
+    for (i = 0; i < NET_BATCH_HIST_BUCKETS; i++) {
+        unsigned int lo = 1u << i;
+
+        if (i == NET_BATCH_HIST_BUCKETS - 1) {
+            monitor_printf(mon, " %u+=%" PRIu64, lo, hist->buckets[i]);
+        } else if (lo == 1) {
+            monitor_printf(mon, " 1=%" PRIu64, hist->buckets[i]);
+        } else {
+            monitor_printf(mon, " %u-%u=%" PRIu64, lo, 2 * lo - 1,
+                           hist->buckets[i]);
+        }
+    }
+    monitor_printf(mon, "\n");
+}
+
 void print_net_client(Monitor *mon, NetClientState *nc)
 {
     NetFilterState *nf;
@@ -1249,6 +1377,9 @@ void print_net_client(Monitor *mon, NetClientState *nc)
                    nc->queue_index,
                    NetClientDriver_str(nc->info->type),
                    nc->info_str);
+    if (nc->info->print_info) {
+        nc->info->print_info(nc, mon);
+    }
     if (!QTAILQ_EMPTY(&nc->filters)) {
         monitor_printf(mon, "filters:\n");
     }
@@ -26,6 +26,7 @@
 
 #include "qemu/osdep.h"
 #include <sys/ioctl.h>
+#include <poll.h>
 #include <net/if.h>
 #define NETMAP_WITH_LIBS
 #include <net/netmap.h>
@@ -39,11 +40,24 @@
 #include "qapi/error.h"
 #include "qemu/iov.h"
 #include "qemu/cutils.h"
+#include "qemu/main-loop.h"
+#include "qemu/timer.h"
+#include "qemu/event_notifier.h"
+#include "qemu/atomic.h"
+#include "qemu/processor.h"
+#include "qemu/host-utils.h"
+#include "monitor/monitor.h"
+#include "sysemu/iothread.h"
+#include "block/aio.h"
+#include "block/aio-wait.h"
 #include "hw/net/ptnetmap.h"
 
+#define MAX_NETMAP_QUEUES 1024
+
 typedef struct NetmapState {
     NetClientState      nc;
     int                 fd;
+    int                 ringid;  /* Bound ring pair, -1 for all rings. */
     uint16_t            mem_id;
     uint64_t            nifp_offset;
     void                *mem;
@@ -54,40 +68,33 @@ typedef struct NetmapState {
     bool                write_poll;
     bool                klooptx;
     bool                klooprx;
+    bool                kloopuser;  /* Force the userspace sync loop. */
+    unsigned int        txbatch;   /* Max frames published per TXSYNC. */
+    unsigned int        txpending; /* Frames published since last TXSYNC. */
+    QEMUBH              *txsync_bh;
+    bool                zerocopy;
+    /* RX slots [rx_inflight_head, rx_inflight_tail) hold the frame that
+     * is currently being delivered to the peer by netmap_send(). */
+    uint32_t            rx_inflight_head;
+    uint32_t            rx_inflight_tail;
+    /* The port that swapped buffers out of that frame, if any. */
+    struct NetmapState  *rx_inflight_taker;
+    uint64_t            tx_zcopy_frames; /* Frames sent by buffer swap. */
+    uint64_t            tx_copy_frames;  /* Frames sent by copy. */
     struct iovec        iov[IOV_MAX];
     int                 vnet_hdr_len;  /* Current virtio-net header length. */
     QTAILQ_ENTRY(NetmapState) next;
     PTNetmapState       ptnetmap;
+    IOThread            *iothread; /* Given with iothread=, see
+                                    * netmap_get_iothread(). */
+    bool                iothread_taken; /* A peer will run us there. */
+    AioContext          *nic_ctx; /* Set by a peer that runs us in its
+                                   * IOThread (no BQL needed there). */
 } NetmapState;
 
 static QTAILQ_HEAD(, NetmapState) netmap_clients =
                    QTAILQ_HEAD_INITIALIZER(netmap_clients);
 
-#ifndef __FreeBSD__
-#define pkt_copy bcopy
-#else
-/* A fast copy routine only for multiples of 64 bytes, non overlapped. */
-static inline void pkt_copy(const void *_src, void *_dst, int l)
-{
-    const uint64_t *src = _src;
-    uint64_t *dst = _dst;
-    if (unlikely(l >= 1024)) {
-        bcopy(src, dst, l);
-        return;
-    }
-    for (; l > 0; l -= 64) {
-        *dst++ = *src++;
-        *dst++ = *src++;
-        *dst++ = *src++;
-        *dst++ = *src++;
-        *dst++ = *src++;
-        *dst++ = *src++;
-        *dst++ = *src++;
-        *dst++ = *src++;
-    }
-}
-#endif /* __FreeBSD__ */
-
 /*
  * find nm_desc parent with same allocator
  */
@@ -107,15 +114,14 @@ static NetmapState *netmap_find_memory(uint16_t mem_id, NetmapState *exclude)
 }
 
 /*
- * Open a netmap device. We only use the first TX ring and the first
- * RX ring, even if there are more.
+ * Open a netmap control device as s->fd and register s->ifname on it. If
+ * s->ringid is negative all the hardware rings are bound, otherwise only
+ * the TX and RX rings with index s->ringid.
  */
-static int netmap_open(NetmapState *s, Error **errp)
+static int netmap_register(NetmapState *s, struct nmreq_register *req,
+                           Error **errp)
 {
-    struct nmreq_register req;
     struct nmreq_header hdr;
-    struct netmap_if *nifp;
-    NetmapState *other;
     int ret;
 
     s->fd = open("/dev/netmap", O_RDWR);
@@ -125,23 +131,59 @@ static int netmap_open(NetmapState *s, Error **errp)
     }
 
     memset(&hdr, 0, sizeof(hdr));
-    memset(&req, 0, sizeof(req));
+    memset(req, 0, sizeof(*req));
 
     hdr.nr_version = NETMAP_API;
     strncpy(hdr.nr_name, s->ifname, sizeof(hdr.nr_name) - 1);
     hdr.nr_reqtype = NETMAP_REQ_REGISTER;
-    hdr.nr_body    = (uintptr_t)&req;
+    hdr.nr_body    = (uintptr_t)req;
     hdr.nr_options = (uintptr_t)NULL;
-    req.nr_mode    = NR_REG_ALL_NIC;
-    req.nr_flags   = NR_EXCLUSIVE | NR_NO_TX_POLL;
+    if (s->ringid >= 0) {
+        req->nr_mode   = NR_REG_ONE_NIC;
+        req->nr_ringid = s->ringid;
+    } else {
+        req->nr_mode   = NR_REG_ALL_NIC;
+    }
+    req->nr_flags  = NR_EXCLUSIVE | NR_NO_TX_POLL;
     ret            = ioctl(s->fd, NIOCCTRL, &hdr);
     if (ret) {
         error_setg_errno(errp, errno, "Failed to register %s", s->ifname);
+        close(s->fd);
+        s->fd = -1;
+        return ret;
+    }
+
+    return 0;
+}
+
+/*
+ * Open a netmap device. If s->ringid is negative all the hardware rings
+ * are bound, but we only use the first TX ring and the first RX ring.
+ * Otherwise only the TX and RX rings with index s->ringid are bound and
+ * used.
+ */
+static int netmap_open(NetmapState *s, Error **errp)
+{
+    struct nmreq_register req;
+    struct netmap_if *nifp;
+    NetmapState *other;
+    int ret;
+
+    ret = netmap_register(s, &req, errp);
+    if (ret) {
         return ret;
     }
     s->mem_id = req.nr_mem_id;
     s->nifp_offset = req.nr_offset;
 
+    if (s->ringid >= 0 && (s->ringid >= req.nr_tx_rings ||
+                           s->ringid >= req.nr_rx_rings)) {
+        error_setg(errp, "%s has only %u TX and %u RX rings, cannot use "
+                   "ring pair %d", s->ifname, req.nr_tx_rings,
+                   req.nr_rx_rings, s->ringid);
+        goto fail;
+    }
+
     /* Check if we already have a netmap port that uses the same memory as the
      * one just opened, so that nm_mmap() can skip mmap() and inherit from
      * parent. */
@@ -152,24 +194,90 @@ static int netmap_open(NetmapState *s, Error **errp)
         if (s->mem == MAP_FAILED) {
             error_setg_errno(errp, errno, "Failed to mmap %s",
                     s->ifname);
-            return -1;
+            goto fail;
         }
     } else {
         s->mem = other->mem;
     }
     nifp = NETMAP_IF(s->mem, req.nr_offset);
-    s->tx = NETMAP_TXRING(nifp, 0);
-    s->rx = NETMAP_RXRING(nifp, 0);
+    s->tx = NETMAP_TXRING(nifp, MAX(s->ringid, 0));
+    s->rx = NETMAP_RXRING(nifp, MAX(s->ringid, 0));
 
     return 0;
+
+fail:
+    /* Closing the file descriptor also unregisters the port. Forget its
+     * memory, so that netmap_find_memory() does not share it. */
+    close(s->fd);
+    s->fd = -1;
+    s->mem_id = 0;
+    s->mem = NULL;
+    return -1;
 }
 
 static void netmap_send(void *opaque);
 static void netmap_writable(void *opaque);
 
+/* Check for frames that an earlier sync already made visible before
+ * asking the kernel for new ones. */
+static bool netmap_rx_ring_poll(NetmapState *s)
+{
+    if (!nm_ring_empty(s->rx)) {
+        return true;
+    }
+    ioctl(s->fd, NIOCRXSYNC, NULL);
+    return !nm_ring_empty(s->rx);
+}
+
+/*
+ * Handlers used when the peer moved us to its own AioContext with
+ * qemu_net_set_aio_context(). Both sides run in that AioContext, so
+ * acquiring it is all we need.
+ */
+static void netmap_aio_read(void *opaque)
+{
+    NetmapState *s = opaque;
+
+    aio_context_acquire(s->nic_ctx);
+    netmap_send(s);
+    aio_context_release(s->nic_ctx);
+}
+
+static void netmap_aio_write(void *opaque)
+{
+    NetmapState *s = opaque;
+
+    aio_context_acquire(s->nic_ctx);
+    netmap_writable(s);
+    aio_context_release(s->nic_ctx);
+}
+
+/* Busy-poll callback, driven by the adaptive polling of the AioContext
+ * (see the poll-max-ns IOThread property). */
+static bool netmap_aio_poll(void *opaque)
+{
+    NetmapState *s = opaque;
+
+    if (!netmap_rx_ring_poll(s)) {
+        return false;
+    }
+    netmap_aio_read(s);
+
+    return true;
+}
+
 /* Set the event-loop handlers for the netmap backend. */
 static void netmap_update_fd_handler(NetmapState *s)
 {
+    if (s->nic_ctx) {
+        aio_set_fd_handler(s->nic_ctx, s->fd, false,
+                           s->read_poll ? netmap_aio_read : NULL,
+                           s->write_poll ? netmap_aio_write : NULL,
+                           s->read_poll ? netmap_aio_poll : NULL,
+                           s);
+        return;
+    }
+
     qemu_set_fd_handler(s->fd,
                         s->read_poll ? netmap_send : NULL,
                         s->write_poll ? netmap_writable : NULL,
@@ -205,6 +313,24 @@ static void netmap_poll(NetClientState *nc, bool enable)
     }
 }
 
+/* Tell the kernel about the TX slots published since the last TXSYNC. */
+static void netmap_txsync(NetmapState *s)
+{
+    if (s->txpending) {
+        s->txpending = 0;
+        ioctl(s->fd, NIOCTXSYNC, NULL);
+    }
+}
+
+/* Bottom half that flushes a partial TX batch once the peer is done
+ * sending, i.e. when control goes back to the event loop. */
+static void netmap_txsync_bh(void *opaque)
+{
+    NetmapState *s = opaque;
+
+    netmap_txsync(s);
+}
+
 /*
  * The fd_write() callback, invoked if the fd is marked as
  * writable after a poll. Unregister the handler and flush any
@@ -218,29 +344,68 @@ static void netmap_writable(void *opaque)
     qemu_flush_queued_packets(&s->nc);
 }
 
-static ssize_t netmap_receive_iov(NetClientState *nc,
-                    const struct iovec *iov, int iovcnt)
+/*
+ * Look for a netmap port sharing our memory allocator that is currently
+ * forwarding the netmap buffer starting at 'buf', and return the RX slot
+ * owning it. Such a buffer can be moved into one of our TX slots with
+ * a buffer swap, rather than being copied.
+ *
+ * A frame may be delivered to several ports, e.g. through a hub. Only
+ * the first port that swaps one of its buffers may swap the others;
+ * the other ports copy the frame, which stays untouched in the TX ring
+ * of the first port until the delivery is over.
+ */
+static struct netmap_slot *netmap_zcopy_lookup(NetmapState *s,
+                                               const void *buf)
+{
+    NetmapState *src;
+
+    QTAILQ_FOREACH(src, &netmap_clients, next) {
+        struct netmap_ring *ring = src->rx;
+        uint32_t i;
+
+        if (src->mem_id != s->mem_id ||
+            src->rx_inflight_head == src->rx_inflight_tail ||
+            (src->rx_inflight_taker && src->rx_inflight_taker != s)) {
+            continue;
+        }
+
+        for (i = src->rx_inflight_head; i != src->rx_inflight_tail;
+                                        i = nm_ring_next(ring, i)) {
+            if (NETMAP_BUF(ring, ring->slot[i].buf_idx) == buf) {
+                src->rx_inflight_taker = s;
+                return &ring->slot[i];
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/* Publish one frame to the TX ring, without syncing it. Returns 0 if
+ * there is no room for it. */
+static ssize_t netmap_tx_publish(NetmapState *s,
+                                 const struct iovec *iov, int iovcnt)
 {
-    NetmapState *s = DO_UPCAST(NetmapState, nc, nc);
     struct netmap_ring *ring = s->tx;
-    unsigned int tail = ring->tail;
-    ssize_t totlen = 0;
+    struct netmap_slot *src_slot;
+    unsigned int tail;
+    ssize_t totlen;
+    bool copied;
     uint32_t last;
     uint32_t idx;
     uint8_t *dst;
     int j;
     uint32_t i;
 
+again:
+    tail = ring->tail;
+    totlen = 0;
+    copied = false;
     last = i = ring->head;
 
     if (nm_ring_space(ring) < iovcnt) {
-        /* Not enough netmap slots. Tell the kernel that we have seen the new
-         * available slots (so that it notifies us again when it has more
-         * ones), but without publishing any new slots to be processed
-         * (e.g., we don't advance ring->head). */
-        ring->cur = tail;
-        netmap_write_poll(s, true);
-        return 0;
+        goto ring_full;
     }
 
     for (j = 0; j < iovcnt; j++) {
@@ -258,17 +423,35 @@ static ssize_t netmap_receive_iov(NetClientState *nc,
             if (unlikely(i == tail)) {
                 /* We ran out of netmap slots while splitting the
                    iovec fragments. */
-                ring->cur = tail;
-                netmap_write_poll(s, true);
-                return 0;
+                goto ring_full;
             }
 
-            idx = ring->slot[i].buf_idx;
-            dst = (uint8_t *)NETMAP_BUF(ring, idx);
-
+            /* Preserve NS_BUF_CHANGED, since a slot may have been
+             * swapped by a previous attempt that was not published. */
             ring->slot[i].len = nm_frag_size;
-            ring->slot[i].flags = NS_MOREFRAG;
-            pkt_copy(iov[j].iov_base + offset, dst, nm_frag_size);
+            ring->slot[i].flags = (ring->slot[i].flags & NS_BUF_CHANGED) |
+                                  NS_MOREFRAG;
+
+            src_slot = NULL;
+            if (s->zerocopy && offset == 0 &&
+                    iov_frag_size <= ring->nr_buf_size) {
+                src_slot = netmap_zcopy_lookup(s, iov[j].iov_base);
+            }
+
+            if (src_slot) {
+                /* Exchange buffers with the source RX slot, so that the
+                 * frame goes out without being copied. */
+                idx = ring->slot[i].buf_idx;
+                ring->slot[i].buf_idx = src_slot->buf_idx;
+                ring->slot[i].flags |= NS_BUF_CHANGED;
+                src_slot->buf_idx = idx;
+                src_slot->flags |= NS_BUF_CHANGED;
+            } else {
+                idx = ring->slot[i].buf_idx;
+                dst = (uint8_t *)NETMAP_BUF(ring, idx);
+                pkt_copy(dst, iov[j].iov_base + offset, nm_frag_size);
+                copied = true;
+            }
 
             last = i;
             i = nm_ring_next(ring, i);
@@ -284,9 +467,71 @@ static ssize_t netmap_receive_iov(NetClientState *nc,
      * the new wakeup point. */
     ring->head = ring->cur = i;
 
-    ioctl(s->fd, NIOCTXSYNC, NULL);
+    if (copied) {
+        s->tx_copy_frames++;
+    } else {
+        s->tx_zcopy_frames++;
+    }
+    s->txpending++;
 
     return totlen;
+
+ring_full:
+    if (s->txpending) {
+        /* Some published slots have not been synced yet. Flush them,
+         * which also lets the kernel give us back the slots it has
+         * completed, and try again. */
+        netmap_txsync(s);
+        goto again;
+    }
+
+    /* Not enough netmap slots. Tell the kernel that we have seen the new
+     * available slots (so that it notifies us again when it has more
+     * ones), but without publishing any new slots to be processed
+     * (e.g., we don't advance ring->head). */
+    ring->cur = tail;
+    netmap_write_poll(s, true);
+    return 0;
+}
+
+static ssize_t netmap_receive_iov(NetClientState *nc,
+                    const struct iovec *iov, int iovcnt)
+{
+    NetmapState *s = DO_UPCAST(NetmapState, nc, nc);
+    ssize_t ret;
+
+    ret = netmap_tx_publish(s, iov, iovcnt);
+    if (ret == 0) {
+        return 0;
+    }
+
+    /* Issue the TXSYNC right away if the batch is complete, otherwise
+     * defer it until the peer stops sending. */
+    if (s->txpending >= s->txbatch) {
+        netmap_txsync(s);
+    } else {
+        qemu_bh_schedule(s->txsync_bh);
+    }
+
+    return ret;
+}
+
+/* The peer hands over a whole batch: publish all the frames that fit
+ * and sync them with a single TXSYNC. */
+static int netmap_receive_batch(NetClientState *nc,
+                                const NetPacketVec *pkts, int count)
+{
+    NetmapState *s = DO_UPCAST(NetmapState, nc, nc);
+    int i;
+
+    for (i = 0; i < count; i++) {
+        if (netmap_tx_publish(s, pkts[i].iov, pkts[i].iovcnt) == 0) {
+            break;
+        }
+    }
+    netmap_txsync(s);
+
+    return i;
 }
 
 static ssize_t netmap_receive(NetClientState *nc,
@@ -344,8 +589,14 @@ static void netmap_send(void *opaque)
             break;
         }
 
+        /* Let netmap peers that share our memory swap the buffers out of
+         * these slots while the frame is being delivered. */
+        s->rx_inflight_head = ring->head;
+        s->rx_inflight_tail = i;
+        s->rx_inflight_taker = NULL;
         iovsize = qemu_sendv_packet_async(&s->nc, s->iov, iovcnt,
                                             netmap_send_completed);
+        s->rx_inflight_head = s->rx_inflight_tail = 0;
 
         /* Release the slots to the kernel. */
         ring->head = i;
@@ -359,21 +610,126 @@ static void netmap_send(void *opaque)
     }
 }
 
+/* Context: BH in IOThread */
+static void netmap_detach_aio_context_bh(void *opaque)
+{
+    NetmapState *s = opaque;
+
+    aio_set_fd_handler(qemu_get_current_aio_context(), s->fd, false,
+                       NULL, NULL, NULL, NULL);
+}
+
+static int netmap_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    NetmapState *s = DO_UPCAST(NetmapState, nc, nc);
+
+    if (s->iothread && ctx && ctx != iothread_get_aio_context(s->iothread)) {
+        /* Only the IOThread given with iothread= may run us. */
+        return -EBUSY;
+    }
+    if (s->fd < 0) {
+        return -EBADF;
+    }
+    if (ctx == s->nic_ctx) {
+        return 0;
+    }
+
+    /* The handlers are removed from within the IOThread, so none of
+     * them can still be running afterwards. */
+    if (s->nic_ctx) {
+        aio_wait_bh_oneshot(s->nic_ctx, netmap_detach_aio_context_bh, s);
+    } else {
+        qemu_set_fd_handler(s->fd, NULL, NULL, NULL);
+    }
+
+    /* The deferred TXSYNC must run where the TX ring is filled. */
+    netmap_txsync(s);
+    qemu_bh_delete(s->txsync_bh);
+    s->txsync_bh = aio_bh_new(ctx ? ctx : qemu_get_aio_context(),
+                              netmap_txsync_bh, s);
+
+    s->nic_ctx = ctx;
+    netmap_update_fd_handler(s);
+    return 0;
+}
+
+/* The IOThread given with iothread=, or NULL. The caller is the peer,
+ * which must then run this queue there with qemu_net_set_aio_context().
+ */
+IOThread *netmap_get_iothread(NetClientState *nc)
+{
+    NetmapState *s = DO_UPCAST(NetmapState, nc, nc);
+    assert(nc->info->type == NET_CLIENT_DRIVER_NETMAP);
+
+    if (s->iothread) {
+        s->iothread_taken = true;
+    }
+    return s->iothread;
+}
+
+/* Only the peer can move the datapath to the IOThread; without that,
+ * iothread= would silently leave it in the main loop. */
+static void netmap_check_iothreads(Notifier *notifier, void *data)
+{
+    NetmapState *s;
+
+    QTAILQ_FOREACH(s, &netmap_clients, next) {
+        if (s->iothread && !s->iothread_taken) {
+            error_report("netdev '%s': iothread= needs a virtio-net peer, "
+                         "which then runs its dataplane in IOThread '%s'",
+                         s->nc.name, iothread_get_id(s->iothread));
+            exit(1);
+        }
+    }
+}
+
+static void netmap_check_iothreads_at_init(void)
+{
+    static Notifier notifier = { .notify = netmap_check_iothreads };
+    static bool registered;
+
+    /* Hotplugged netdevs get their peer later; nothing to check then. */
+    if (!machine_init_done && !registered) {
+        qemu_add_machine_init_done_notifier(&notifier);
+        registered = true;
+    }
+}
+
 /* Flush and close. */
 static void netmap_cleanup(NetClientState *nc)
 {
     NetmapState *s = DO_UPCAST(NetmapState, nc, nc);
 
+    if (s->nic_ctx) {
+        AioContext *ctx = s->nic_ctx;
+
+        aio_context_acquire(ctx);
+        netmap_set_aio_context(nc, NULL);
+        aio_context_release(ctx);
+    }
+
     qemu_purge_queued_packets(nc);
     ptnetmap_kloop_stop(&s->ptnetmap);
+    if (s->ptnetmap.fallback_bh) {
+        qemu_bh_delete(s->ptnetmap.fallback_bh);
+        s->ptnetmap.fallback_bh = NULL;
+    }
 
     if (s->fd >= 0) {
+        netmap_txsync(s);
         netmap_poll(nc, false);
         close(s->fd);
         s->fd = -1;
     }
+    qemu_bh_delete(s->txsync_bh);
+    if (s->iothread) {
+        object_unref(OBJECT(s->iothread));
+        s->iothread = NULL;
+    }
 
     QTAILQ_REMOVE(&netmap_clients, s, next);
+    g_free(s->ptnetmap.ring_stats);
+    g_free(s->ptnetmap.shadow_ktoa);
 }
 
 static void nmreq_hdr_init(struct nmreq_header *hdr, const char *ifname)
@@ -460,12 +816,21 @@ static void netmap_set_offload(NetClientState *nc, int csum, int tso4, int tso6,
     }
 }
 
+static void netmap_print_info(NetClientState *nc, Monitor *mon)
+{
+    NetmapState *s = DO_UPCAST(NetmapState, nc, nc);
+
+    monitor_printf(mon, "  tx frames: %" PRIu64 " zero-copy, %" PRIu64
+                   " copied\n", s->tx_zcopy_frames, s->tx_copy_frames);
+}
+
 /* NetClientInfo methods */
 static NetClientInfo net_netmap_info = {
     .type = NET_CLIENT_DRIVER_NETMAP,
     .size = sizeof(NetmapState),
     .receive = netmap_receive,
     .receive_iov = netmap_receive_iov,
+    .receive_batch = netmap_receive_batch,
     .poll = netmap_poll,
     .cleanup = netmap_cleanup,
     .has_ufo = netmap_has_vnet_hdr,
@@ -474,6 +839,8 @@ static NetClientInfo net_netmap_info = {
     .using_vnet_hdr = netmap_using_vnet_hdr,
     .set_offload = netmap_set_offload,
     .set_vnet_hdr_len = netmap_set_vnet_hdr_len,
+    .print_info = netmap_print_info,
+    .set_aio_context = netmap_set_aio_context,
 };
 
 /*
@@ -507,8 +874,15 @@ PTNetmapState *get_ptnetmap(NetClientState *nc)
     }
 
     /* Create a new ptnetmap memdev that exposes the memory allocator,
-     * if it does not exist yet. */
-    ptnetmap_memdev_create(s->mem, &pi);
+     * if it does not exist yet. On incoming migration the guest keeps
+     * using the memory of the source, which the memdev restores into a
+     * copy of its own. */
+    s->ptnetmap.mem = s->mem;
+    ptnetmap_memdev_create(s->mem, &pi, runstate_check(RUN_STATE_INMIGRATE),
+                           &s->ptnetmap.mem);
+    s->ptnetmap.memsize = pi.nr_memsize;
+    s->ptnetmap.nifp_offset = s->nifp_offset;
+    s->ptnetmap.shadow = s->ptnetmap.mem != s->mem;
 
     return &s->ptnetmap;
 }
@@ -557,6 +931,11 @@ uint32_t netmap_get_nifp_offset(NetClientState *nc)
 {
     NetmapState *s = DO_UPCAST(NetmapState, nc, nc);
 
+    if (s->ptnetmap.netmap == s) {
+        /* The offset in the memory seen by the guest. */
+        return s->ptnetmap.nifp_offset;
+    }
+
     return s->nifp_offset;
 }
 
@@ -565,6 +944,9 @@ struct SyncKloopThreadCtx {
     int num_entries;
     int *ioeventfds;
     int *irqfds;
+    struct nm_csb_atok *csb_atok;   /* Only used by the userspace loop. */
+    struct nm_csb_ktoa *csb_ktoa;
+    struct SyncUloopRing *rings;
 };
 
 /* Start a kernel sync loop for the netmap rings bound to 's->fd'. */
@@ -612,12 +994,18 @@ static void *ptnetmap_sync_kloop_worker(void *opaque)
     memset(&req, 0, sizeof(req));
     req.sleep_us = 100;  /* ignored by the kernel */
     err          = ioctl(s->fd, NIOCCTRL, &hdr);
+    g_free(evopt);
     if (err) {
-        error_report("Unable to execute SYNC_KLOOP_START on %s: %s",
+        error_report("Unable to execute SYNC_KLOOP_START on %s: %s, "
+                     "falling back to the userspace sync loop",
                      s->ifname, strerror(errno));
+        /* The eventfds and the CSB are handed over to the userspace
+         * loop, which ptnetmap_kloop_fallback_bh() starts. */
+        atomic_mb_set(&s->ptnetmap.failed_ctx, ctx);
+        qemu_bh_schedule(s->ptnetmap.fallback_bh);
+        return NULL;
     }
 
-    g_free(evopt);
     g_free(ctx->ioeventfds);
     g_free(ctx->irqfds);
     g_free(ctx);
@@ -625,6 +1013,724 @@ static void *ptnetmap_sync_kloop_worker(void *opaque)
     return NULL;
 }
 
+/*
+ * Userspace sync loop, used when the netmap kernel module does not
+ * support the in-kernel sync loop. The rings bound to 's->fd' are
+ * driven through the regular netmap API: the loop copies the guest
+ * head/cur pointers from the CSB into the netmap rings, runs TXSYNC
+ * and RXSYNC, and copies the kernel hwcur/hwtail back to the CSB,
+ * raising the irqfds when the guest asked for a notification.
+ * The loop busy-polls for a while when there is no work to do, and
+ * then it enables guest kicks and sleeps on the ioeventfds.
+ *
+ * In shadow mode (after an incoming migration) the guest rings are not
+ * the rings of 's->fd', but their copy restored from the source: the
+ * loop then copies the frames between the two, and it maintains the
+ * hwcur/hwtail pointers of the guest rings by itself.
+ */
+
+/* Busy-poll budget, adapted between 0 and PTNETMAP_ULOOP_POLL_MAX_NS in
+ * the same way AioContext adapts its polling time. */
+#define PTNETMAP_ULOOP_POLL_MAX_NS  (64 * SCALE_US)
+#define PTNETMAP_ULOOP_POLL_MIN_NS  (4 * SCALE_US)
+
+typedef struct SyncUloopRing {
+    struct netmap_ring *ring;
+    struct nm_csb_atok *atok;
+    struct nm_csb_ktoa *ktoa;
+    int ioeventfd;
+    int irqfd;
+    PTNetmapRingStats *stats;
+
+    /* Shadow mode only: the guest ring, the offset of its buffers in
+     * the guest memory, the last head seen and the pointers published
+     * to the guest. */
+    struct netmap_ring *gring;
+    uint64_t gbuf_ofs;
+    uint32_t ghead;
+    uint32_t hwcur;
+    uint32_t hwtail;
+} SyncUloopRing;
+
+static void ptnetmap_uloop_kick(int fd)
+{
+    uint64_t v = 1;
+    ssize_t ret;
+
+    do {
+        ret = write(fd, &v, sizeof(v));
+    } while (ret < 0 && errno == EINTR);
+}
+
+/* Consume a guest kick, and account for it. */
+static void ptnetmap_uloop_drain(SyncUloopRing *r, int64_t now)
+{
+    PTNetmapRingStats *stats = r->stats;
+    uint64_t v;
+    ssize_t ret;
+
+    do {
+        ret = read(r->ioeventfd, &v, sizeof(v));
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret == sizeof(v)) {
+        stat64_add(&stats->kicks, v);
+        if (stats->last_kick_ns) {
+            uint64_t us = (now - stats->last_kick_ns) / SCALE_US;
+            int bucket = MIN(us ? 64 - clz64(us) : 0,
+                             PTNETMAP_KICK_HIST_BUCKETS - 1);
+
+            stat64_add(&stats->kick_hist[bucket], 1);
+        }
+        stats->last_kick_ns = now;
+    }
+}
+
+/* Copy the guest pointers into the netmap ring. Return true if the
+ * guest published new slots. */
+static bool ptnetmap_uloop_intake(SyncUloopRing *r)
+{
+    uint32_t head = atomic_read(&r->atok->head);
+    uint32_t cur = atomic_read(&r->atok->cur);
+
+    smp_rmb();
+    if (unlikely(head >= r->ring->num_slots || cur >= r->ring->num_slots)) {
+        /* Bogus pointers, ignore them. */
+        return false;
+    }
+    if (head == r->ring->head && cur == r->ring->cur) {
+        return false;
+    }
+    r->ring->head = head;
+    r->ring->cur = cur;
+
+    return true;
+}
+
+/* Publish the kernel pointers to the guest, and notify it if needed.
+ * Return true if the kernel made progress on the ring. */
+static bool ptnetmap_uloop_publish(SyncUloopRing *r, uint32_t hwcur,
+                                   uint32_t hwtail)
+{
+    uint32_t old_tail = atomic_read(&r->ktoa->hwtail);
+
+    atomic_set(&r->ktoa->hwcur, hwcur);
+    atomic_set(&r->ktoa->hwtail, hwtail);
+    if (hwtail == old_tail) {
+        return false;
+    }
+
+    smp_mb();
+    if (atomic_read(&r->atok->appl_need_kick)) {
+        ptnetmap_uloop_kick(r->irqfd);
+        stat64_add(&r->stats->interrupts, 1);
+    }
+
+    return true;
+}
+
+/* Return true if [p, p + len) lies in the netmap memory seen by the
+ * guest. */
+static bool ptnetmap_guest_range_ok(PTNetmapState *ptn, const void *p,
+                                    uint64_t len)
+{
+    uintptr_t ofs = (uintptr_t)p - (uintptr_t)ptn->mem;
+
+    return p >= ptn->mem && ofs <= ptn->memsize && len <= ptn->memsize - ofs;
+}
+
+/* Look up the netmap_if seen by the guest, and check that it describes
+ * the same rings as the one of 's->fd'. */
+static struct netmap_if *ptnetmap_guest_nifp(PTNetmapState *ptn)
+{
+    NetmapState *s = ptn->netmap;
+    struct netmap_if *nifp = NETMAP_IF(s->mem, s->nifp_offset);
+    struct netmap_if *gnifp = NETMAP_IF(ptn->mem, ptn->nifp_offset);
+    unsigned int num_rings = nifp->ni_tx_rings + nifp->ni_rx_rings;
+
+    if (gnifp == nifp) {
+        return nifp;
+    }
+    if (!ptnetmap_guest_range_ok(ptn, gnifp, sizeof(*gnifp) +
+                                 2 * num_rings * sizeof(gnifp->ring_ofs[0])) ||
+        memcmp(&gnifp->ni_version, &nifp->ni_version,
+               offsetof(struct netmap_if, ring_ofs) -
+               offsetof(struct netmap_if, ni_version))) {
+        return NULL;
+    }
+
+    return gnifp;
+}
+
+/* Return the guest ring matching 'ring', or NULL if it is bogus. */
+static struct netmap_ring *ptnetmap_guest_ring(PTNetmapState *ptn,
+                                               struct netmap_if *gnifp,
+                                               struct netmap_ring *ring,
+                                               unsigned int i, bool tx)
+{
+    struct netmap_ring *gring = tx ? NETMAP_TXRING(gnifp, i)
+                                   : NETMAP_RXRING(gnifp, i);
+
+    if (!ptnetmap_guest_range_ok(ptn, gring, sizeof(*gring) +
+                                 ring->num_slots * sizeof(gring->slot[0])) ||
+        gring->num_slots != ring->num_slots ||
+        gring->nr_buf_size != ring->nr_buf_size) {
+        return NULL;
+    }
+
+    return gring;
+}
+
+/* Shadow mode: return the guest buffer 'buf_idx', or NULL if it does
+ * not lie in the guest memory. */
+static void *ptnetmap_shadow_buf(PTNetmapState *ptn, SyncUloopRing *r,
+                                 uint32_t buf_idx)
+{
+    uint64_t ofs = r->gbuf_ofs + (uint64_t)buf_idx * r->ring->nr_buf_size;
+
+    if (ofs > ptn->memsize || r->ring->nr_buf_size > ptn->memsize - ofs) {
+        return NULL;
+    }
+
+    return (char *)ptn->mem + ofs;
+}
+
+/* Shadow mode: move the frames published by the guest on a TX ring to
+ * the netmap ring. Guest slots are given back as soon as they are
+ * copied. Return true if the guest pointers changed. */
+static bool ptnetmap_shadow_txsync(PTNetmapState *ptn, SyncUloopRing *r)
+{
+    struct netmap_ring *ring = r->ring;
+    uint32_t head = atomic_read(&r->atok->head);
+    uint32_t hwtail;
+    bool progress = false;
+
+    smp_rmb();
+    if (unlikely(head >= ring->num_slots)) {
+        return false;
+    }
+    r->ghead = head;
+
+    while (r->hwcur != head && !nm_ring_empty(ring)) {
+        struct netmap_slot *gslot = r->gring->slot + r->hwcur;
+        struct netmap_slot *slot = ring->slot + ring->cur;
+        uint16_t len = atomic_read(&gslot->len);
+        void *src = ptnetmap_shadow_buf(ptn, r, atomic_read(&gslot->buf_idx));
+
+        if (likely(src)) {
+            len = MIN(len, ring->nr_buf_size);
+            pkt_copy(NETMAP_BUF(ring, slot->buf_idx), src, len);
+            slot->len = len;
+            slot->flags = atomic_read(&gslot->flags) & NS_MOREFRAG;
+            ring->head = ring->cur = nm_ring_next(ring, ring->cur);
+        }
+        r->hwcur = nm_ring_next(ring, r->hwcur);
+        progress = true;
+    }
+
+    hwtail = r->hwcur ? r->hwcur - 1 : ring->num_slots - 1;
+    if (progress || hwtail != r->hwtail) {
+        r->hwtail = hwtail;
+        ptnetmap_uloop_publish(r, r->hwcur, hwtail);
+        return true;
+    }
+
+    return false;
+}
+
+/* Shadow mode: move the frames received on the netmap ring to the free
+ * slots of a guest RX ring. Return true if new frames were published. */
+static bool ptnetmap_shadow_rxsync(PTNetmapState *ptn, SyncUloopRing *r)
+{
+    struct netmap_ring *ring = r->ring;
+    uint32_t head = atomic_read(&r->atok->head);
+    uint32_t hwtail = r->hwtail;
+
+    smp_rmb();
+    if (unlikely(head >= ring->num_slots)) {
+        return false;
+    }
+    r->ghead = head;
+
+    while (!nm_ring_empty(ring) && nm_ring_next(ring, hwtail) != head) {
+        struct netmap_slot *slot = ring->slot + ring->cur;
+        struct netmap_slot *gslot = r->gring->slot + hwtail;
+        uint16_t len = MIN(slot->len, ring->nr_buf_size);
+        void *dst = ptnetmap_shadow_buf(ptn, r, atomic_read(&gslot->buf_idx));
+
+        if (likely(dst)) {
+            pkt_copy(dst, NETMAP_BUF(ring, slot->buf_idx), len);
+            gslot->len = len;
+            gslot->flags = slot->flags & NS_MOREFRAG;
+            hwtail = nm_ring_next(ring, hwtail);
+        }
+        ring->head = ring->cur = nm_ring_next(ring, ring->cur);
+    }
+
+    if (head == r->hwcur && hwtail == r->hwtail) {
+        return false;
+    }
+    r->hwcur = head;
+    r->hwtail = hwtail;
+
+    return ptnetmap_uloop_publish(r, head, hwtail);
+}
+
+/* Initialize the CSB entry of a ring, as CSB_ENABLE would do. */
+static void ptnetmap_uloop_csb_init(SyncUloopRing *r, uint32_t head,
+                                    uint32_t cur, uint32_t hwcur,
+                                    uint32_t hwtail)
+{
+    atomic_set(&r->atok->head, head);
+    atomic_set(&r->atok->cur, cur);
+    atomic_set(&r->atok->appl_need_kick, 1);
+    atomic_set(&r->atok->sync_flags, 0);
+    atomic_set(&r->ktoa->hwcur, hwcur);
+    atomic_set(&r->ktoa->hwtail, hwtail);
+    atomic_set(&r->ktoa->kern_need_kick, 0);
+}
+
+/* Bind the CSB entries to the netmap rings and, in shadow mode, to the
+ * guest rings. The guest ring pointers are taken from the CSB when the
+ * rings are resumed after a migration, from the last run of the loop
+ * otherwise. Return NULL if the guest rings are bogus. */
+static SyncUloopRing *ptnetmap_uloop_rings_init(PTNetmapState *ptn,
+                                                struct SyncKloopThreadCtx *ctx)
+{
+    NetmapState *s = ptn->netmap;
+    struct netmap_if *nifp = NETMAP_IF(s->mem, s->nifp_offset);
+    struct netmap_if *gnifp = NULL;
+    unsigned int num_tx = nifp->ni_tx_rings;
+    unsigned int num_rings = ctx->num_entries;
+    bool resume = ptn->resume;
+    bool fresh = false;
+    SyncUloopRing *rings;
+    unsigned int i;
+
+    ptn->resume = false;
+    if (ptn->shadow) {
+        gnifp = ptnetmap_guest_nifp(ptn);
+        if (!gnifp) {
+            return NULL;
+        }
+        if (ptn->num_shadow_rings != num_rings) {
+            g_free(ptn->shadow_ktoa);
+            ptn->shadow_ktoa = g_new0(struct nm_csb_ktoa, num_rings);
+            ptn->num_shadow_rings = num_rings;
+            fresh = true;
+        }
+    }
+
+    rings = g_new0(SyncUloopRing, num_rings);
+
+    /* TX rings come first, then RX rings, both in the CSB and in the
+     * arrays of eventfds. */
+    for (i = 0; i < num_rings; i++) {
+        SyncUloopRing *r = rings + i;
+        bool tx = i < num_tx;
+        struct nm_csb_ktoa *saved;
+
+        r->ring = tx ? NETMAP_TXRING(nifp, i) : NETMAP_RXRING(nifp, i - num_tx);
+        r->atok = ctx->csb_atok + i;
+        r->ktoa = ctx->csb_ktoa + i;
+        r->ioeventfd = ctx->ioeventfds[i];
+        r->irqfd = ctx->irqfds[i];
+        r->stats = ptn->ring_stats + i;
+
+        if (!ptn->shadow) {
+            ptnetmap_uloop_csb_init(r, r->ring->head, r->ring->cur,
+                                    r->ring->head, r->ring->tail);
+            continue;
+        }
+
+        r->gring = ptnetmap_guest_ring(ptn, gnifp, r->ring,
+                                       tx ? i : i - num_tx, tx);
+        if (!r->gring) {
+            g_free(rings);
+            return NULL;
+        }
+        r->gbuf_ofs = (char *)r->gring - (char *)ptn->mem +
+                      r->gring->buf_ofs;
+
+        saved = ptn->shadow_ktoa + i;
+        if (resume) {
+            saved->hwcur = atomic_read(&r->ktoa->hwcur);
+            saved->hwtail = atomic_read(&r->ktoa->hwtail);
+        } else if (fresh) {
+            saved->hwcur = r->gring->head;
+            saved->hwtail = r->gring->tail;
+        }
+        if (saved->hwcur >= r->ring->num_slots ||
+            saved->hwtail >= r->ring->num_slots) {
+            g_free(rings);
+            return NULL;
+        }
+        r->ghead = r->hwcur = saved->hwcur;
+        r->hwtail = saved->hwtail;
+        if (!resume) {
+            ptnetmap_uloop_csb_init(r, r->hwcur, r->hwcur,
+                                    r->hwcur, r->hwtail);
+        }
+    }
+    smp_mb();
+
+    return rings;
+}
+
+static void ptnetmap_uloop_need_kick(SyncUloopRing *rings, int num_rings,
+                                     uint32_t enable)
+{
+    int i;
+
+    for (i = 0; i < num_rings; i++) {
+        atomic_set(&rings[i].ktoa->kern_need_kick, enable);
+    }
+    smp_mb();
+}
+
+static void *ptnetmap_sync_uloop_worker(void *opaque)
+{
+    struct SyncKloopThreadCtx *ctx = opaque;
+    NetmapState *s = ctx->s;
+    PTNetmapState *ptn = &s->ptnetmap;
+    struct netmap_if *nifp = NETMAP_IF(s->mem, s->nifp_offset);
+    SyncUloopRing *rings = ctx->rings;
+    bool shadow = ptn->shadow;
+    int num_tx = nifp->ni_tx_rings;
+    int num_rings = ctx->num_entries;
+    int64_t poll_ns = PTNETMAP_ULOOP_POLL_MIN_NS;
+    int64_t idle_since = 0;
+    struct pollfd *fds;
+    int i;
+
+    fds = g_new0(struct pollfd, num_rings + 2);
+    for (i = 0; i < num_rings; i++) {
+        fds[i].fd = rings[i].ioeventfd;
+        fds[i].events = POLLIN;
+    }
+    fds[num_rings].fd = s->fd;
+    fds[num_rings + 1].fd = event_notifier_get_fd(&ptn->uloop_stop);
+    fds[num_rings + 1].events = POLLIN;
+
+    while (!atomic_read(&ptn->uloop_stopping)) {
+        bool tx_work = false;
+        bool progress = false;
+        int64_t now, slept;
+
+        for (i = 0; i < num_tx; i++) {
+            if (shadow) {
+                progress |= ptnetmap_shadow_txsync(ptn, rings + i);
+            } else {
+                tx_work |= ptnetmap_uloop_intake(rings + i);
+            }
+            /* Also sync if some slots still wait for completion. */
+            tx_work |= nm_ring_space(rings[i].ring) <
+                       rings[i].ring->num_slots - 1;
+        }
+        if (tx_work) {
+            ioctl(s->fd, NIOCTXSYNC, NULL);
+            for (i = 0; i < num_tx && !shadow; i++) {
+                progress |= ptnetmap_uloop_publish(rings + i,
+                                                   rings[i].ring->head,
+                                                   rings[i].ring->tail);
+            }
+        }
+
+        for (i = num_tx; i < num_rings && !shadow; i++) {
+            progress |= ptnetmap_uloop_intake(rings + i);
+        }
+        ioctl(s->fd, NIOCRXSYNC, NULL);
+        for (i = num_tx; i < num_rings; i++) {
+            if (shadow) {
+                progress |= ptnetmap_shadow_rxsync(ptn, rings + i);
+            } else {
+                progress |= ptnetmap_uloop_publish(rings + i,
+                                                   rings[i].ring->head,
+                                                   rings[i].ring->tail);
+            }
+        }
+
+        now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        if (progress) {
+            if (idle_since) {
+                stat64_add(&ptn->uloop_polls, 1);
+            }
+            idle_since = 0;
+            continue;
+        }
+        if (!idle_since) {
+            idle_since = now;
+        }
+        if (now - idle_since < poll_ns) {
+            cpu_relax();
+            continue;
+        }
+
+        /* Nothing happened for a while: enable guest kicks, check again
+         * to close the race with the guest, and sleep. */
+        ptnetmap_uloop_need_kick(rings, num_rings, 1);
+        for (i = 0; i < num_rings; i++) {
+            uint32_t seen = shadow ? rings[i].ghead : rings[i].ring->head;
+
+            if (atomic_read(&rings[i].atok->head) != seen) {
+                break;
+            }
+        }
+        if (i == num_rings) {
+            /* Ask for TX completions only if someone waits for them. In
+             * shadow mode, ask for them if the guest frames do not fit
+             * the netmap ring. */
+            fds[num_rings].events = 0;
+            for (i = 0; i < num_tx; i++) {
+                if (shadow ? rings[i].hwcur != rings[i].ghead :
+                    atomic_read(&rings[i].atok->appl_need_kick) &&
+                    nm_ring_space(rings[i].ring) <
+                    rings[i].ring->num_slots - 1) {
+                    fds[num_rings].events |= POLLOUT;
+                }
+            }
+            /* netmap reports the fd readable as long as any RX ring
+             * holds frames not consumed yet, which would make poll()
+             * return at once while the guest lags behind. Ask for RX
+             * frames only if the guest took all of them (and, in shadow
+             * mode, has room for more): otherwise the guest kick that
+             * frees the slots wakes us up. */
+            for (i = num_tx; i < num_rings; i++) {
+                if (!nm_ring_empty(rings[i].ring) ||
+                    (shadow && nm_ring_next(rings[i].ring, rings[i].hwtail) ==
+                               rings[i].ghead)) {
+                    break;
+                }
+            }
+            if (i == num_rings) {
+                fds[num_rings].events |= POLLIN;
+            }
+            poll(fds, num_rings + 2, -1);
+            stat64_add(&ptn->uloop_sleeps, 1);
+            slept = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+            for (i = 0; i < num_rings; i++) {
+                if (fds[i].revents & POLLIN) {
+                    ptnetmap_uloop_drain(rings + i, slept);
+                }
+            }
+
+            /* Grow the polling time if we slept only for a short time,
+             * shrink it otherwise. */
+            if (slept - now < PTNETMAP_ULOOP_POLL_MAX_NS) {
+                poll_ns = MIN(poll_ns * 2, PTNETMAP_ULOOP_POLL_MAX_NS);
+            } else {
+                poll_ns = MAX(poll_ns / 2, PTNETMAP_ULOOP_POLL_MIN_NS);
+            }
+        }
+        ptnetmap_uloop_need_kick(rings, num_rings, 0);
+        idle_since = 0;
+    }
+
+    /* Remember the guest ring pointers for the next run. */
+    for (i = 0; i < num_rings && shadow; i++) {
+        ptn->shadow_ktoa[i].hwcur = rings[i].hwcur;
+        ptn->shadow_ktoa[i].hwtail = rings[i].hwtail;
+    }
+
+    g_free(fds);
+    g_free(rings);
+    g_free(ctx->ioeventfds);
+    g_free(ctx->irqfds);
+    g_free(ctx);
+
+    return NULL;
+}
+
+/* Mark the parts of the guest memory that the host writes behind the
+ * back of dirty logging, so that the last pass of a migration sends
+ * them: the ring slots, and the buffers of the frames received but not
+ * yet consumed by the guest. The sync loop must be stopped. */
+void ptnetmap_dirty_rings(PTNetmapState *ptn, void *csb_gh, void *csb_hg,
+                          unsigned int num_entries)
+{
+    NetmapState *s = ptn->netmap;
+    struct netmap_if *nifp = NETMAP_IF(s->mem, s->nifp_offset);
+    struct netmap_if *gnifp = ptnetmap_guest_nifp(ptn);
+    struct nm_csb_atok *atok = csb_gh;
+    struct nm_csb_ktoa *ktoa = csb_hg;
+    unsigned int num_tx = nifp->ni_tx_rings;
+    unsigned int i;
+
+    if (!gnifp || !atok || !ktoa ||
+        num_entries != num_tx + nifp->ni_rx_rings) {
+        return;
+    }
+
+    for (i = 0; i < num_entries; i++) {
+        bool tx = i < num_tx;
+        struct netmap_ring *ring = tx ? NETMAP_TXRING(nifp, i)
+                                      : NETMAP_RXRING(nifp, i - num_tx);
+        struct netmap_ring *gring;
+        uint32_t head, hwtail;
+
+        gring = ptnetmap_guest_ring(ptn, gnifp, ring, tx ? i : i - num_tx, tx);
+        if (!gring) {
+            continue;
+        }
+        ptnetmap_memdev_set_dirty(gring, sizeof(*gring) +
+                                  ring->num_slots * sizeof(gring->slot[0]));
+        if (tx) {
+            continue;
+        }
+
+        head = atomic_read(&atok[i].head);
+        hwtail = atomic_read(&ktoa[i].hwtail);
+        if (head >= ring->num_slots || hwtail >= ring->num_slots) {
+            continue;
+        }
+        for (; head != hwtail; head = nm_ring_next(ring, head)) {
+            char *buf = NETMAP_BUF(gring, gring->slot[head].buf_idx);
+
+            if (ptnetmap_guest_range_ok(ptn, buf, ring->nr_buf_size)) {
+                ptnetmap_memdev_set_dirty(buf, ring->nr_buf_size);
+            }
+        }
+    }
+}
+
+/* The guest registers its netmap interface again: it now takes its rings
+ * from the CSB, which is initialized from the port. After an incoming
+ * migration, stop shadowing the rings of the source and let the guest
+ * use the netmap memory of the port directly. */
+void ptnetmap_unshadow(PTNetmapState *ptn)
+{
+    NetmapState *s = ptn->netmap;
+
+    if (!ptn->shadow || ptn->worker_started) {
+        return;
+    }
+
+    /* The guest keeps using the netmap_if it found on the source. */
+    if (ptn->nifp_offset != s->nifp_offset ||
+        ptnetmap_memdev_unshadow(ptn->mem, s->mem)) {
+        return;
+    }
+
+    ptn->mem = s->mem;
+    ptn->shadow = false;
+    g_free(ptn->shadow_ktoa);
+    ptn->shadow_ktoa = NULL;
+    ptn->num_shadow_rings = 0;
+}
+
+/* Start the userspace sync loop for the rings bound to 's->fd'. The
+ * loop takes ownership of 'ctx', which is freed on failure. */
+static int ptnetmap_uloop_start(PTNetmapState *ptn,
+                                struct SyncKloopThreadCtx *ctx)
+{
+    NetmapState *s = ptn->netmap;
+    struct netmap_if *nifp = NETMAP_IF(s->mem, s->nifp_offset);
+    char tname[128];
+    int ret;
+
+    if (ctx->num_entries != nifp->ni_tx_rings + nifp->ni_rx_rings) {
+        error_report("Number of CSB entries (%u) does not match the "
+                     "rings of %s", ctx->num_entries, s->ifname);
+        g_free(ctx->ioeventfds);
+        g_free(ctx->irqfds);
+        g_free(ctx);
+        return -EINVAL;
+    }
+
+    /* Statistics are reset each time the loop is started. */
+    if (ptn->num_ring_stats != ctx->num_entries) {
+        g_free(ptn->ring_stats);
+        ptn->ring_stats = g_new0(PTNetmapRingStats, ctx->num_entries);
+        ptn->num_ring_stats = ctx->num_entries;
+    } else {
+        memset(ptn->ring_stats, 0, ctx->num_entries * sizeof(*ptn->ring_stats));
+    }
+    stat64_init(&ptn->uloop_polls, 0);
+    stat64_init(&ptn->uloop_sleeps, 0);
+
+    ctx->rings = ptnetmap_uloop_rings_init(ptn, ctx);
+    if (!ctx->rings) {
+        error_report("Guest rings of %s are not valid", s->ifname);
+        g_free(ctx->ioeventfds);
+        g_free(ctx->irqfds);
+        g_free(ctx);
+        return -EINVAL;
+    }
+
+    ret = event_notifier_init(&ptn->uloop_stop, 0);
+    if (ret) {
+        error_report("Unable to create the sync loop stop notifier");
+        g_free(ctx->rings);
+        g_free(ctx->ioeventfds);
+        g_free(ctx->irqfds);
+        g_free(ctx);
+        return ret;
+    }
+    atomic_set(&ptn->uloop_stopping, false);
+
+    snprintf(tname, sizeof(tname), "ptnetmap-sync-uloop-%s", s->ifname);
+    qemu_thread_create(&ptn->th, tname, ptnetmap_sync_uloop_worker,
+                       ctx, QEMU_THREAD_JOINABLE);
+
+    return 0;
+}
+
+/* Register the port again on a new file descriptor, which is not in CSB
+ * mode. The rings must stay where the guest already sees them. */
+static int ptnetmap_reregister(NetmapState *s, Error **errp)
+{
+    struct nmreq_register req;
+    int ret;
+
+    close(s->fd);
+    ret = netmap_register(s, &req, errp);
+    if (ret) {
+        return ret;
+    }
+    if (req.nr_mem_id != s->mem_id || req.nr_offset != s->nifp_offset) {
+        error_setg(errp, "The rings of %s moved after registering it again",
+                   s->ifname);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Context: BH in the main loop, scheduled when SYNC_KLOOP_START failed.
+ * CSB_ENABLE succeeded then, and netmap has no way to leave CSB mode: it
+ * refuses TXSYNC and RXSYNC on 's->fd' from now on. Register the port
+ * again without a CSB and run the userspace loop in place of the kernel
+ * one. The loop initializes the CSB from the rings of the new
+ * registration, like CSB_ENABLE did. */
+static void ptnetmap_kloop_fallback_bh(void *opaque)
+{
+    PTNetmapState *ptn = opaque;
+    struct SyncKloopThreadCtx *ctx = atomic_mb_read(&ptn->failed_ctx);
+    NetmapState *s = ptn->netmap;
+    Error *err = NULL;
+
+    if (!ctx) {
+        /* ptnetmap_kloop_stop() got here first. */
+        return;
+    }
+    qemu_thread_join(&ptn->th);
+    ptn->failed_ctx = NULL;
+    ptn->worker_started = false;
+
+    if (ptnetmap_reregister(s, &err)) {
+        error_reportf_err(err, "Unable to start the userspace sync loop: ");
+        g_free(ctx->ioeventfds);
+        g_free(ctx->irqfds);
+        g_free(ctx);
+        return;
+    }
+
+    ptn->uloop = true;
+    if (ptnetmap_uloop_start(ptn, ctx) == 0) {
+        ptn->worker_started = true;
+    }
+}
+
 int ptnetmap_kloop_start(PTNetmapState *ptn, void *csb_gh, void *csb_hg,
                 unsigned int num_entries, int *ioeventfds, int *irqfds)
 {
@@ -647,30 +1753,44 @@ int ptnetmap_kloop_start(PTNetmapState *ptn, void *csb_gh, void *csb_hg,
     csbopt.csb_atok = (uintptr_t)csb_gh;
     csbopt.csb_ktoa = (uintptr_t)csb_hg;
 
-    /* Enable CSB mode, since it was not done by netmap_open(). This
-     * operation also initializes the CSB. */
-    nmreq_hdr_init(&hdr, s->ifname);
-    hdr.nr_reqtype = NETMAP_REQ_CSB_ENABLE;
-    hdr.nr_options = (uintptr_t)&csbopt;
-    hdr.nr_body = (uintptr_t)NULL;
-    ret = ioctl(s->fd, NIOCCTRL, &hdr);
-    if (ret) {
-        error_report("Unable to execute CSB_ENABLE on %s: %s",
-                     s->ifname, strerror(errno));
-        g_free(ioeventfds);
-        g_free(irqfds);
-        return ret;
+    /* In shadow mode the guest rings are not the ones of 's->fd', and
+     * only the userspace loop can serve them. */
+    ptn->uloop = s->kloopuser || ptn->shadow;
+    if (!ptn->uloop) {
+        /* Enable CSB mode, since it was not done by netmap_open(). This
+         * operation also initializes the CSB. */
+        nmreq_hdr_init(&hdr, s->ifname);
+        hdr.nr_reqtype = NETMAP_REQ_CSB_ENABLE;
+        hdr.nr_options = (uintptr_t)&csbopt;
+        hdr.nr_body = (uintptr_t)NULL;
+        ret = ioctl(s->fd, NIOCCTRL, &hdr);
+        if (ret) {
+            warn_report("Unable to execute CSB_ENABLE on %s: %s, "
+                        "falling back to the userspace sync loop",
+                        s->ifname, strerror(errno));
+            ptn->uloop = true;
+        }
     }
 
-    /* Ask netmap to start sync-kloop. */
     ctx = g_malloc(sizeof(*ctx));
     ctx->s = s;
     ctx->num_entries = num_entries;
     ctx->ioeventfds = ioeventfds;
     ctx->irqfds = irqfds;
-    snprintf(tname, sizeof(tname), "ptnetmap-sync-kloop-%s", s->ifname);
-    qemu_thread_create(&ptn->th, tname, ptnetmap_sync_kloop_worker,
-                       ctx, QEMU_THREAD_JOINABLE);
+    ctx->csb_atok = csb_gh;
+    ctx->csb_ktoa = csb_hg;
+
+    if (ptn->uloop) {
+        ret = ptnetmap_uloop_start(ptn, ctx);
+        if (ret) {
+            return ret;
+        }
+    } else {
+        /* Ask netmap to start sync-kloop. */
+        snprintf(tname, sizeof(tname), "ptnetmap-sync-kloop-%s", s->ifname);
+        qemu_thread_create(&ptn->th, tname, ptnetmap_sync_kloop_worker,
+                           ctx, QEMU_THREAD_JOINABLE);
+    }
 
     ptn->worker_started = true;
 
@@ -679,6 +1799,7 @@ int ptnetmap_kloop_start(PTNetmapState *ptn, void *csb_gh, void *csb_hg,
 
 int ptnetmap_kloop_stop(PTNetmapState *ptn)
 {
+    struct SyncKloopThreadCtx *ctx;
     NetmapState *s = ptn->netmap;
     struct nmreq_header hdr;
     int err = 0;
@@ -687,31 +1808,53 @@ int ptnetmap_kloop_stop(PTNetmapState *ptn)
         return 0;
     }
 
-    /* Ask netmap to stop sync-kloop for the rings bound to 's->fd'. */
-    nmreq_hdr_init(&hdr, s->ifname);
-    hdr.nr_reqtype = NETMAP_REQ_SYNC_KLOOP_STOP;
-    err            = ioctl(s->fd, NIOCCTRL, &hdr);
-    if (err) {
-        error_report("Unable to execute SYNC_KLOOP_STOP on %s: %s",
-                     s->ifname, strerror(errno));
-        err = -errno;
+    if (ptn->uloop) {
+        /* Wake up the userspace sync loop and wait for it to exit. */
+        atomic_set(&ptn->uloop_stopping, true);
+        event_notifier_set(&ptn->uloop_stop);
+        qemu_thread_join(&ptn->th);
+        event_notifier_cleanup(&ptn->uloop_stop);
+        ptn->worker_started = false;
+
+        return 0;
+    }
+
+    /* Ask netmap to stop sync-kloop for the rings bound to 's->fd',
+     * unless it failed to start and ptnetmap_kloop_fallback_bh() has not
+     * run yet. */
+    ctx = atomic_mb_read(&ptn->failed_ctx);
+    if (!ctx) {
+        nmreq_hdr_init(&hdr, s->ifname);
+        hdr.nr_reqtype = NETMAP_REQ_SYNC_KLOOP_STOP;
+        err            = ioctl(s->fd, NIOCCTRL, &hdr);
+        if (err) {
+            error_report("Unable to execute SYNC_KLOOP_STOP on %s: %s",
+                         s->ifname, strerror(errno));
+            err = -errno;
+        }
     }
     qemu_thread_join(&ptn->th);
     ptn->worker_started = false;
 
+    /* The kernel loop may also have failed while we were stopping it. */
+    ctx = ptn->failed_ctx;
+    if (ctx) {
+        ptn->failed_ctx = NULL;
+        g_free(ctx->ioeventfds);
+        g_free(ctx->irqfds);
+        g_free(ctx);
+    }
+
     return err;
 }
 
-/* The exported init function
- *
- * ... -net netmap,ifname="..."
- */
-int net_init_netmap(const Netdev *netdev,
-                    const char *name, NetClientState *peer, Error **errp)
+/* Create the net client for one queue of the netmap netdev, bound to the
+ * hardware ring pair 'ringid', or to all of them if 'ringid' is negative. */
+static NetmapState *net_init_netmap_one(const NetdevNetmapOptions *netmap_opts,
+                                        NetClientState *peer, const char *name,
+                                        const char *ifname, int ringid,
+                                        IOThread *iothread, Error **errp)
 {
-    const NetdevNetmapOptions *netmap_opts = &netdev->u.netmap;
-    const char *ifname = netmap_opts->ifname;
-    const char *nmpref = "netmap:";
     NetClientState *nc;
     Error *err = NULL;
     NetmapState *s;
@@ -721,12 +1864,9 @@ int net_init_netmap(const Netdev *netdev,
     s = DO_UPCAST(NetmapState, nc, nc);
     QTAILQ_INSERT_TAIL(&netmap_clients, s, next);
     s->vnet_hdr_len = 0;
-
-    /* Strip the netmap prefix, if present. */
-    if (!strncmp(ifname, nmpref, strlen(nmpref))) {
-        ifname += strlen(nmpref);
-    }
+    s->txsync_bh = qemu_bh_new(netmap_txsync_bh, s);
     pstrcpy(s->ifname, sizeof(s->ifname), ifname);
+    s->ringid = ringid;
 
     s->klooptx = s->klooprx = true; /* default values */
     if (netmap_opts->has_klooptx) {
@@ -735,16 +1875,37 @@ int net_init_netmap(const Netdev *netdev,
     if (netmap_opts->has_klooprx) {
         s->klooprx = netmap_opts->klooprx;
     }
+    s->kloopuser = netmap_opts->has_kloopuser && netmap_opts->kloopuser;
+
+    s->zerocopy = netmap_opts->has_zerocopy && netmap_opts->zerocopy;
+    s->rx_inflight_head = s->rx_inflight_tail = 0;
+    s->tx_zcopy_frames = s->tx_copy_frames = 0;
+
+    s->txbatch = netmap_opts->has_txbatch ? netmap_opts->txbatch : 1;
+    s->txpending = 0;
 
     /* Open a netmap control device and bind it to 's->ifname'. This must
      * be done before all the subsequent ioctl() operations. */
     netmap_open(s, &err);
     if (err) {
         error_propagate(errp, err);
-        return -1;
+        return NULL;
+    }
+
+    if (ringid >= 0) {
+        snprintf(nc->info_str, sizeof(nc->info_str), "ifname=%s,ring=%d",
+                 s->ifname, ringid);
+    } else {
+        snprintf(nc->info_str, sizeof(nc->info_str), "ifname=%s", s->ifname);
     }
 
     if (!netmap_opts->passthrough) {
+        if (iothread) {
+            s->iothread = iothread;
+            object_ref(OBJECT(iothread));
+            netmap_check_iothreads_at_init();
+        }
+
         /* Initially only poll for reads. We poll on write only when
          * the TX rings become full. */
         netmap_read_poll(s, true);
@@ -755,12 +1916,117 @@ int net_init_netmap(const Netdev *netdev,
         s->ptnetmap.features = 0;
         s->ptnetmap.acked_features = 0;
         s->ptnetmap.worker_started = false;
+        s->ptnetmap.fallback_bh = qemu_bh_new(ptnetmap_kloop_fallback_bh,
+                                              &s->ptnetmap);
 
         if (netmap_has_vnet_hdr_len(nc, sizeof(struct virtio_net_hdr_v1))) {
             s->ptnetmap.features |= PTNETMAP_F_VNET_HDR;
         }
     }
 
-    return 0;
+    return s;
 }
 
+/* The exported init function
+ *
+ * ... -net netmap,ifname="..."
+ */
+int net_init_netmap(const Netdev *netdev,
+                    const char *name, NetClientState *peer, Error **errp)
+{
+    const NetdevNetmapOptions *netmap_opts = &netdev->u.netmap;
+    const char *ifname = netmap_opts->ifname;
+    const char *nmpref = "netmap:";
+    IOThread **iothreads = NULL;
+    int num_iothreads = 0;
+    int queues, i;
+    int ret = 0;
+
+    queues = netmap_opts->has_queues ? netmap_opts->queues : 1;
+    if (queues < 1 || queues > MAX_NETMAP_QUEUES) {
+        error_setg(errp, "queues must be between 1 and %d",
+                   MAX_NETMAP_QUEUES);
+        return -1;
+    }
+
+    /* QEMU hubs do not support multiqueue netmap, in this case peer is set.
+     * For -netdev, peer is always NULL. */
+    if (queues > 1 && peer) {
+        error_setg(errp, "Multiqueue netmap cannot be used with hubs");
+        return -1;
+    }
+
+    if (queues > 1 && netmap_opts->passthrough) {
+        error_setg(errp, "queues= is invalid with passthrough=");
+        return -1;
+    }
+
+    if (netmap_opts->has_txbatch && netmap_opts->txbatch == 0) {
+        error_setg(errp, "txbatch must be greater than zero");
+        return -1;
+    }
+
+    if (netmap_opts->has_iothread) {
+        char **ids;
+
+        if (netmap_opts->passthrough) {
+            error_setg(errp, "iothread= is invalid with passthrough=");
+            return -1;
+        }
+        /* Hubs run in the main loop, and so would we. */
+        if (peer) {
+            error_setg(errp, "iothread= cannot be used with hubs");
+            return -1;
+        }
+
+        /* Queues are assigned to the IOThreads in a round-robin way. */
+        ids = g_strsplit(netmap_opts->iothread, ":", MAX_NETMAP_QUEUES);
+        num_iothreads = g_strv_length(ids);
+        iothreads = g_new0(IOThread *, MAX(num_iothreads, 1));
+        for (i = 0; i < num_iothreads; i++) {
+            iothreads[i] = iothread_by_id(ids[i]);
+            if (!iothreads[i]) {
+                error_setg(errp, "Cannot find iothread '%s'", ids[i]);
+                ret = -1;
+                break;
+            }
+        }
+        g_strfreev(ids);
+        if (!ret && !num_iothreads) {
+            error_setg(errp, "iothread= needs at least one IOThread");
+            ret = -1;
+        }
+        if (ret) {
+            g_free(iothreads);
+            return ret;
+        }
+    }
+
+    /* Strip the netmap prefix, if present. */
+    if (!strncmp(ifname, nmpref, strlen(nmpref))) {
+        ifname += strlen(nmpref);
+    }
+
+    if (queues == 1) {
+        if (!net_init_netmap_one(netmap_opts, peer, name, ifname, -1,
+                                 iothreads ? iothreads[0] : NULL, errp)) {
+            ret = -1;
+        }
+        g_free(iothreads);
+        return ret;
+    }
+
+    /* One net client per queue, each one bound to its own hardware
+     * ring pair. */
+    for (i = 0; i < queues; i++) {
+        if (!net_init_netmap_one(netmap_opts, peer, name, ifname, i,
+                                 iothreads ? iothreads[i % num_iothreads]
+                                           : NULL, errp)) {
+            ret = -1;
+            break;
+        }
+    }
+    g_free(iothreads);
+
+    return ret;
+}
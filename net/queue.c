@@ -38,6 +38,10 @@
  *
  * If a sent callback isn't provided, we just drop the packet to avoid
  * unbounded queueing.
+ *
+ * The optional batch delivery handler follows the same rules, with a
+ * short count standing for a zero return on the first packet it did not
+ * consume.  Without one, batches are delivered one packet at a time.
  */
 
 struct NetPacket {
@@ -54,13 +58,16 @@ struct NetQueue {
     uint32_t nq_maxlen;
     uint32_t nq_count;
     NetQueueDeliverFunc *deliver;
+    NetQueueDeliverBatchFunc *deliver_batch;
 
     QTAILQ_HEAD(packets, NetPacket) packets;
 
     unsigned delivering : 1;
 };
 
-NetQueue *qemu_new_net_queue(NetQueueDeliverFunc *deliver, void *opaque)
+NetQueue *qemu_new_net_queue(NetQueueDeliverFunc *deliver,
+                             NetQueueDeliverBatchFunc *deliver_batch,
+                             void *opaque)
 {
     NetQueue *queue;
 
@@ -70,6 +77,7 @@ NetQueue *qemu_new_net_queue(NetQueueDeliverFunc *deliver, void *opaque)
     queue->nq_maxlen = 10000;
     queue->nq_count = 0;
     queue->deliver = deliver;
+    queue->deliver_batch = deliver_batch;
 
     QTAILQ_INIT(&queue->packets);
 
@@ -232,6 +240,57 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
     return ret;
 }
 
+/* Send @count packets.  Returns the number of packets consumed, i.e.
+ * delivered, discarded or queued without a callback.  If a sent callback
+ * is provided and the count is short, pkts[ret] was queued and the
+ * caller must not send any more packets until the callback is invoked.
+ */
+int qemu_net_queue_send_batch(NetQueue *queue,
+                              NetClientState *sender,
+                              unsigned flags,
+                              const NetPacketVec *pkts,
+                              int count,
+                              NetPacketSent *sent_cb)
+{
+    int ret, i;
+
+    if (!queue->deliver_batch) {
+        for (i = 0; i < count; i++) {
+            ret = qemu_net_queue_send_iov(queue, sender, flags, pkts[i].iov,
+                                          pkts[i].iovcnt, sent_cb);
+            if (ret == 0 && sent_cb) {
+                return i;
+            }
+        }
+        return count;
+    }
+
+    if (queue->delivering || !qemu_can_send_packet(sender)) {
+        ret = 0;
+    } else {
+        queue->delivering = 1;
+        ret = queue->deliver_batch(sender, flags, pkts, count, queue->opaque);
+        queue->delivering = 0;
+    }
+
+    if (ret == count) {
+        qemu_net_queue_flush(queue);
+        return count;
+    }
+
+    if (sent_cb) {
+        qemu_net_queue_append_iov(queue, sender, flags, pkts[ret].iov,
+                                  pkts[ret].iovcnt, sent_cb);
+        return ret;
+    }
+
+    for (i = ret; i < count; i++) {
+        qemu_net_queue_append_iov(queue, sender, flags, pkts[i].iov,
+                                  pkts[i].iovcnt, NULL);
+    }
+    return count;
+}
+
 void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
 {
     NetPacket *packet, *next;
@@ -33,6 +33,13 @@
 #include "qemu/sockets.h"
 #include "qemu/iov.h"
 #include "qemu/main-loop.h"
+#include "block/aio.h"
+#include "block/aio-wait.h"
+
+#ifdef CONFIG_SENDMMSG
+/* Datagrams moved by a single recvmmsg() or sendmmsg() */
+#define NET_SOCKET_BATCH 16
+#endif
 
 typedef struct NetSocketState {
     NetClientState nc;
@@ -44,13 +51,54 @@ typedef struct NetSocketState {
     IOHandler *send_fn;           /* differs between SOCK_STREAM/SOCK_DGRAM */
     bool read_poll;               /* waiting to receive data? */
     bool write_poll;              /* waiting to transmit data? */
+    AioContext *ctx;              /* NULL when running in the main loop */
+#ifdef CONFIG_SENDMMSG
+    /* SOCK_DGRAM: datagrams read by the last recvmmsg(); the ones from
+     * rx_head on still have to be handed to the peer.
+     */
+    uint8_t *rx_bufs;
+    struct iovec rx_iov[NET_SOCKET_BATCH];
+    struct mmsghdr rx_msgs[NET_SOCKET_BATCH];
+    NetPacketVec rx_pkts[NET_SOCKET_BATCH];
+    unsigned int rx_head;
+    unsigned int rx_count;
+#endif
+    NetBatchHist rx_hist;         /* only SOCK_DGRAM */
+    NetBatchHist tx_hist;         /* only SOCK_DGRAM */
 } NetSocketState;
 
 static void net_socket_accept(void *opaque);
 static void net_socket_writable(void *opaque);
 
+/* Handlers used when the peer runs us in an IOThread. */
+static void net_socket_aio_send(void *opaque)
+{
+    NetSocketState *s = opaque;
+
+    aio_context_acquire(s->ctx);
+    s->send_fn(s);
+    aio_context_release(s->ctx);
+}
+
+static void net_socket_aio_writable(void *opaque)
+{
+    NetSocketState *s = opaque;
+
+    aio_context_acquire(s->ctx);
+    net_socket_writable(s);
+    aio_context_release(s->ctx);
+}
+
 static void net_socket_update_fd_handler(NetSocketState *s)
 {
+    if (s->ctx) {
+        aio_set_fd_handler(s->ctx, s->fd, false,
+                           s->read_poll ? net_socket_aio_send : NULL,
+                           s->write_poll ? net_socket_aio_writable : NULL,
+                           NULL, s);
+        return;
+    }
+
     qemu_set_fd_handler(s->fd,
                         s->read_poll ? s->send_fn : NULL,
                         s->write_poll ? net_socket_writable : NULL,
@@ -128,13 +176,93 @@ static ssize_t net_socket_receive_dgram(NetClientState *nc, const uint8_t *buf,
         net_socket_write_poll(s, true);
         return 0;
     }
+    if (ret >= 0) {
+        net_batch_hist_add(&s->tx_hist, 1);
+    }
     return ret;
 }
 
+#ifdef CONFIG_SENDMMSG
+static int net_socket_receive_dgram_batch(NetClientState *nc,
+                                          const NetPacketVec *pkts, int count)
+{
+    NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
+    struct mmsghdr msgs[NET_SOCKET_BATCH];
+    int done = 0;
+
+    while (done < count) {
+        int i, n = MIN(count - done, NET_SOCKET_BATCH);
+        int ret;
+
+        for (i = 0; i < n; i++) {
+            msgs[i].msg_hdr = (struct msghdr) {
+                .msg_name = &s->dgram_dst,
+                .msg_namelen = sizeof(s->dgram_dst),
+                .msg_iov = (struct iovec *)pkts[done + i].iov,
+                .msg_iovlen = pkts[done + i].iovcnt,
+            };
+        }
+
+        do {
+            ret = sendmmsg(s->fd, msgs, n, 0);
+        } while (ret == -1 && errno == EINTR);
+
+        if (ret == -1 && errno == EAGAIN) {
+            net_socket_write_poll(s, true);
+            break;
+        }
+        if (ret <= 0) {
+            /* Same as net_socket_receive_dgram(): the datagram is lost */
+            done++;
+            continue;
+        }
+        net_batch_hist_add(&s->tx_hist, ret);
+        done += ret;
+    }
+
+    return done;
+}
+
+static void net_socket_send_completed(NetClientState *nc, ssize_t len);
+
+/* Hand the datagrams left from the last recvmmsg() to the peer.  Returns
+ * false if the peer is full; net_socket_send_completed() resumes then.
+ */
+static bool net_socket_send_pending(NetSocketState *s)
+{
+    int count = s->rx_count - s->rx_head;
+    int sent;
+
+    if (!count) {
+        return true;
+    }
+
+    sent = qemu_sendv_packet_batch_async(&s->nc, &s->rx_pkts[s->rx_head],
+                                         count, net_socket_send_completed);
+    if (sent < count) {
+        /* rx_pkts[rx_head + sent] sits in the peer's queue */
+        s->rx_head += sent + 1;
+        net_socket_read_poll(s, false);
+        return false;
+    }
+    s->rx_head = s->rx_count;
+    return true;
+}
+#endif
+
 static void net_socket_send_completed(NetClientState *nc, ssize_t len)
 {
     NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
 
+#ifdef CONFIG_SENDMMSG
+    if (len == 0) {
+        /* The queue is being purged, drop what is left of the batch too */
+        s->rx_head = s->rx_count;
+    }
+    if (!net_socket_send_pending(s)) {
+        return;
+    }
+#endif
     if (!s->read_poll) {
         net_socket_read_poll(s, true);
     }
@@ -189,6 +317,45 @@ static void net_socket_send(void *opaque)
     }
 }
 
+#ifdef CONFIG_SENDMMSG
+static void net_socket_send_dgram(void *opaque)
+{
+    NetSocketState *s = opaque;
+    int i, count;
+
+    if (!net_socket_send_pending(s)) {
+        return;
+    }
+
+    for (i = 0; i < NET_SOCKET_BATCH; i++) {
+        s->rx_iov[i].iov_len = NET_BUFSIZE;
+    }
+
+    do {
+        count = recvmmsg(s->fd, s->rx_msgs, NET_SOCKET_BATCH, MSG_DONTWAIT,
+                         NULL);
+    } while (count == -1 && errno == EINTR);
+    if (count <= 0) {
+        return;
+    }
+    net_batch_hist_add(&s->rx_hist, count);
+
+    s->rx_head = 0;
+    s->rx_count = 0;
+    for (i = 0; i < count; i++) {
+        /* Empty datagrams carry no frame */
+        if (!s->rx_msgs[i].msg_len) {
+            continue;
+        }
+        s->rx_iov[i].iov_len = s->rx_msgs[i].msg_len;
+        s->rx_pkts[s->rx_count].iov = &s->rx_iov[i];
+        s->rx_pkts[s->rx_count].iovcnt = 1;
+        s->rx_count++;
+    }
+
+    net_socket_send_pending(s);
+}
+#else
 static void net_socket_send_dgram(void *opaque)
 {
     NetSocketState *s = opaque;
@@ -203,11 +370,13 @@ static void net_socket_send_dgram(void *opaque)
         net_socket_write_poll(s, false);
         return;
     }
+    net_batch_hist_add(&s->rx_hist, 1);
     if (qemu_send_packet_async(&s->nc, s->rs.buf, size,
                                net_socket_send_completed) == 0) {
         net_socket_read_poll(s, false);
     }
 }
+#endif
 
 static int net_socket_mcast_create(struct sockaddr_in *mcastaddr,
                                    struct in_addr *localaddr,
@@ -302,9 +471,45 @@ fail:
     return -1;
 }
 
+/* Context: BH in IOThread */
+static void net_socket_detach_aio_context_bh(void *opaque)
+{
+    NetSocketState *s = opaque;
+
+    aio_set_fd_handler(s->ctx, s->fd, false, NULL, NULL, NULL, NULL);
+}
+
+static int net_socket_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
+    /* Connecting and listening are always handled by the main loop. */
+    bool polling = s->fd != -1 && (s->read_poll || s->write_poll);
+
+    if (polling) {
+        if (s->ctx) {
+            aio_wait_bh_oneshot(s->ctx, net_socket_detach_aio_context_bh, s);
+        } else {
+            qemu_set_fd_handler(s->fd, NULL, NULL, NULL);
+        }
+    }
+    s->ctx = ctx;
+    if (polling) {
+        net_socket_update_fd_handler(s);
+    }
+    return 0;
+}
+
 static void net_socket_cleanup(NetClientState *nc)
 {
     NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
+
+    if (s->ctx) {
+        AioContext *ctx = s->ctx;
+
+        aio_context_acquire(ctx);
+        net_socket_set_aio_context(nc, NULL);
+        aio_context_release(ctx);
+    }
     if (s->fd != -1) {
         net_socket_read_poll(s, false);
         net_socket_write_poll(s, false);
@@ -316,13 +521,30 @@ static void net_socket_cleanup(NetClientState *nc)
         closesocket(s->listen_fd);
         s->listen_fd = -1;
     }
+#ifdef CONFIG_SENDMMSG
+    g_free(s->rx_bufs);
+    s->rx_bufs = NULL;
+#endif
+}
+
+static void net_socket_print_info(NetClientState *nc, Monitor *mon)
+{
+    NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
+
+    net_batch_hist_print(mon, "rx", &s->rx_hist);
+    net_batch_hist_print(mon, "tx", &s->tx_hist);
 }
 
 static NetClientInfo net_dgram_socket_info = {
     .type = NET_CLIENT_DRIVER_SOCKET,
     .size = sizeof(NetSocketState),
     .receive = net_socket_receive_dgram,
+#ifdef CONFIG_SENDMMSG
+    .receive_batch = net_socket_receive_dgram_batch,
+#endif
     .cleanup = net_socket_cleanup,
+    .print_info = net_socket_print_info,
+    .set_aio_context = net_socket_set_aio_context,
 };
 
 static NetSocketState *net_socket_fd_init_dgram(NetClientState *peer,
@@ -336,6 +558,9 @@ static NetSocketState *net_socket_fd_init_dgram(NetClientState *peer,
     int newfd;
     NetClientState *nc;
     NetSocketState *s;
+#ifdef CONFIG_SENDMMSG
+    int i;
+#endif
 
     /* fd passed: multicast: "learn" dgram_dst address from bound address and save it
      * Because this may be "shared" socket from a "master" process, datagrams would be recv()
@@ -370,6 +595,16 @@ static NetSocketState *net_socket_fd_init_dgram(NetClientState *peer,
     s->listen_fd = -1;
     s->send_fn = net_socket_send_dgram;
     net_socket_rs_init(&s->rs, net_socket_rs_finalize, false);
+#ifdef CONFIG_SENDMMSG
+    s->rx_bufs = g_malloc(NET_SOCKET_BATCH * NET_BUFSIZE);
+    for (i = 0; i < NET_SOCKET_BATCH; i++) {
+        s->rx_iov[i].iov_base = s->rx_bufs + i * NET_BUFSIZE;
+        s->rx_msgs[i].msg_hdr = (struct msghdr) {
+            .msg_iov = &s->rx_iov[i],
+            .msg_iovlen = 1,
+        };
+    }
+#endif
     net_socket_read_poll(s, true);
 
     /* mcast: save bound address as dst */
@@ -393,6 +628,10 @@ err:
 static void net_socket_connect(void *opaque)
 {
     NetSocketState *s = opaque;
+    if (s->ctx) {
+        /* Drop the main loop handler that waited for the connection. */
+        qemu_set_fd_handler(s->fd, NULL, NULL, NULL);
+    }
     s->send_fn = net_socket_send;
     net_socket_read_poll(s, true);
 }
@@ -402,6 +641,7 @@ static NetClientInfo net_socket_info = {
     .size = sizeof(NetSocketState),
     .receive = net_socket_receive,
     .cleanup = net_socket_cleanup,
+    .set_aio_context = net_socket_set_aio_context,
 };
 
 static NetSocketState *net_socket_fd_init_stream(NetClientState *peer,
@@ -478,12 +718,18 @@ static void net_socket_accept(void *opaque)
         }
     }
 
+    if (s->ctx) {
+        aio_context_acquire(s->ctx);
+    }
     s->fd = fd;
     s->nc.link_down = false;
     net_socket_connect(s);
     snprintf(s->nc.info_str, sizeof(s->nc.info_str),
              "socket: connection from %s:%d",
              inet_ntoa(saddr.sin_addr), ntohs(saddr.sin_port));
+    if (s->ctx) {
+        aio_context_release(s->ctx);
+    }
 }
 
 static int net_socket_listen_init(NetClientState *peer,
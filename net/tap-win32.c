@@ -739,6 +739,11 @@ struct vhost_net *tap_get_vhost_net(NetClientState *nc)
     return NULL;
 }
 
+IOThread *tap_get_worker(NetClientState *nc)
+{
+    return NULL;
+}
+
 static bool tap_has_vnet_hdr_len(NetClientState *nc, int len)
 {
     return false;
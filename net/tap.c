@@ -41,25 +41,44 @@
 #include "qemu/cutils.h"
 #include "qemu/error-report.h"
 #include "qemu/sockets.h"
+#include "block/aio.h"
+#include "block/aio-wait.h"
 
 #include "net/tap.h"
 
 #include "net/vhost_net.h"
 
+/* Defaults for rx-budget and rx-batch */
+#define TAP_RX_BUDGET 50
+#define TAP_RX_BATCH 1
+#define TAP_RX_BATCH_MAX 64
+
 typedef struct TAPState {
     NetClientState nc;
     int fd;
     char down_script[1024];
     char down_script_arg[128];
-    uint8_t buf[NET_BUFSIZE];
+    /* Frames read by tap_send(); the ones from rx_head on still have to
+     * be handed to the peer.
+     */
+    uint8_t *rx_bufs;               /* rx_batch buffers of NET_BUFSIZE */
+    struct iovec *rx_iov;
+    NetPacketVec *rx_pkts;
+    unsigned int rx_head;
+    unsigned int rx_count;
+    unsigned int rx_batch;          /* frames passed to the peer at once */
+    unsigned int rx_budget;         /* frames read per wakeup */
+    NetBatchHist rx_hist;
     bool read_poll;
     bool write_poll;
     bool using_vnet_hdr;
     bool has_ufo;
     bool enabled;
     VHostNetState *vhost_net;
+    IOThread *worker;   /* worker=on without vhost, see tap_get_worker() */
     unsigned host_vnet_hdr_len;
     Notifier exit;
+    AioContext *ctx;    /* NULL when running in the main loop. */
 } TAPState;
 
 static void launch_script(const char *setup_script, const char *ifname,
@@ -68,8 +87,35 @@ static void launch_script(const char *setup_script, const char *ifname,
 static void tap_send(void *opaque);
 static void tap_writable(void *opaque);
 
+/* Handlers used when the peer runs us in an IOThread. */
+static void tap_aio_send(void *opaque)
+{
+    TAPState *s = opaque;
+
+    aio_context_acquire(s->ctx);
+    tap_send(s);
+    aio_context_release(s->ctx);
+}
+
+static void tap_aio_writable(void *opaque)
+{
+    TAPState *s = opaque;
+
+    aio_context_acquire(s->ctx);
+    tap_writable(s);
+    aio_context_release(s->ctx);
+}
+
 static void tap_update_fd_handler(TAPState *s)
 {
+    if (s->ctx) {
+        aio_set_fd_handler(s->ctx, s->fd, false,
+                           s->read_poll && s->enabled ? tap_aio_send : NULL,
+                           s->write_poll && s->enabled ? tap_aio_writable : NULL,
+                           NULL, s);
+        return;
+    }
+
     qemu_set_fd_handler(s->fd,
                         s->read_poll && s->enabled ? tap_send : NULL,
                         s->write_poll && s->enabled ? tap_writable : NULL,
@@ -132,6 +178,24 @@ static ssize_t tap_receive_iov(NetClientState *nc, const struct iovec *iov,
     return tap_write_packet(s, iovp, iovcnt);
 }
 
+/* A tap fd takes exactly one frame per write(), and there is no
+ * sendmmsg() equivalent for it, so the batch still costs one writev()
+ * per frame.  Only the per-frame trip through the NetQueue is saved.
+ */
+static int tap_receive_batch(NetClientState *nc, const NetPacketVec *pkts,
+                             int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        if (tap_receive_iov(nc, pkts[i].iov, pkts[i].iovcnt) == 0) {
+            break;
+        }
+    }
+
+    return i;
+}
+
 static ssize_t tap_receive_raw(NetClientState *nc, const uint8_t *buf, size_t size)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
@@ -174,47 +238,93 @@ ssize_t tap_read_packet(int tapfd, uint8_t *buf, int maxlen)
 }
 #endif
 
+static void tap_send_completed(NetClientState *nc, ssize_t len);
+
+/* Hand the frames read so far to the peer.  Returns false if the peer is
+ * full; tap_send_completed() resumes then.
+ */
+static bool tap_send_pending(TAPState *s)
+{
+    int count = s->rx_count - s->rx_head;
+    int sent;
+
+    if (!count) {
+        return true;
+    }
+
+    sent = qemu_sendv_packet_batch_async(&s->nc, &s->rx_pkts[s->rx_head],
+                                         count, tap_send_completed);
+    if (sent < count) {
+        /* rx_pkts[rx_head + sent] sits in the peer's queue */
+        s->rx_head += sent + 1;
+        tap_read_poll(s, false);
+        return false;
+    }
+    s->rx_head = s->rx_count;
+    return true;
+}
+
 static void tap_send_completed(NetClientState *nc, ssize_t len)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
-    tap_read_poll(s, true);
+
+    if (len == 0) {
+        /* The queue is being purged, drop what is left of the batch too */
+        s->rx_head = s->rx_count;
+    }
+    if (tap_send_pending(s)) {
+        tap_read_poll(s, true);
+    }
 }
 
 static void tap_send(void *opaque)
 {
     TAPState *s = opaque;
-    int size;
-    int packets = 0;
+    unsigned int packets = 0;
+
+    /* Leftovers go first, even if someone else turned read_poll back on */
+    if (!tap_send_pending(s)) {
+        return;
+    }
 
-    while (true) {
-        uint8_t *buf = s->buf;
+    /*
+     * When the host keeps receiving more packets while tap_send() is
+     * running we can hog the QEMU global mutex.  Limit the number of
+     * packets that are processed per tap_send() callback to prevent
+     * stalling the guest.
+     */
+    while (packets < s->rx_budget) {
+        unsigned int max = MIN(s->rx_batch, s->rx_budget - packets);
+        unsigned int count = 0;
+        int size = 0;
 
-        size = tap_read_packet(s->fd, s->buf, sizeof(s->buf));
-        if (size <= 0) {
-            break;
-        }
+        while (count < max) {
+            uint8_t *buf = s->rx_bufs + count * NET_BUFSIZE;
+
+            size = tap_read_packet(s->fd, buf, NET_BUFSIZE);
+            if (size <= 0) {
+                break;
+            }
+
+            if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
+                buf  += s->host_vnet_hdr_len;
+                size -= s->host_vnet_hdr_len;
+            }
 
-        if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
-            buf  += s->host_vnet_hdr_len;
-            size -= s->host_vnet_hdr_len;
+            s->rx_iov[count].iov_base = buf;
+            s->rx_iov[count].iov_len = size;
+            count++;
         }
 
-        size = qemu_send_packet_async(&s->nc, buf, size, tap_send_completed);
-        if (size == 0) {
-            tap_read_poll(s, false);
-            break;
-        } else if (size < 0) {
+        if (!count) {
             break;
         }
+        net_batch_hist_add(&s->rx_hist, count);
+        packets += count;
 
-        /*
-         * When the host keeps receiving more packets while tap_send() is
-         * running we can hog the QEMU global mutex.  Limit the number of
-         * packets that are processed per tap_send() callback to prevent
-         * stalling the guest.
-         */
-        packets++;
-        if (packets >= 50) {
+        s->rx_head = 0;
+        s->rx_count = count;
+        if (!tap_send_pending(s) || size <= 0) {
             break;
         }
     }
@@ -307,10 +417,47 @@ static void tap_exit_notify(Notifier *notifier, void *data)
     }
 }
 
+/* Context: BH in IOThread */
+static void tap_detach_aio_context_bh(void *opaque)
+{
+    TAPState *s = opaque;
+
+    aio_set_fd_handler(s->ctx, s->fd, false, NULL, NULL, NULL, NULL);
+}
+
+static int tap_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+
+    if (s->vhost_net) {
+        return -EBUSY;
+    }
+
+    /* Removing the handlers from within the IOThread guarantees that
+     * none of them is still running once we get here.
+     */
+    if (s->ctx) {
+        aio_wait_bh_oneshot(s->ctx, tap_detach_aio_context_bh, s);
+    } else {
+        qemu_set_fd_handler(s->fd, NULL, NULL, NULL);
+    }
+    s->ctx = ctx;
+    tap_update_fd_handler(s);
+    return 0;
+}
+
 static void tap_cleanup(NetClientState *nc)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
 
+    if (s->ctx) {
+        AioContext *ctx = s->ctx;
+
+        aio_context_acquire(ctx);
+        tap_set_aio_context(nc, NULL);
+        aio_context_release(ctx);
+    }
+
     if (s->vhost_net) {
         vhost_net_cleanup(s->vhost_net);
         g_free(s->vhost_net);
@@ -326,6 +473,26 @@ static void tap_cleanup(NetClientState *nc)
     tap_write_poll(s, false);
     close(s->fd);
     s->fd = -1;
+
+    /* The peer may still hold a reference, the thread goes with the last */
+    if (s->worker) {
+        iothread_destroy(s->worker);
+        s->worker = NULL;
+    }
+
+    g_free(s->rx_bufs);
+    g_free(s->rx_iov);
+    g_free(s->rx_pkts);
+    s->rx_bufs = NULL;
+    s->rx_iov = NULL;
+    s->rx_pkts = NULL;
+}
+
+static void tap_print_info(NetClientState *nc, Monitor *mon)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+
+    net_batch_hist_print(mon, "rx", &s->rx_hist);
 }
 
 static void tap_poll(NetClientState *nc, bool enable)
@@ -350,6 +517,7 @@ static NetClientInfo net_tap_info = {
     .receive = tap_receive,
     .receive_raw = tap_receive_raw,
     .receive_iov = tap_receive_iov,
+    .receive_batch = tap_receive_batch,
     .poll = tap_poll,
     .cleanup = tap_cleanup,
     .has_ufo = tap_has_ufo,
@@ -360,8 +528,31 @@ static NetClientInfo net_tap_info = {
     .set_vnet_hdr_len = tap_set_vnet_hdr_len,
     .set_vnet_le = tap_set_vnet_le,
     .set_vnet_be = tap_set_vnet_be,
+    .print_info = tap_print_info,
+    .set_aio_context = tap_set_aio_context,
 };
 
+static void tap_set_rx_batch(TAPState *s, unsigned int budget,
+                             unsigned int batch)
+{
+    unsigned int i;
+
+    assert(!s->rx_count);
+    s->rx_budget = budget;
+    s->rx_batch = batch;
+
+    g_free(s->rx_bufs);
+    g_free(s->rx_iov);
+    g_free(s->rx_pkts);
+    s->rx_bufs = g_malloc(batch * NET_BUFSIZE);
+    s->rx_iov = g_new(struct iovec, batch);
+    s->rx_pkts = g_new(NetPacketVec, batch);
+    for (i = 0; i < batch; i++) {
+        s->rx_pkts[i].iov = &s->rx_iov[i];
+        s->rx_pkts[i].iovcnt = 1;
+    }
+}
+
 static TAPState *net_tap_fd_init(NetClientState *peer,
                                  const char *model,
                                  const char *name,
@@ -380,6 +571,7 @@ static TAPState *net_tap_fd_init(NetClientState *peer,
     s->using_vnet_hdr = false;
     s->has_ufo = tap_probe_has_ufo(s->fd);
     s->enabled = true;
+    tap_set_rx_batch(s, TAP_RX_BUDGET, TAP_RX_BATCH);
     tap_set_offload(&s->nc, 0, 0, 0, 0, 0);
     /*
      * Make sure host header length is set correctly in tap:
@@ -639,6 +831,84 @@ static int net_tap_init(const NetdevTapOptions *tap, int *vnet_hdr,
 
 #define MAX_TAP_QUEUES 1024
 
+static void net_init_tap_vhost(const NetdevTapOptions *tap, TAPState *s,
+                               const char *vhostfdname, Error **errp)
+{
+    Error *err = NULL;
+    VhostNetOptions options;
+    int vhostfd;
+
+    options.backend_type = VHOST_BACKEND_TYPE_KERNEL;
+    options.net_backend = &s->nc;
+    if (tap->has_poll_us) {
+        options.busyloop_timeout = tap->poll_us;
+    } else {
+        options.busyloop_timeout = 0;
+    }
+
+    if (vhostfdname) {
+        vhostfd = monitor_fd_param(cur_mon, vhostfdname, &err);
+        if (vhostfd == -1) {
+            if (tap->has_vhostforce && tap->vhostforce) {
+                error_propagate(errp, err);
+            } else {
+                warn_report_err(err);
+            }
+            return;
+        }
+        qemu_set_nonblock(vhostfd);
+    } else {
+        vhostfd = open("/dev/vhost-net", O_RDWR);
+        if (vhostfd < 0) {
+            if (tap->has_vhostforce && tap->vhostforce) {
+                error_setg_errno(errp, errno,
+                                 "tap: open vhost char device failed");
+            } else {
+                warn_report("tap: open vhost char device failed: %s",
+                            strerror(errno));
+            }
+            return;
+        }
+        fcntl(vhostfd, F_SETFL, O_NONBLOCK);
+    }
+    options.opaque = (void *)(uintptr_t)vhostfd;
+
+    s->vhost_net = vhost_net_init(&options);
+    if (!s->vhost_net) {
+        if (tap->has_vhostforce && tap->vhostforce) {
+            error_setg(errp, VHOST_NET_INIT_FAILED);
+        } else {
+            warn_report(VHOST_NET_INIT_FAILED);
+        }
+    }
+}
+
+static void net_init_tap_worker(const NetdevTapOptions *tap, TAPState *s,
+                                Error **errp)
+{
+    Error *err = NULL;
+    char *id;
+
+    id = g_strdup_printf("%s-worker-fd%d", s->nc.name, s->fd);
+    s->worker = iothread_create(id, &err);
+    g_free(id);
+    if (err) {
+        error_propagate(errp, err);
+        s->worker = NULL;
+        return;
+    }
+
+    /* poll-us also bounds the adaptive polling of the worker */
+    if (tap->has_poll_us) {
+        object_property_set_int(OBJECT(s->worker),
+                                (int64_t)tap->poll_us * SCALE_US,
+                                "poll-max-ns", &err);
+        if (err) {
+            error_propagate(errp, err);
+        }
+    }
+}
+
 static void net_init_tap_one(const NetdevTapOptions *tap, NetClientState *peer,
                              const char *model, const char *name,
                              const char *ifname, const char *script,
@@ -647,7 +917,6 @@ static void net_init_tap_one(const NetdevTapOptions *tap, NetClientState *peer,
 {
     Error *err = NULL;
     TAPState *s = net_tap_fd_init(peer, model, name, fd, vnet_hdr);
-    int vhostfd;
 
     tap_set_sndbuf(s->fd, tap, &err);
     if (err) {
@@ -655,6 +924,12 @@ static void net_init_tap_one(const NetdevTapOptions *tap, NetClientState *peer,
         return;
     }
 
+    if (tap->has_rx_budget || tap->has_rx_batch) {
+        tap_set_rx_batch(s,
+                         tap->has_rx_budget ? tap->rx_budget : TAP_RX_BUDGET,
+                         tap->has_rx_batch ? tap->rx_batch : TAP_RX_BATCH);
+    }
+
     if (tap->has_fd || tap->has_fds) {
         snprintf(s->nc.info_str, sizeof(s->nc.info_str), "fd=%d", fd);
     } else if (tap->has_helper) {
@@ -674,54 +949,19 @@ static void net_init_tap_one(const NetdevTapOptions *tap, NetClientState *peer,
 
     if (tap->has_vhost ? tap->vhost :
         vhostfdname || (tap->has_vhostforce && tap->vhostforce)) {
-        VhostNetOptions options;
-
-        options.backend_type = VHOST_BACKEND_TYPE_KERNEL;
-        options.net_backend = &s->nc;
-        if (tap->has_poll_us) {
-            options.busyloop_timeout = tap->poll_us;
-        } else {
-            options.busyloop_timeout = 0;
-        }
-
-        if (vhostfdname) {
-            vhostfd = monitor_fd_param(cur_mon, vhostfdname, &err);
-            if (vhostfd == -1) {
-                if (tap->has_vhostforce && tap->vhostforce) {
-                    error_propagate(errp, err);
-                } else {
-                    warn_report_err(err);
-                }
-                return;
-            }
-            qemu_set_nonblock(vhostfd);
-        } else {
-            vhostfd = open("/dev/vhost-net", O_RDWR);
-            if (vhostfd < 0) {
-                if (tap->has_vhostforce && tap->vhostforce) {
-                    error_setg_errno(errp, errno,
-                                     "tap: open vhost char device failed");
-                } else {
-                    warn_report("tap: open vhost char device failed: %s",
-                                strerror(errno));
-                }
-                return;
-            }
-            fcntl(vhostfd, F_SETFL, O_NONBLOCK);
-        }
-        options.opaque = (void *)(uintptr_t)vhostfd;
-
-        s->vhost_net = vhost_net_init(&options);
-        if (!s->vhost_net) {
-            if (tap->has_vhostforce && tap->vhostforce) {
-                error_setg(errp, VHOST_NET_INIT_FAILED);
-            } else {
-                warn_report(VHOST_NET_INIT_FAILED);
-            }
+        net_init_tap_vhost(tap, s, vhostfdname, &err);
+        if (err) {
+            error_propagate(errp, err);
             return;
         }
     } else if (vhostfdname) {
         error_setg(errp, "vhostfd(s)= is not valid without vhost");
+        return;
+    }
+
+    /* Without vhost, the worker stands in for the vhost-net kernel thread */
+    if (tap->has_worker && tap->worker && !s->vhost_net) {
+        net_init_tap_worker(tap, s, errp);
     }
 }
 
@@ -775,6 +1015,17 @@ int net_init_tap(const Netdev *netdev, const char *name,
         return -1;
     }
 
+    if (tap->has_rx_budget && !tap->rx_budget) {
+        error_setg(errp, "rx-budget must be at least 1");
+        return -1;
+    }
+    if (tap->has_rx_batch &&
+        (!tap->rx_batch || tap->rx_batch > TAP_RX_BATCH_MAX)) {
+        error_setg(errp, "rx-batch must be between 1 and %d",
+                   TAP_RX_BATCH_MAX);
+        return -1;
+    }
+
     if (tap->has_fd) {
         if (tap->has_ifname || tap->has_script || tap->has_downscript ||
             tap->has_vnet_hdr || tap->has_helper || tap->has_queues ||
@@ -950,6 +1201,16 @@ VHostNetState *tap_get_vhost_net(NetClientState *nc)
     return s->vhost_net;
 }
 
+/* The thread that should process this queue and its peer's vrings, or
+ * NULL to leave the choice to the peer.
+ */
+IOThread *tap_get_worker(NetClientState *nc)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+    assert(nc->info->type == NET_CLIENT_DRIVER_TAP);
+    return s->worker;
+}
+
 int tap_enable(NetClientState *nc)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
@@ -790,7 +790,7 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "-drive [file=file][,if=type][,bus=n][,unit=m][,media=d][,index=i]\n"
     "       [,cache=writethrough|writeback|none|directsync|unsafe][,format=f]\n"
     "       [,snapshot=on|off][,rerror=ignore|stop|report]\n"
-    "       [,werror=ignore|stop|report|enospc][,id=name][,aio=threads|native]\n"
+    "       [,werror=ignore|stop|report|enospc][,id=name][,aio=threads|native|io_uring]\n"
     "       [,readonly=on|off][,copy-on-read=on|off]\n"
     "       [,discard=ignore|unmap][,detect-zeroes=on|off|unmap]\n"
     "       [[,bps=b]|[[,bps_rd=r][,bps_wr=w]]]\n"
@@ -858,7 +858,9 @@ unsafe       │ on                off            on
 The default mode is @option{cache=writeback}.
 
 @item aio=@var{aio}
-@var{aio} is "threads", or "native" and selects between pthread based disk I/O and native Linux AIO.
+@var{aio} is "threads", "native" or "io_uring" and selects between pthread
+based disk I/O, native Linux AIO and Linux io_uring.  Unlike native AIO,
+io_uring does not require @option{cache.direct=on}.
 @item format=@var{format}
 Specify which disk @var{format} will be used rather than detecting
 the format.  Can be used to specify format=raw to avoid interpreting
@@ -1841,7 +1843,7 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "-netdev tap,id=str[,fd=h][,fds=x:y:...:z][,ifname=name][,script=file][,downscript=dfile]\n"
     "         [,br=bridge][,helper=helper][,sndbuf=nbytes][,vnet_hdr=on|off][,vhost=on|off]\n"
     "         [,vhostfd=h][,vhostfds=x:y:...:z][,vhostforce=on|off][,queues=n]\n"
-    "         [,poll-us=n]\n"
+    "         [,poll-us=n][,rx-budget=n][,rx-batch=n][,worker=on|off]\n"
     "                configure a host TAP network backend with ID 'str'\n"
     "                connected to a bridge (default=" DEFAULT_BRIDGE_INTERFACE ")\n"
     "                use network scripts 'file' (default=" DEFAULT_NETWORK_SCRIPT ")\n"
@@ -1864,6 +1866,10 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "                use 'queues=n' to specify the number of queues to be created for multiqueue TAP\n"
     "                use 'poll-us=n' to speciy the maximum number of microseconds that could be\n"
     "                spent on busy polling for vhost net\n"
+    "                use 'rx-budget=n' to read at most n frames per wakeup (default=50)\n"
+    "                use 'rx-batch=n' to pass up to n frames at once to the peer (default=1)\n"
+    "                use worker=on to run the virtio-net datapath in a dedicated thread\n"
+    "                    when vhost is off or not available\n"
     "-netdev bridge,id=str[,br=bridge][,helper=helper]\n"
     "                configure a host TAP network backend with ID 'str' that is\n"
     "                connected to a bridge (default=" DEFAULT_BRIDGE_INTERFACE ")\n"
@@ -1913,17 +1919,27 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "                ownership and permissions for communication port.\n"
 #endif
 #ifdef CONFIG_NETMAP
-    "-netdev netmap,id=str,ifname=name[,devname=nmname]\n"
+    "-netdev netmap,id=str,ifname=name[,devname=nmname][,txbatch=n][,zerocopy=on|off]\n"
+    "         [,queues=n][,iothread=x:y:...:z]\n"
     "                attach to the existing netmap-enabled network interface 'name', or to a\n"
     "                VALE port (created on the fly) called 'name' ('nmname' is name of the \n"
     "                netmap device, defaults to '/dev/netmap')\n"
+    "                use 'txbatch=n' to publish up to 'n' transmitted frames with a\n"
+    "                single TXSYNC (default: 1)\n"
+    "                use 'zerocopy=on' to swap buffers with netmap ports sharing the\n"
+    "                same memory instead of copying frames\n"
+    "                use 'queues=n' to bind each of 'n' queues to its own pair of hardware\n"
+    "                rings (default: 1)\n"
+    "                use 'iothread=x:y:...:z' to process the queues in the given IOThreads,\n"
+    "                together with the dataplane of their virtio-net peer\n"
 #endif
 #ifdef CONFIG_POSIX
     "-netdev vhost-user,id=str,chardev=dev[,vhostforce=on|off]\n"
     "                configure a vhost-user network, backed by a chardev 'dev'\n"
 #endif
-    "-netdev hubport,id=str,hubid=n[,netdev=nd]\n"
-    "                configure a hub port on the hub with ID 'n'\n", QEMU_ARCH_ALL)
+    "-netdev hubport,id=str,hubid=n[,netdev=nd][,learning=on|off]\n"
+    "                configure a hub port on the hub with ID 'n'\n"
+    "                use learning=on to forward unicast frames like a switch\n", QEMU_ARCH_ALL)
 DEF("nic", HAS_ARG, QEMU_OPTION_nic,
     "-nic [tap|bridge|"
 #ifdef CONFIG_SLIRP
@@ -2379,7 +2395,7 @@ qemu -m 512 -object memory-backend-file,id=mem,size=512M,mem-path=/hugetlbfs,sha
      -device virtio-net-pci,netdev=net0
 @end example
 
-@item -netdev hubport,id=@var{id},hubid=@var{hubid}[,netdev=@var{nd}]
+@item -netdev hubport,id=@var{id},hubid=@var{hubid}[,netdev=@var{nd}][,learning=on|off]
 
 Create a hub port on the emulated hub with ID @var{hubid}.
 
@@ -2387,6 +2403,13 @@ The hubport netdev lets you connect a NIC to a QEMU emulated hub instead of a
 single netdev. Alternatively, you can also connect the hubport to another
 netdev with ID @var{nd} by using the @option{netdev=@var{nd}} option.
 
+By default the hub sends every packet to all of its other ports. With
+@option{learning=on} on the port that creates it, the hub learns the MAC
+addresses behind each port and sends unicast frames to the port of their
+destination only, like a switch. Addresses not seen for 5 minutes are
+forgotten. Later ports of the same hub must omit @option{learning} or give
+the same value.
+
 @item -net nic[,netdev=@var{nd}][,macaddr=@var{mac}][,model=@var{type}] [,name=@var{name}][,addr=@var{addr}][,vectors=@var{v}]
 @findex -net
 Legacy option to configure or create an on-board (or machine default) Network
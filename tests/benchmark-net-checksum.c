@@ -0,0 +1,76 @@
+/*
+ * QEMU Internet checksum speed benchmark
+ *
+ * Copyright (c) 2018 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "net/checksum.h"
+
+/* Checksum a ring worth of 2KB buffers, to get realistic cache
+ * behaviour.  */
+#define CSUM_BUF_SIZE   2048
+#define CSUM_NUM_BUFS   512
+
+static void run_checksum_speed(size_t len)
+{
+    uint8_t *bufs;
+    uint64_t frames = 0;
+    uint32_t sum = 0;
+    double total = 0.0;
+    size_t i = 0;
+
+    bufs = g_malloc(CSUM_BUF_SIZE * CSUM_NUM_BUFS);
+    for (i = 0; i < CSUM_BUF_SIZE * CSUM_NUM_BUFS; i++) {
+        bufs[i] = g_test_rand_int();
+    }
+
+    i = 0;
+    g_test_timer_start();
+    do {
+        uint8_t *buf = bufs + (i % CSUM_NUM_BUFS) * CSUM_BUF_SIZE;
+
+        sum += net_checksum_add(len, buf);
+        total += len;
+        frames++;
+        i++;
+    } while ((i & 0xffff) || g_test_timer_elapsed() < 2.0);
+
+    total /= GiB;
+    g_print("done: %.3f GB (%" PRIu64 " frames, sum %04x) in %.2f secs: ",
+            total, frames, net_checksum_finish(sum), g_test_timer_last());
+    g_print("%.2f GB/sec, %.2f Mfps\n", total / g_test_timer_last(),
+            frames / g_test_timer_last() / 1e6);
+
+    g_free(bufs);
+}
+
+static void test_checksum_speed(void)
+{
+    static const size_t frame_sizes[] = {
+        20, 60, 128, 256, 512, 1024, 1514, 2048,
+    };
+    int variant = 0;
+    size_t i;
+
+    /* From the best implementation for this host down to the plain C one */
+    do {
+        g_print("Testing variant %d\n", variant++);
+        for (i = 0; i < ARRAY_SIZE(frame_sizes); i++) {
+            g_print("  %4zu bytes: ", frame_sizes[i]);
+            run_checksum_speed(frame_sizes[i]);
+        }
+    } while (test_net_checksum_next_accel());
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/net/checksum/speed", test_checksum_speed);
+
+    return g_test_run();
+}
@@ -0,0 +1,101 @@
+/*
+ * QEMU pkt_copy speed benchmark
+ *
+ * Copyright (c) 2018 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "qemu/cutils.h"
+
+/* Netmap slot buffers are 2KB, so a ring worth of them is used as the
+ * destination, to get realistic cache behaviour.  */
+#define NM_BUF_SIZE     2048
+#define NM_NUM_BUFS     512
+
+/* Frame sizes of a simple IMIX distribution (7:4:1), followed by a
+ * sweep of the usual Ethernet frame sizes. */
+static const size_t imix_sizes[] = {
+    60, 60, 60, 576, 60, 576, 60, 60, 576, 1514, 60, 576,
+};
+
+typedef void (*CopyFunc)(void *dst, const void *src, size_t len);
+
+static void memcpy_func(void *dst, const void *src, size_t len)
+{
+    memcpy(dst, src, len);
+}
+
+static void run_copy_speed(const char *name, CopyFunc fn,
+                           const size_t *sizes, size_t num_sizes)
+{
+    uint8_t *src, *dst;
+    uint64_t frames = 0;
+    double total = 0.0;
+    size_t i = 0;
+
+    src = g_malloc(NM_BUF_SIZE);
+    dst = g_malloc(NM_BUF_SIZE * NM_NUM_BUFS);
+    memset(src, g_test_rand_int(), NM_BUF_SIZE);
+    memset(dst, 0, NM_BUF_SIZE * NM_NUM_BUFS);
+
+    g_test_timer_start();
+    do {
+        size_t len = sizes[i % num_sizes];
+
+        fn(dst + (i % NM_NUM_BUFS) * NM_BUF_SIZE, src, len);
+        total += len;
+        frames++;
+        i++;
+    } while ((i & 0xffff) || g_test_timer_elapsed() < 2.0);
+
+    total /= MiB;
+    g_print("%s: ", name);
+    g_print("done: %.2f MB (%" PRIu64 " frames) in %.2f secs: ",
+            total, frames, g_test_timer_last());
+    g_print("%.2f MB/sec, %.2f Mfps\n", total / g_test_timer_last(),
+            frames / g_test_timer_last() / 1e6);
+
+    g_free(dst);
+    g_free(src);
+}
+
+static void test_copy_speed(const void *opaque)
+{
+    size_t frame_size = (size_t)opaque;
+    const size_t *sizes = frame_size ? &frame_size : imix_sizes;
+    size_t num_sizes = frame_size ? 1 : ARRAY_SIZE(imix_sizes);
+
+    if (frame_size) {
+        g_print("Testing frame size %zu bytes\n", frame_size);
+    } else {
+        g_print("Testing IMIX frame sizes\n");
+    }
+
+    run_copy_speed("memcpy", memcpy_func, sizes, num_sizes);
+    run_copy_speed("pkt_copy", pkt_copy, sizes, num_sizes);
+}
+
+int main(int argc, char **argv)
+{
+    static const size_t frame_sizes[] = {
+        60, 128, 256, 512, 1024, 1514, 2048,
+    };
+    char name[64];
+    size_t i;
+
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_data_func("/cutils/pktcopy/speed-imix", (void *)0,
+                         test_copy_speed);
+    for (i = 0; i < ARRAY_SIZE(frame_sizes); i++) {
+        snprintf(name, sizeof(name), "/cutils/pktcopy/speed-%zu",
+                 frame_sizes[i]);
+        g_test_add_data_func(name, (void *)frame_sizes[i], test_copy_speed);
+    }
+
+    return g_test_run();
+}
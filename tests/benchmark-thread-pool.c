@@ -0,0 +1,106 @@
+/*
+ * QEMU thread pool latency benchmark
+ *
+ * Copyright (c) 2018 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "block/aio.h"
+#include "block/thread-pool.h"
+#include "qapi/error.h"
+#include "qemu/timer.h"
+#include "qemu/main-loop.h"
+
+typedef struct {
+    int64_t submitted;
+} BenchRequest;
+
+static AioContext *ctx;
+static ThreadPool *pool;
+static int64_t deadline;
+static int64_t total_latency;
+static uint64_t completed;
+static int active;
+
+static int bench_worker_cb(void *opaque)
+{
+    return 0;
+}
+
+static void bench_submit(BenchRequest *req);
+
+static void bench_done_cb(void *opaque, int ret)
+{
+    BenchRequest *req = opaque;
+    int64_t now = get_clock();
+
+    total_latency += now - req->submitted;
+    completed++;
+
+    /* Keep the queue depth constant until the deadline */
+    if (now < deadline) {
+        bench_submit(req);
+    } else {
+        active--;
+    }
+}
+
+static void bench_submit(BenchRequest *req)
+{
+    req->submitted = get_clock();
+    thread_pool_submit_aio(pool, bench_worker_cb, req, bench_done_cb, req);
+}
+
+static void test_thread_pool_latency(const void *opaque)
+{
+    int depth = GPOINTER_TO_INT(opaque);
+    BenchRequest *reqs = g_new0(BenchRequest, depth);
+    int i;
+
+    total_latency = 0;
+    completed = 0;
+    active = depth;
+
+    g_test_timer_start();
+    deadline = get_clock() + 2 * NANOSECONDS_PER_SECOND;
+    for (i = 0; i < depth; i++) {
+        bench_submit(&reqs[i]);
+    }
+    while (active > 0) {
+        aio_poll(ctx, true);
+    }
+    g_test_timer_elapsed();
+
+    g_print("depth %3d: %" PRIu64 " requests in %.2f secs: ",
+            depth, completed, g_test_timer_last());
+    g_print("%.2f us submit-to-completion, %.2f Kreq/sec\n",
+            (double)total_latency / completed / 1000,
+            completed / g_test_timer_last() / 1000);
+
+    g_free(reqs);
+}
+
+int main(int argc, char **argv)
+{
+    static const int depths[] = { 1, 4, 16, 64, 256 };
+    size_t i;
+
+    qemu_init_main_loop(&error_abort);
+    ctx = qemu_get_current_aio_context();
+    pool = aio_get_thread_pool(ctx);
+
+    g_test_init(&argc, &argv, NULL);
+    for (i = 0; i < ARRAY_SIZE(depths); i++) {
+        char *name = g_strdup_printf("/thread-pool/latency/depth-%d",
+                                     depths[i]);
+        g_test_add_data_func(name, GINT_TO_POINTER(depths[i]),
+                             test_thread_pool_latency);
+        g_free(name);
+    }
+
+    return g_test_run();
+}
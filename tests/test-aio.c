@@ -456,6 +456,17 @@ static void test_wait_event_notifier_noflush(void)
     event_notifier_cleanup(&data.e);
 }
 
+static void test_notify_unaccepted(void)
+{
+    /* aio_notify() sets the EventNotifier before ctx->notified.  If the
+     * event loop runs in between, aio_notify_accept() leaves the
+     * EventNotifier set, so dispatching it must clear it.
+     */
+    event_notifier_set(&ctx->notifier);
+    g_assert(!aio_poll(ctx, true));
+    g_assert(!event_notifier_test_and_clear(&ctx->notifier));
+}
+
 static void test_timer_schedule(void)
 {
     TimerTestData data = { .n = 0, .ctx = ctx, .ns = SCALE_MS * 750LL,
@@ -899,6 +910,7 @@ int main(int argc, char **argv)
     g_test_add_func("/aio/event/wait/no-flush-cb",  test_wait_event_notifier_noflush);
     g_test_add_func("/aio/event/flush",             test_flush_event_notifier);
     g_test_add_func("/aio/external-client",         test_aio_external_client);
+    g_test_add_func("/aio/notify/unaccepted",       test_notify_unaccepted);
     g_test_add_func("/aio/timer/schedule",          test_timer_schedule);
 
     g_test_add_func("/aio/coroutine/queue-chaining", test_queue_chaining);
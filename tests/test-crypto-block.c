@@ -24,6 +24,7 @@
 #include "crypto/block.h"
 #include "qemu/buffer.h"
 #include "crypto/secret.h"
+#include "qemu/thread.h"
 #ifndef _WIN32
 #include <sys/resource.h>
 #endif
@@ -305,6 +306,7 @@ static void test_block(gconstpointer opaque)
                              test_block_read_func,
                              &header,
                              0,
+                             1,
                              NULL);
     g_assert(blk == NULL);
 
@@ -313,6 +315,7 @@ static void test_block(gconstpointer opaque)
                              test_block_read_func,
                              &header,
                              QCRYPTO_BLOCK_OPEN_NO_IO,
+                             1,
                              &error_abort);
 
     g_assert(qcrypto_block_get_cipher(blk) == NULL);
@@ -327,6 +330,7 @@ static void test_block(gconstpointer opaque)
                              test_block_read_func,
                              &header,
                              0,
+                             1,
                              &error_abort);
     g_assert(blk);
 
@@ -340,6 +344,103 @@ static void test_block(gconstpointer opaque)
 }
 
 
+#define PARALLEL_THREADS 4
+#define PARALLEL_SECTORS 64
+#define PARALLEL_ROUNDS 50
+
+typedef struct {
+    QCryptoBlock *blk;
+    const uint8_t *plain;
+    const uint8_t *cipher;
+    unsigned int first;
+} ParallelTestData;
+
+static void *test_block_parallel_thread(void *opaque)
+{
+    ParallelTestData *data = opaque;
+    uint8_t buf[512];
+    unsigned int i, n;
+
+    for (n = 0; n < PARALLEL_ROUNDS; n++) {
+        for (i = data->first; i < PARALLEL_SECTORS; i += PARALLEL_THREADS) {
+            memcpy(buf, data->plain + i * 512, 512);
+            g_assert(qcrypto_block_encrypt(data->blk, i * 512, buf, 512,
+                                           &error_abort) == 0);
+            g_assert(memcmp(buf, data->cipher + i * 512, 512) == 0);
+            g_assert(qcrypto_block_decrypt(data->blk, i * 512, buf, 512,
+                                           &error_abort) == 0);
+            g_assert(memcmp(buf, data->plain + i * 512, 512) == 0);
+        }
+    }
+
+    return NULL;
+}
+
+/* Encrypt and decrypt from several threads with one QCryptoBlock, and
+ * compare with what a single-threaded QCryptoBlock produces. */
+static void test_block_parallel(void)
+{
+    ParallelTestData data[PARALLEL_THREADS];
+    QemuThread threads[PARALLEL_THREADS];
+    size_t len = PARALLEL_SECTORS * 512;
+    uint8_t *plain = g_malloc(len);
+    uint8_t *cipher = g_malloc(len);
+    QCryptoBlock *blk;
+    Buffer header;
+    Object *sec = test_block_secret();
+    unsigned int i;
+
+    memset(&header, 0, sizeof(header));
+    buffer_init(&header, "header");
+
+    blk = qcrypto_block_create(&qcow_create_opts, NULL,
+                               test_block_init_func,
+                               test_block_write_func,
+                               &header,
+                               &error_abort);
+    qcrypto_block_free(blk);
+
+    for (i = 0; i < len; i++) {
+        plain[i] = i * 7 + i / 512;
+    }
+    memcpy(cipher, plain, len);
+
+    blk = qcrypto_block_open(&qcow_open_opts, NULL,
+                             test_block_read_func,
+                             &header,
+                             0,
+                             1,
+                             &error_abort);
+    g_assert(qcrypto_block_encrypt(blk, 0, cipher, len, &error_abort) == 0);
+    qcrypto_block_free(blk);
+
+    blk = qcrypto_block_open(&qcow_open_opts, NULL,
+                             test_block_read_func,
+                             &header,
+                             0,
+                             PARALLEL_THREADS,
+                             &error_abort);
+    for (i = 0; i < PARALLEL_THREADS; i++) {
+        data[i].blk = blk;
+        data[i].plain = plain;
+        data[i].cipher = cipher;
+        data[i].first = i;
+        qemu_thread_create(&threads[i], "crypto-test",
+                           test_block_parallel_thread, &data[i],
+                           QEMU_THREAD_JOINABLE);
+    }
+    for (i = 0; i < PARALLEL_THREADS; i++) {
+        qemu_thread_join(&threads[i]);
+    }
+    qcrypto_block_free(blk);
+
+    object_unparent(sec);
+    buffer_free(&header);
+    g_free(plain);
+    g_free(cipher);
+}
+
+
 int main(int argc, char **argv)
 {
     gsize i;
@@ -360,5 +461,7 @@ int main(int argc, char **argv)
         }
     }
 
+    g_test_add_func("/crypto/block/qcow/parallel", test_block_parallel);
+
     return g_test_run();
 }
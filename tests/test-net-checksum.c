@@ -0,0 +1,125 @@
+/*
+ * QEMU Internet checksum test
+ *
+ * Copyright (c) 2018 QEMU contributors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "net/checksum.h"
+
+#define BUF_SIZE    4096
+
+static uint8_t buf[BUF_SIZE];
+
+/* The byte at a time sum, as net_checksum_add_cont() used to compute it */
+static uint32_t ref_checksum_add_cont(int len, const uint8_t *p, int seq)
+{
+    uint32_t sum1 = 0, sum2 = 0;
+    int i;
+
+    for (i = 0; i < len - 1; i += 2) {
+        sum1 += p[i];
+        sum2 += p[i + 1];
+    }
+    if (i < len) {
+        sum1 += p[i];
+    }
+
+    return seq & 1 ? sum1 + (sum2 << 8) : sum2 + (sum1 << 8);
+}
+
+static void fill(int pattern)
+{
+    size_t i;
+
+    for (i = 0; i < BUF_SIZE; i++) {
+        buf[i] = pattern < 0 ? g_test_rand_int() : pattern;
+    }
+}
+
+static void test_1(void)
+{
+    static const int patterns[] = { -1, 0x00, 0xff };
+    int p, len, off, seq;
+
+    /* Only the folded value is defined, so compare what the callers see */
+    for (p = 0; p < ARRAY_SIZE(patterns); p++) {
+        fill(patterns[p]);
+        for (off = 0; off < 64; off += 3) {
+            for (len = 0; len <= 2048; len++) {
+                for (seq = 0; seq < 2; seq++) {
+                    uint32_t ref = ref_checksum_add_cont(len, buf + off, seq);
+                    uint32_t sum = net_checksum_add_cont(len, buf + off, seq);
+
+                    g_assert_cmphex(net_checksum_finish(sum), ==,
+                                    net_checksum_finish(ref));
+                    g_assert_cmphex(net_checksum_finish(sum + 0x1234), ==,
+                                    net_checksum_finish(ref + 0x1234));
+                }
+            }
+        }
+    }
+}
+
+static void test_iov(void)
+{
+    struct iovec iov[4];
+    size_t cut1, cut2;
+    uint16_t ref;
+
+    fill(-1);
+    ref = net_checksum_finish(ref_checksum_add_cont(1514 - 13, buf + 13, 0));
+
+    /* Split the frame at every pair of odd and even offsets */
+    for (cut1 = 0; cut1 <= 64; cut1++) {
+        for (cut2 = cut1; cut2 <= cut1 + 65; cut2 += 5) {
+            iov[0].iov_base = buf;
+            iov[0].iov_len = cut1;
+            iov[1].iov_base = buf + cut1;
+            iov[1].iov_len = cut2 - cut1;
+            iov[2].iov_base = buf + cut2;
+            iov[2].iov_len = 1000 - cut2;
+            iov[3].iov_base = buf + 1000;
+            iov[3].iov_len = 514;
+
+            g_assert_cmphex(net_checksum_finish(
+                                net_checksum_add_iov(iov, 4, 13, 1514 - 13, 0)),
+                            ==, ref);
+        }
+    }
+}
+
+static void test_2(void)
+{
+    if (g_test_perf()) {
+        test_1();
+        test_iov();
+    } else {
+        do {
+            test_1();
+            test_iov();
+        } while (test_net_checksum_next_accel());
+    }
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/net/checksum", test_2);
+
+    return g_test_run();
+}
@@ -0,0 +1,72 @@
+/*
+ * QEMU pkt_copy test
+ *
+ * Copyright (c) 2018 QEMU contributors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/cutils.h"
+
+#define BUF_SIZE    4096
+
+static uint8_t src[BUF_SIZE];
+static uint8_t dst[BUF_SIZE];
+
+static void test_1(void)
+{
+    size_t s, a, i;
+
+    for (i = 0; i < BUF_SIZE; i++) {
+        src[i] = g_test_rand_int();
+    }
+
+    /* Check every size up to a 2KB netmap buffer, with both aligned and
+     * unaligned pointers, and make sure that nothing past the end of the
+     * destination is touched.  */
+    for (a = 0; a < 64; a += 7) {
+        for (s = 0; s <= 2048; s++) {
+            memset(dst, 0xa5, sizeof(dst));
+            pkt_copy(dst + a, src + 64 - a, s);
+            g_assert(memcmp(dst + a, src + 64 - a, s) == 0);
+            for (i = 0; i < a; i++) {
+                g_assert_cmpint(dst[i], ==, 0xa5);
+            }
+            for (i = a + s; i < BUF_SIZE; i++) {
+                g_assert_cmpint(dst[i], ==, 0xa5);
+            }
+        }
+    }
+}
+
+static void test_2(void)
+{
+    if (g_test_perf()) {
+        test_1();
+    } else {
+        do {
+            test_1();
+        } while (test_pkt_copy_next_accel());
+    }
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/cutils/pktcopy", test_2);
+
+    return g_test_run();
+}
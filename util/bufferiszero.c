@@ -24,6 +24,7 @@
 #include "qemu/osdep.h"
 #include "qemu-common.h"
 #include "qemu/cutils.h"
+#include "qemu/cpuinfo.h"
 #include "qemu/bswap.h"
 
 static bool
@@ -188,13 +189,6 @@ buffer_zero_avx2(const void *buf, size_t len)
 #pragma GCC pop_options
 #endif /* CONFIG_AVX2_OPT */
 
-/* Note that for test_buffer_is_zero_next_accel, the most preferred
- * ISA must have the least significant bit.
- */
-#define CACHE_AVX2    1
-#define CACHE_SSE4    2
-#define CACHE_SSE2    4
-
 /* Make sure that these variables are appropriately initialized when
  * SSE2 is enabled on the compiler command-line, but the compiler is
  * too old to support CONFIG_AVX2_OPT.
@@ -206,7 +200,7 @@ buffer_zero_avx2(const void *buf, size_t len)
 # ifndef __SSE2__
 #  error "ISA selection confusion"
 # endif
-# define INIT_CACHE CACHE_SSE2
+# define INIT_CACHE CPUINFO_SSE2
 # define INIT_ACCEL buffer_zero_sse2
 #endif
 
@@ -216,14 +210,14 @@ static bool (*buffer_accel)(const void *, size_t) = INIT_ACCEL;
 static void init_accel(unsigned cache)
 {
     bool (*fn)(const void *, size_t) = buffer_zero_int;
-    if (cache & CACHE_SSE2) {
+    if (cache & CPUINFO_SSE2) {
         fn = buffer_zero_sse2;
     }
 #ifdef CONFIG_AVX2_OPT
-    if (cache & CACHE_SSE4) {
+    if (cache & CPUINFO_SSE4) {
         fn = buffer_zero_sse4;
     }
-    if (cache & CACHE_AVX2) {
+    if (cache & CPUINFO_AVX2) {
         fn = buffer_zero_avx2;
     }
 #endif
@@ -231,35 +225,10 @@ static void init_accel(unsigned cache)
 }
 
 #ifdef CONFIG_AVX2_OPT
-#include "qemu/cpuid.h"
-
 static void __attribute__((constructor)) init_cpuid_cache(void)
 {
-    int max = __get_cpuid_max(0, NULL);
-    int a, b, c, d;
-    unsigned cache = 0;
-
-    if (max >= 1) {
-        __cpuid(1, a, b, c, d);
-        if (d & bit_SSE2) {
-            cache |= CACHE_SSE2;
-        }
-        if (c & bit_SSE4_1) {
-            cache |= CACHE_SSE4;
-        }
-
-        /* We must check that AVX is not just available, but usable.  */
-        if ((c & bit_OSXSAVE) && (c & bit_AVX) && max >= 7) {
-            int bv;
-            __asm("xgetbv" : "=a"(bv), "=d"(d) : "c"(0));
-            __cpuid_count(7, 0, a, b, c, d);
-            if ((bv & 6) == 6 && (b & bit_AVX2)) {
-                cache |= CACHE_AVX2;
-            }
-        }
-    }
-    cpuid_cache = cache;
-    init_accel(cache);
+    cpuid_cache = cpuinfo_get() & (CPUINFO_SSE2 | CPUINFO_SSE4 | CPUINFO_AVX2);
+    init_accel(cpuid_cache);
 }
 #endif /* CONFIG_AVX2_OPT */
 
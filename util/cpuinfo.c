@@ -0,0 +1,52 @@
+/*
+ * cpuinfo.c - detect the ISA extensions of an x86 host
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/cpuinfo.h"
+#include "qemu/cpuid.h"
+
+unsigned cpuinfo_get(void)
+{
+    /* Computed once; constructors run before any other thread exists.  */
+    static unsigned cpuinfo;
+    static bool cpuinfo_valid;
+    int max, a, b, c, d;
+    unsigned info = 0;
+
+    if (cpuinfo_valid) {
+        return cpuinfo;
+    }
+
+    max = __get_cpuid_max(0, NULL);
+    if (max >= 1) {
+        __cpuid(1, a, b, c, d);
+        if (d & bit_SSE2) {
+            info |= CPUINFO_SSE2;
+        }
+        if (c & bit_SSE4_1) {
+            info |= CPUINFO_SSE4;
+        }
+
+        /* We must check that AVX is not just available, but usable.  */
+        if ((c & bit_OSXSAVE) && (c & bit_AVX) && max >= 7) {
+            int bv;
+            __asm("xgetbv" : "=a"(bv), "=d"(d) : "c"(0));
+            __cpuid_count(7, 0, a, b, c, d);
+            if ((bv & 6) == 6 && (b & bit_AVX2)) {
+                info |= CPUINFO_AVX2;
+            }
+            /* The OS must also save the opmask and ZMM registers.  */
+            if ((bv & 0xe6) == 0xe6 && (b & bit_AVX512F)) {
+                info |= CPUINFO_AVX512F;
+            }
+        }
+    }
+
+    cpuinfo = info;
+    cpuinfo_valid = true;
+    return info;
+}
@@ -0,0 +1,270 @@
+/*
+ * Packet buffer copy routines
+ *
+ * Copyright (c) 2018 QEMU contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qemu/cutils.h"
+#include "qemu/cpuinfo.h"
+
+/* Packets are short (a few cache lines at most), so all the variants
+ * below avoid any setup cost: the body is copied in blocks with
+ * unaligned loads and stores, and the tail is handled by copying the
+ * last block again, overlapping with the previous one. Source and
+ * destination must not overlap.
+ */
+
+static void
+pkt_copy_int(void *dst, const void *src, size_t len)
+{
+    memcpy(dst, src, len);
+}
+
+#if defined(CONFIG_AVX2_OPT) || defined(__SSE2__)
+/* Do not use push_options pragmas unnecessarily, because clang
+ * does not support them.
+ */
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("sse2")
+#endif
+#include <emmintrin.h>
+
+/* Note that each of these vectorized functions require len >= 64.  */
+
+static void
+pkt_copy_sse2(void *dst, const void *src, size_t len)
+{
+    __m128i a, b, c, d;
+    size_t i;
+
+    /* Copy blocks of 64 bytes.  */
+    for (i = 0; i + 64 <= len; i += 64) {
+        a = _mm_loadu_si128(src + i);
+        b = _mm_loadu_si128(src + i + 16);
+        c = _mm_loadu_si128(src + i + 32);
+        d = _mm_loadu_si128(src + i + 48);
+        _mm_storeu_si128(dst + i, a);
+        _mm_storeu_si128(dst + i + 16, b);
+        _mm_storeu_si128(dst + i + 32, c);
+        _mm_storeu_si128(dst + i + 48, d);
+    }
+
+    /* Finish with the last 64 bytes, unaligned.  */
+    if (i < len) {
+        a = _mm_loadu_si128(src + len - 64);
+        b = _mm_loadu_si128(src + len - 48);
+        c = _mm_loadu_si128(src + len - 32);
+        d = _mm_loadu_si128(src + len - 16);
+        _mm_storeu_si128(dst + len - 64, a);
+        _mm_storeu_si128(dst + len - 48, b);
+        _mm_storeu_si128(dst + len - 32, c);
+        _mm_storeu_si128(dst + len - 16, d);
+    }
+}
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC pop_options
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+/* Note that due to restrictions/bugs wrt __builtin functions in gcc <= 4.8,
+ * the includes have to be within the corresponding push_options region, and
+ * therefore the regions themselves have to be ordered with increasing ISA.
+ */
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static void
+pkt_copy_avx2(void *dst, const void *src, size_t len)
+{
+    __m256i a, b, c, d;
+    size_t i;
+
+    if (len <= 128) {
+        /* Minimum sized frames: two 32-byte blocks at each end.  */
+        a = _mm256_loadu_si256(src);
+        b = _mm256_loadu_si256(src + 32);
+        c = _mm256_loadu_si256(src + len - 64);
+        d = _mm256_loadu_si256(src + len - 32);
+        _mm256_storeu_si256(dst, a);
+        _mm256_storeu_si256(dst + 32, b);
+        _mm256_storeu_si256(dst + len - 64, c);
+        _mm256_storeu_si256(dst + len - 32, d);
+        return;
+    }
+
+    /* Copy blocks of 128 bytes.  */
+    for (i = 0; i + 128 <= len; i += 128) {
+        a = _mm256_loadu_si256(src + i);
+        b = _mm256_loadu_si256(src + i + 32);
+        c = _mm256_loadu_si256(src + i + 64);
+        d = _mm256_loadu_si256(src + i + 96);
+        _mm256_storeu_si256(dst + i, a);
+        _mm256_storeu_si256(dst + i + 32, b);
+        _mm256_storeu_si256(dst + i + 64, c);
+        _mm256_storeu_si256(dst + i + 96, d);
+    }
+
+    /* Finish with the last 128 bytes, unaligned.  */
+    if (i < len) {
+        a = _mm256_loadu_si256(src + len - 128);
+        b = _mm256_loadu_si256(src + len - 96);
+        c = _mm256_loadu_si256(src + len - 64);
+        d = _mm256_loadu_si256(src + len - 32);
+        _mm256_storeu_si256(dst + len - 128, a);
+        _mm256_storeu_si256(dst + len - 96, b);
+        _mm256_storeu_si256(dst + len - 64, c);
+        _mm256_storeu_si256(dst + len - 32, d);
+    }
+}
+#pragma GCC pop_options
+
+#ifdef CONFIG_AVX512F_OPT
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+#include <immintrin.h>
+
+static void
+pkt_copy_avx512f(void *dst, const void *src, size_t len)
+{
+    __m512i a, b, c, d;
+    size_t i;
+
+    if (len <= 128) {
+        /* Minimum sized frames: one 64-byte block at each end.  */
+        a = _mm512_loadu_si512(src);
+        b = _mm512_loadu_si512(src + len - 64);
+        _mm512_storeu_si512(dst, a);
+        _mm512_storeu_si512(dst + len - 64, b);
+        return;
+    }
+
+    /* Copy blocks of 256 bytes.  */
+    for (i = 0; i + 256 <= len; i += 256) {
+        a = _mm512_loadu_si512(src + i);
+        b = _mm512_loadu_si512(src + i + 64);
+        c = _mm512_loadu_si512(src + i + 128);
+        d = _mm512_loadu_si512(src + i + 192);
+        _mm512_storeu_si512(dst + i, a);
+        _mm512_storeu_si512(dst + i + 64, b);
+        _mm512_storeu_si512(dst + i + 128, c);
+        _mm512_storeu_si512(dst + i + 192, d);
+    }
+
+    /* Finish with the remaining 64-byte blocks and the unaligned tail.  */
+    for (; i + 64 <= len; i += 64) {
+        a = _mm512_loadu_si512(src + i);
+        _mm512_storeu_si512(dst + i, a);
+    }
+    if (i < len) {
+        a = _mm512_loadu_si512(src + len - 64);
+        _mm512_storeu_si512(dst + len - 64, a);
+    }
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX512F_OPT */
+#endif /* CONFIG_AVX2_OPT */
+
+/* Make sure that these variables are appropriately initialized when
+ * SSE2 is enabled on the compiler command-line, but the compiler is
+ * too old to support CONFIG_AVX2_OPT.
+ */
+#ifdef CONFIG_AVX2_OPT
+# define INIT_CACHE 0
+# define INIT_ACCEL pkt_copy_int
+#else
+# ifndef __SSE2__
+#  error "ISA selection confusion"
+# endif
+# define INIT_CACHE CPUINFO_SSE2
+# define INIT_ACCEL pkt_copy_sse2
+#endif
+
+static unsigned cpuid_cache = INIT_CACHE;
+static void (*pkt_copy_accel)(void *, const void *, size_t) = INIT_ACCEL;
+
+static void init_accel(unsigned cache)
+{
+    void (*fn)(void *, const void *, size_t) = pkt_copy_int;
+    if (cache & CPUINFO_SSE2) {
+        fn = pkt_copy_sse2;
+    }
+#ifdef CONFIG_AVX2_OPT
+    if (cache & CPUINFO_AVX2) {
+        fn = pkt_copy_avx2;
+    }
+#ifdef CONFIG_AVX512F_OPT
+    if (cache & CPUINFO_AVX512F) {
+        fn = pkt_copy_avx512f;
+    }
+#endif
+#endif
+    pkt_copy_accel = fn;
+}
+
+#ifdef CONFIG_AVX2_OPT
+static void __attribute__((constructor)) init_cpuid_cache(void)
+{
+    cpuid_cache = cpuinfo_get() &
+                  (CPUINFO_SSE2 | CPUINFO_AVX2 | CPUINFO_AVX512F);
+    init_accel(cpuid_cache);
+}
+#endif /* CONFIG_AVX2_OPT */
+
+bool test_pkt_copy_next_accel(void)
+{
+    /* If no bits set, we just tested pkt_copy_int, and there
+       are no more acceleration options to test.  */
+    if (cpuid_cache == 0) {
+        return false;
+    }
+    /* Disable the accelerator we used before and select a new one.  */
+    cpuid_cache &= cpuid_cache - 1;
+    init_accel(cpuid_cache);
+    return true;
+}
+
+static void select_accel_fn(void *dst, const void *src, size_t len)
+{
+    if (likely(len >= 64)) {
+        pkt_copy_accel(dst, src, len);
+        return;
+    }
+    pkt_copy_int(dst, src, len);
+}
+
+#else
+#define select_accel_fn  pkt_copy_int
+bool test_pkt_copy_next_accel(void)
+{
+    return false;
+}
+#endif
+
+/*
+ * Copy a packet (or a fragment of it) between two non-overlapping buffers
+ */
+void pkt_copy(void *dst, const void *src, size_t len)
+{
+    select_accel_fn(dst, src, len);
+}
@@ -19,13 +19,18 @@
 #include "qemu/queue.h"
 #include "qemu/thread.h"
 #include "qemu/coroutine.h"
+#include "qemu/bitops.h"
+#include "qemu/host-utils.h"
 #include "trace.h"
 #include "block/thread-pool.h"
 #include "qemu/main-loop.h"
 
+#define THREAD_POOL_MAX_THREADS 64
+
 static void do_spawn_thread(ThreadPool *pool);
 
 typedef struct ThreadPoolElement ThreadPoolElement;
+typedef struct ThreadPoolWorker ThreadPoolWorker;
 
 enum ThreadState {
     THREAD_QUEUED,
@@ -36,21 +41,43 @@ enum ThreadState {
 struct ThreadPoolElement {
     BlockAIOCB common;
     ThreadPool *pool;
+    ThreadPoolWorker *worker;
     ThreadPoolFunc *func;
     void *arg;
 
-    /* Moving state out of THREAD_QUEUED is protected by lock.  After
-     * that, only the worker thread can write to it.  Reads and writes
-     * of state and ret are ordered with memory barriers.
+    /* Moving state out of THREAD_QUEUED is protected by worker->lock.
+     * After that, only the thread that runs the request can write to it.
+     * Reads and writes of state and ret are ordered with memory barriers.
      */
     enum ThreadState state;
     int ret;
 
-    /* Access to this list is protected by lock.  */
+    /* Access to this list is protected by worker->lock.  */
     QTAILQ_ENTRY(ThreadPoolElement) reqs;
 
-    /* Access to this list is protected by the global mutex.  */
-    QLIST_ENTRY(ThreadPoolElement) all;
+    /* Pushed atomically by the thread that ran the request.  */
+    QSLIST_ENTRY(ThreadPoolElement) next_done;
+
+    /* Access to this list is protected by the AioContext.  */
+    QSIMPLEQ_ENTRY(ThreadPoolElement) next_completed;
+};
+
+/* A worker slot.  At most one thread serves a slot at any time; idle
+ * threads exit, and the slot is restarted when a request is queued on it.
+ */
+struct ThreadPoolWorker {
+    ThreadPool *pool;
+    int index;
+    QemuSemaphore sem;
+
+    /* The following variables are protected by lock.  */
+    QemuSpin lock;
+    QTAILQ_HEAD(, ThreadPoolElement) request_list;
+    int queued;          /* length of request_list, also read atomically */
+    bool running;        /* a thread serves, or is being created for, us */
+
+    /* Requests completed by this worker, popped by the completion BH.  */
+    QSLIST_HEAD(, ThreadPoolElement) completed;
 };
 
 struct ThreadPool {
@@ -58,50 +85,139 @@ struct ThreadPool {
     QEMUBH *completion_bh;
     QemuMutex lock;
     QemuCond worker_stopped;
-    QemuSemaphore sem;
     int max_threads;
     QEMUBH *new_thread_bh;
 
     /* The following variables are only accessed from one AioContext. */
-    QLIST_HEAD(, ThreadPoolElement) head;
+    QSIMPLEQ_HEAD(, ThreadPoolElement) completed;
+    unsigned int in_flight;
+    int next_worker;
+
+    /* Workers waiting for a request.  A worker sets its own bit, whoever
+     * clears it must wake the worker up.
+     */
+    unsigned long idle_workers[BITS_TO_LONGS(THREAD_POOL_MAX_THREADS)];
+
+    /* Number of requests queued on all workers.  */
+    int queued;
 
     /* The following variables are protected by lock.  */
-    QTAILQ_HEAD(, ThreadPoolElement) request_list;
-    int cur_threads;
-    int idle_threads;
+    unsigned long new_workers[BITS_TO_LONGS(THREAD_POOL_MAX_THREADS)];
+    int cur_threads;     /* also read atomically by submitters */
     int new_threads;     /* backlog of threads we need to create */
     int pending_threads; /* threads created but not running yet */
-    bool stopping;
+    bool stopping;       /* also read atomically by workers */
+
+    ThreadPoolWorker workers[THREAD_POOL_MAX_THREADS];
 };
 
+static ThreadPoolElement *thread_pool_dequeue(ThreadPoolWorker *worker)
+{
+    ThreadPoolElement *req;
+
+    qemu_spin_lock(&worker->lock);
+    req = QTAILQ_FIRST(&worker->request_list);
+    if (req) {
+        QTAILQ_REMOVE(&worker->request_list, req, reqs);
+        atomic_set(&worker->queued, worker->queued - 1);
+        atomic_dec(&worker->pool->queued);
+        req->state = THREAD_ACTIVE;
+    }
+    qemu_spin_unlock(&worker->lock);
+    return req;
+}
+
+/* Take the oldest request queued on @worker, or steal one from another
+ * worker that is busy running a request.
+ */
+static ThreadPoolElement *thread_pool_get_request(ThreadPoolWorker *worker)
+{
+    ThreadPool *pool = worker->pool;
+    ThreadPoolElement *req = NULL;
+    int i;
+
+    if (atomic_read(&worker->queued)) {
+        req = thread_pool_dequeue(worker);
+    }
+    for (i = 1; !req && i < pool->max_threads; i++) {
+        ThreadPoolWorker *victim;
+
+        if (!atomic_read(&pool->queued)) {
+            break;
+        }
+        victim = &pool->workers[(worker->index + i) % pool->max_threads];
+        if (atomic_read(&victim->queued)) {
+            req = thread_pool_dequeue(victim);
+        }
+    }
+    return req;
+}
+
+/* Park an idle worker.  Returns false if the thread has been idle for too
+ * long and must exit.
+ */
+static bool thread_pool_worker_wait(ThreadPoolWorker *worker)
+{
+    ThreadPool *pool = worker->pool;
+    unsigned long *idle = &pool->idle_workers[BIT_WORD(worker->index)];
+    unsigned long mask = BIT_MASK(worker->index);
+    bool running;
+
+    atomic_or(idle, mask);
+
+    /* Write idle_workers before reading queued, pairs with the barrier in
+     * thread_pool_submit_aio().
+     */
+    smp_mb();
+    if (atomic_read(&pool->queued) || atomic_read(&pool->stopping)) {
+        atomic_and(idle, ~mask);
+        return true;
+    }
+
+    if (qemu_sem_timedwait(&worker->sem, 10000) == 0) {
+        /* Usually the submitter cleared our bit already, but the wakeup may
+         * be a stale one from a previous round.
+         */
+        atomic_and(idle, ~mask);
+        return true;
+    }
+
+    if (!(atomic_fetch_and(idle, ~mask) & mask)) {
+        /* A submitter picked us while we timed out, wakeup is on its way */
+        return true;
+    }
+
+    qemu_spin_lock(&worker->lock);
+    if (QTAILQ_EMPTY(&worker->request_list)) {
+        worker->running = false;
+    }
+    running = worker->running;
+    qemu_spin_unlock(&worker->lock);
+    return running;
+}
+
 static void *worker_thread(void *opaque)
 {
-    ThreadPool *pool = opaque;
+    ThreadPoolWorker *worker = opaque;
+    ThreadPool *pool = worker->pool;
 
     qemu_mutex_lock(&pool->lock);
     pool->pending_threads--;
     do_spawn_thread(pool);
+    qemu_mutex_unlock(&pool->lock);
 
-    while (!pool->stopping) {
+    while (!atomic_read(&pool->stopping)) {
         ThreadPoolElement *req;
         int ret;
 
-        do {
-            pool->idle_threads++;
-            qemu_mutex_unlock(&pool->lock);
-            ret = qemu_sem_timedwait(&pool->sem, 10000);
-            qemu_mutex_lock(&pool->lock);
-            pool->idle_threads--;
-        } while (ret == -1 && !QTAILQ_EMPTY(&pool->request_list));
-        if (ret == -1 || pool->stopping) {
-            break;
+        req = thread_pool_get_request(worker);
+        if (!req) {
+            if (!thread_pool_worker_wait(worker)) {
+                break;
+            }
+            continue;
         }
 
-        req = QTAILQ_FIRST(&pool->request_list);
-        QTAILQ_REMOVE(&pool->request_list, req, reqs);
-        req->state = THREAD_ACTIVE;
-        qemu_mutex_unlock(&pool->lock);
-
         ret = req->func(req->arg);
 
         req->ret = ret;
@@ -109,12 +225,12 @@ static void *worker_thread(void *opaque)
         smp_wmb();
         req->state = THREAD_DONE;
 
-        qemu_mutex_lock(&pool->lock);
-
+        QSLIST_INSERT_HEAD_ATOMIC(&worker->completed, req, next_done);
         qemu_bh_schedule(pool->completion_bh);
     }
 
-    pool->cur_threads--;
+    qemu_mutex_lock(&pool->lock);
+    atomic_set(&pool->cur_threads, pool->cur_threads - 1);
     qemu_cond_signal(&pool->worker_stopped);
     qemu_mutex_unlock(&pool->lock);
     return NULL;
@@ -123,16 +239,20 @@ static void *worker_thread(void *opaque)
 static void do_spawn_thread(ThreadPool *pool)
 {
     QemuThread t;
+    int i;
 
     /* Runs with lock taken.  */
     if (!pool->new_threads) {
         return;
     }
 
+    i = find_first_bit(pool->new_workers, pool->max_threads);
+    clear_bit(i, pool->new_workers);
     pool->new_threads--;
     pool->pending_threads++;
 
-    qemu_thread_create(&t, "worker", worker_thread, pool, QEMU_THREAD_DETACHED);
+    qemu_thread_create(&t, "worker", worker_thread, &pool->workers[i],
+                       QEMU_THREAD_DETACHED);
 }
 
 static void spawn_thread_bh_fn(void *opaque)
@@ -144,10 +264,12 @@ static void spawn_thread_bh_fn(void *opaque)
     qemu_mutex_unlock(&pool->lock);
 }
 
-static void spawn_thread(ThreadPool *pool)
+static void spawn_thread(ThreadPool *pool, ThreadPoolWorker *worker)
 {
-    pool->cur_threads++;
+    qemu_mutex_lock(&pool->lock);
+    atomic_set(&pool->cur_threads, pool->cur_threads + 1);
     pool->new_threads++;
+    set_bit(worker->index, pool->new_workers);
     /* If there are threads being created, they will spawn new workers, so
      * we don't spend time creating many threads in a loop holding a mutex or
      * starving the current vcpu.
@@ -158,23 +280,55 @@ static void spawn_thread(ThreadPool *pool)
     if (!pool->pending_threads) {
         qemu_bh_schedule(pool->new_thread_bh);
     }
+    qemu_mutex_unlock(&pool->lock);
+}
+
+/* Move the requests completed by the workers to pool->completed, oldest
+ * first.
+ */
+static void thread_pool_collect_completions(ThreadPool *pool)
+{
+    int i;
+
+    for (i = 0; i < pool->max_threads; i++) {
+        ThreadPoolWorker *worker = &pool->workers[i];
+        QSLIST_HEAD(, ThreadPoolElement) done;
+        QSIMPLEQ_HEAD(, ThreadPoolElement) batch =
+            QSIMPLEQ_HEAD_INITIALIZER(batch);
+        ThreadPoolElement *elem;
+
+        if (!atomic_read(&worker->completed.slh_first)) {
+            continue;
+        }
+
+        QSLIST_MOVE_ATOMIC(&done, &worker->completed);
+        while ((elem = QSLIST_FIRST(&done))) {
+            QSLIST_REMOVE_HEAD(&done, next_done);
+            QSIMPLEQ_INSERT_HEAD(&batch, elem, next_completed);
+        }
+        QSIMPLEQ_CONCAT(&pool->completed, &batch);
+    }
 }
 
 static void thread_pool_completion_bh(void *opaque)
 {
     ThreadPool *pool = opaque;
-    ThreadPoolElement *elem, *next;
+    ThreadPoolElement *elem;
 
     aio_context_acquire(pool->ctx);
-restart:
-    QLIST_FOREACH_SAFE(elem, &pool->head, all, next) {
-        if (elem->state != THREAD_DONE) {
-            continue;
+    for (;;) {
+        if (QSIMPLEQ_EMPTY(&pool->completed)) {
+            thread_pool_collect_completions(pool);
+        }
+        elem = QSIMPLEQ_FIRST(&pool->completed);
+        if (!elem) {
+            break;
         }
 
+        QSIMPLEQ_REMOVE_HEAD(&pool->completed, next_completed);
+        pool->in_flight--;
         trace_thread_pool_complete(pool, elem, elem->common.opaque,
                                    elem->ret);
-        QLIST_REMOVE(elem, all);
 
         if (elem->common.cb) {
             /* Read state before ret.  */
@@ -190,16 +344,12 @@ restart:
             aio_context_acquire(pool->ctx);
 
             /* We can safely cancel the completion_bh here regardless of someone
-             * else having scheduled it meanwhile because we reenter the
-             * completion function anyway (goto restart).
+             * else having scheduled it meanwhile because we look for new
+             * completions before leaving the loop.
              */
             qemu_bh_cancel(pool->completion_bh);
-
-            qemu_aio_unref(elem);
-            goto restart;
-        } else {
-            qemu_aio_unref(elem);
         }
+        qemu_aio_unref(elem);
     }
     aio_context_release(pool->ctx);
 }
@@ -208,25 +358,25 @@ static void thread_pool_cancel(BlockAIOCB *acb)
 {
     ThreadPoolElement *elem = (ThreadPoolElement *)acb;
     ThreadPool *pool = elem->pool;
+    ThreadPoolWorker *worker = elem->worker;
 
     trace_thread_pool_cancel(elem, elem->common.opaque);
 
-    qemu_mutex_lock(&pool->lock);
-    if (elem->state == THREAD_QUEUED &&
-        /* No thread has yet started working on elem. we can try to "steal"
-         * the item from the worker if we can get a signal from the
-         * semaphore.  Because this is non-blocking, we can do it with
-         * the lock taken and ensure that elem will remain THREAD_QUEUED.
+    qemu_spin_lock(&worker->lock);
+    if (elem->state == THREAD_QUEUED) {
+        /* No thread has yet started working on elem, and none can while
+         * we hold the lock of the worker it is queued on.
          */
-        qemu_sem_timedwait(&pool->sem, 0) == 0) {
-        QTAILQ_REMOVE(&pool->request_list, elem, reqs);
-        qemu_bh_schedule(pool->completion_bh);
+        QTAILQ_REMOVE(&worker->request_list, elem, reqs);
+        atomic_set(&worker->queued, worker->queued - 1);
+        atomic_dec(&pool->queued);
 
         elem->state = THREAD_DONE;
         elem->ret = -ECANCELED;
+        QSIMPLEQ_INSERT_TAIL(&pool->completed, elem, next_completed);
+        qemu_bh_schedule(pool->completion_bh);
     }
-
-    qemu_mutex_unlock(&pool->lock);
+    qemu_spin_unlock(&worker->lock);
 }
 
 static AioContext *thread_pool_get_aio_context(BlockAIOCB *acb)
@@ -242,11 +392,43 @@ static const AIOCBInfo thread_pool_aiocb_info = {
     .get_aio_context    = thread_pool_get_aio_context,
 };
 
+/* Pick the worker for a new request: an idle one if possible, then a slot
+ * without a thread while the pool can grow, and finally a busy worker
+ * whose queue idle workers will steal from.
+ */
+static ThreadPoolWorker *thread_pool_pick_worker(ThreadPool *pool)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(pool->idle_workers); i++) {
+        unsigned long idle = atomic_read(&pool->idle_workers[i]);
+
+        if (idle) {
+            return &pool->workers[i * BITS_PER_LONG + ctzl(idle)];
+        }
+    }
+
+    if (atomic_read(&pool->cur_threads) < pool->max_threads) {
+        for (i = 0; i < pool->max_threads; i++) {
+            if (!atomic_read(&pool->workers[i].running)) {
+                return &pool->workers[i];
+            }
+        }
+    }
+
+    pool->next_worker = (pool->next_worker + 1) % pool->max_threads;
+    return &pool->workers[pool->next_worker];
+}
+
 BlockAIOCB *thread_pool_submit_aio(ThreadPool *pool,
         ThreadPoolFunc *func, void *arg,
         BlockCompletionFunc *cb, void *opaque)
 {
     ThreadPoolElement *req;
+    ThreadPoolWorker *worker;
+    unsigned long *idle;
+    unsigned long mask;
+    bool start;
 
     req = qemu_aio_get(&thread_pool_aiocb_info, NULL, cb, opaque);
     req->func = func;
@@ -254,17 +436,36 @@ BlockAIOCB *thread_pool_submit_aio(ThreadPool *pool,
     req->state = THREAD_QUEUED;
     req->pool = pool;
 
-    QLIST_INSERT_HEAD(&pool->head, req, all);
+    pool->in_flight++;
 
     trace_thread_pool_submit(pool, req, arg);
 
-    qemu_mutex_lock(&pool->lock);
-    if (pool->idle_threads == 0 && pool->cur_threads < pool->max_threads) {
-        spawn_thread(pool);
+    worker = thread_pool_pick_worker(pool);
+    req->worker = worker;
+
+    atomic_inc(&pool->queued);
+    qemu_spin_lock(&worker->lock);
+    QTAILQ_INSERT_TAIL(&worker->request_list, req, reqs);
+    atomic_set(&worker->queued, worker->queued + 1);
+    start = !worker->running;
+    atomic_set(&worker->running, true);
+    qemu_spin_unlock(&worker->lock);
+
+    if (start) {
+        spawn_thread(pool, worker);
+        return &req->common;
+    }
+
+    /* Write queued before reading idle_workers, pairs with the barrier in
+     * thread_pool_worker_wait().  Busy workers are never woken up, so a
+     * burst of requests costs at most one wakeup per idle worker.
+     */
+    smp_mb();
+    idle = &pool->idle_workers[BIT_WORD(worker->index)];
+    mask = BIT_MASK(worker->index);
+    if ((atomic_read(idle) & mask) && (atomic_fetch_and(idle, ~mask) & mask)) {
+        qemu_sem_post(&worker->sem);
     }
-    QTAILQ_INSERT_TAIL(&pool->request_list, req, reqs);
-    qemu_mutex_unlock(&pool->lock);
-    qemu_sem_post(&pool->sem);
     return &req->common;
 }
 
@@ -298,6 +499,8 @@ void thread_pool_submit(ThreadPool *pool, ThreadPoolFunc *func, void *arg)
 
 static void thread_pool_init_one(ThreadPool *pool, AioContext *ctx)
 {
+    int i;
+
     if (!ctx) {
         ctx = qemu_get_aio_context();
     }
@@ -307,12 +510,20 @@ static void thread_pool_init_one(ThreadPool *pool, AioContext *ctx)
     pool->completion_bh = aio_bh_new(ctx, thread_pool_completion_bh, pool);
     qemu_mutex_init(&pool->lock);
     qemu_cond_init(&pool->worker_stopped);
-    qemu_sem_init(&pool->sem, 0);
-    pool->max_threads = 64;
+    pool->max_threads = THREAD_POOL_MAX_THREADS;
     pool->new_thread_bh = aio_bh_new(ctx, spawn_thread_bh_fn, pool);
 
-    QLIST_INIT(&pool->head);
-    QTAILQ_INIT(&pool->request_list);
+    QSIMPLEQ_INIT(&pool->completed);
+    for (i = 0; i < pool->max_threads; i++) {
+        ThreadPoolWorker *worker = &pool->workers[i];
+
+        worker->pool = pool;
+        worker->index = i;
+        qemu_sem_init(&worker->sem, 0);
+        qemu_spin_init(&worker->lock);
+        QTAILQ_INIT(&worker->request_list);
+        QSLIST_INIT(&worker->completed);
+    }
 }
 
 ThreadPool *thread_pool_new(AioContext *ctx)
@@ -324,30 +535,36 @@ ThreadPool *thread_pool_new(AioContext *ctx)
 
 void thread_pool_free(ThreadPool *pool)
 {
+    int i;
+
     if (!pool) {
         return;
     }
 
-    assert(QLIST_EMPTY(&pool->head));
+    assert(!pool->in_flight);
 
     qemu_mutex_lock(&pool->lock);
 
     /* Stop new threads from spawning */
     qemu_bh_delete(pool->new_thread_bh);
-    pool->cur_threads -= pool->new_threads;
+    atomic_set(&pool->cur_threads, pool->cur_threads - pool->new_threads);
     pool->new_threads = 0;
 
     /* Wait for worker threads to terminate */
-    pool->stopping = true;
+    atomic_set(&pool->stopping, true);
     while (pool->cur_threads > 0) {
-        qemu_sem_post(&pool->sem);
+        for (i = 0; i < pool->max_threads; i++) {
+            qemu_sem_post(&pool->workers[i].sem);
+        }
         qemu_cond_wait(&pool->worker_stopped, &pool->lock);
     }
 
     qemu_mutex_unlock(&pool->lock);
 
     qemu_bh_delete(pool->completion_bh);
-    qemu_sem_destroy(&pool->sem);
+    for (i = 0; i < pool->max_threads; i++) {
+        qemu_sem_destroy(&pool->workers[i].sem);
+    }
     qemu_cond_destroy(&pool->worker_stopped);
     qemu_mutex_destroy(&pool->lock);
     g_free(pool);